@@ -2,6 +2,10 @@
 import os
 
 PATH_NAME = 256
+# the size of the packed header: path, length and the list linkage
+FILE_HEADER_SIZE = PATH_NAME + 12
+# the content of each file starts at a page boundary of the drive
+FILE_CONTENT_ALIGN = 4096
 
 def int32_to_array(val):
     arr = bytearray(4)
@@ -25,6 +29,8 @@ def write_drive_file(_file_dst, _path):
     name = bytearray(PATH_NAME)
     size = os.path.getsize(_path)
     string_to_array(name, _path.lstrip('.'))
+    padding = -(_file_dst.tell() + FILE_HEADER_SIZE) % FILE_CONTENT_ALIGN
+    _file_dst.write(bytearray(padding))
     _file_dst.write(name)
     _file_dst.write(int32_to_array(size))
     _file_dst.write(int32_to_array(0))
@@ -41,6 +41,13 @@ state_to_string(int state)
     return ret;
 }
 
+// the scheduling classes in kernel/include/task.h
+static char *
+sched_class_to_string(int sched_class)
+{
+    return sched_class == 0 ? "K" : "N";
+}
+
 int
 main(int argc, char * argv[])
 {
@@ -48,12 +55,22 @@ main(int argc, char * argv[])
     struct taskent * taskp = malloc(MAX_TASKENT * sizeof(struct taskent));
     int32_t nr_task = 0;
     nr_task = gettaskents(taskp, MAX_TASKENT);
+    printf("%5s %-14s   %-10s %-3s %3s %5s %8s %8s %-25s %-25s %-25s\n",
+        "PID", "ENTRY", "SCHED", "CLS", "PRI", "%CPU", "RSS(KB)", "VSZ(KB)",
+        "NAME", "STATE", "CWD");
     for (idx = 0; idx < nr_task; idx++) {
-        printf("%5d PL%d:0x%-8x   %-10d %-25s %-25s %-25s\n",
+        printf("%5d PL%d:0x%-8x   %-10d %-3s %3d %3d.%d %8d %8d "
+            "%-25s %-25s %-25s\n",
             taskp[idx].task_id,
             taskp[idx].privilege_level,
             taskp[idx].entry,
             taskp[idx].schedule_counter,
+            sched_class_to_string(taskp[idx].sched_class),
+            taskp[idx].priority,
+            taskp[idx].cpu_usage / 10,
+            taskp[idx].cpu_usage % 10,
+            taskp[idx].resident_size / 1024,
+            taskp[idx].virtual_size / 1024,
             taskp[idx].name,
             state_to_string(taskp[idx].state),
             taskp[idx].cwd);
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <stdio.h>
+#include <builtin.h>
+#include <zelda.h>
+#include <stdlib.h>
+
+static void
+print_usage(void)
+{
+    printf("usage:/usr/bin/renice priority pid\n");
+    printf("the priority is from %d(highest) to %d(lowest)\n",
+        TASK_PRIORITY_HIGHEST, TASK_PRIORITY_LOWEST);
+}
+
+int
+main(int argc, char * argv[])
+{
+    int32_t priority = 0;
+    int32_t task_id = -1;
+    int32_t result = 0;
+    if (argc < 3) {
+        print_usage();
+        exit(-1);
+    }
+    priority = atoi(argv[1]);
+    task_id = atoi(argv[2]);
+    result = settaskpriority(task_id, priority);
+    if (result) {
+        printf("error:%d in setting priority:%d of task:%d\n",
+            result, priority, task_id);
+    }
+    return 0;
+}
@@ -7,6 +7,7 @@
 // https://wiki.osdev.org/PS2_Keyboard#Scan_Code_Set_1
 
 #define SCANCODE_C          0x2e
+#define SCANCODE_M          0x32
 #define SCANCODE_BACKSPACE  0x0e
 #define SCANCODE_F1         0x3b
 #define SCANCODE_F2         (SCANCODE_F1 + 1)
@@ -14,6 +14,11 @@
 #include <lib/include/string.h>
 #include <lib/include/errorcode.h>
 #include <memory/include/paging.h>
+#include <memory/include/malloc.h>
+#include <memory/include/slab.h>
+#include <memory/include/buddy.h>
+#include <memory/include/shrinker.h>
+#include <kernel/include/image_cache.h>
 #include <device/include/pseudo_terminal.h>
 
 #define KEYBOARD_INTERRUPT_VECTOR (0x20 + 1)
@@ -206,6 +211,17 @@ void CTRL_ALT_DELETE(void * arg __used)
     dump_registers();
 }
 
+void CTRL_ALT_M(void * arg __used)
+{
+    dump_buddy_free_areas();
+    dump_page_frame_summary();
+    dump_malloc_stat();
+    dump_zeroed_page_stat();
+    dump_image_cache_stat();
+    dump_kmem_caches();
+    dump_shrinkers();
+}
+
 void
 keyboard_init(void)
 {
@@ -220,6 +236,10 @@ keyboard_init(void)
         KEY_STATE_CONTROLL_PRESSED|KEY_STATE_ALT_PRESSED,
         CTRL_ALT_DELETE,
         NULL);
+    register_shortcut_entry(SCANCODE_M,
+        KEY_STATE_CONTROLL_PRESSED|KEY_STATE_ALT_PRESSED,
+        CTRL_ALT_M,
+        NULL);
     /*
      * please refer to https://en.wikipedia.org/wiki/ASCII
      */
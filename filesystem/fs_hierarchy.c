@@ -4,7 +4,24 @@
 #include <filesystem/include/fs_hierarchy.h>
 #include <lib/include/string.h>
 #include <kernel/include/printk.h>
-#include <memory/include/malloc.h>
+#include <memory/include/slab.h>
+
+static struct kmem_cache * file_cache;
+
+/*
+ * allocate a file node from file cache, return NULL upon memory outage
+ */
+struct file *
+malloc_file(void)
+{
+    return kmem_cache_alloc(file_cache);
+}
+
+void
+free_file(struct file * file)
+{
+    kmem_cache_free(file_cache, file);
+}
 
 /*
  * Create the vertical directory on the root_node
@@ -40,7 +57,7 @@ hierarchy_create_directory(struct generic_tree * root_node,
             current_node = &_file->fs_node;
         } else {
             // The directory does not exist, Try to create one.
-            _file = malloc(sizeof(struct file));
+            _file = malloc_file();
             if (!_file) {
                 LOG_TRIVIA("Can not allocate file descriptor\n");
                 return -ERR_OUT_OF_MEMORY;
@@ -57,7 +74,7 @@ hierarchy_create_directory(struct generic_tree * root_node,
         ASSERT(_file);
         if (!current_node->left) {
             // No child on current node
-            struct file * _file_another = malloc(sizeof(struct file));
+            struct file * _file_another = malloc_file();
             if (!_file_another) {
                 LOG_TRIVIA("Can not allocate another file descriptor\n");
                 return -ERR_OUT_OF_MEMORY;
@@ -114,7 +131,11 @@ hierarchy_create_file(struct generic_tree * root_node,
         return -ERR_EXIST;
     } else {
         // File not exist, try to create one
-        _file = malloc(sizeof(struct file));
+        _file = malloc_file();
+        if (!_file) {
+            LOG_TRIVIA("Can not allocate file descriptor\n");
+            return -ERR_OUT_OF_MEMORY;
+        }
         memset(_file, 0x0, sizeof(struct file));
         strcpy_safe(_file->name, splitted_path[iptr -1], sizeof(_file->name));
         _file->type = FILE_TYPE_REGULAR;
@@ -197,3 +218,12 @@ hierarchy_delete_file(struct generic_tree * root_node,
     }
     return OK;
 }
+
+void
+fs_hierarchy_init(void)
+{
+    file_cache = kmem_cache_create((const uint8_t *)"file",
+        sizeof(struct file),
+        sizeof(uint32_t));
+    ASSERT(file_cache);
+}
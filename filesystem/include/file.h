@@ -27,12 +27,17 @@ struct file {
     void * priv;
 };
 
-// The per-task definition of file entry 
+/*
+ * The per-task definition of file entry, i.e. the open file description a
+ * file descriptor refers to. It's shared
+ * by the file descriptors duplicated by fork(), so is the offset.
+ */
 struct file_entry {
     struct file * file;
     uint32_t offset; 
     uint32_t valid:1;
     uint32_t writable:1; 
+    uint32_t refer_count;
 };
 
 /*
@@ -46,9 +51,15 @@ struct file_operation {
     int32_t (*size)(struct file * _file);
     int32_t (*stat)(struct file * _file, struct stat * stat);
     int32_t (*read)(struct file * _file, uint32_t offset, void * buffer, int size);
+    // NULL if the file can not be written, e.g. a read-only filesystem.
     int32_t (*write)(struct file * _file, uint32_t offset, void * buffer, int size);
     int32_t (*truncate)(struct file * _file, int offset);
     int32_t (*ioctl)(struct file * _file, uint32_t request, void * foo, void * bar);
+    /*
+     * optional, return the physical frame which holds the file content at
+     * the page aligned offset, 0 if the content is not resident in a frame.
+     */
+    uint32_t (*page_frame)(struct file * _file, uint32_t offset);
 };
 
 #endif 
@@ -28,4 +28,12 @@ hierarchy_delete_file(struct generic_tree * root_node,
     int32_t iptr,
     void (*per_file_free)(struct file *));
 
+struct file *
+malloc_file(void);
+
+void
+free_file(struct file * file);
+
+void
+fs_hierarchy_init(void);
 #endif
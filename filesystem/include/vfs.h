@@ -38,6 +38,23 @@ split_path(uint8_t * path,
 int32_t
 do_vfs_close(struct file * file);
 
+/*
+ * allocate an open file description for an opened file, the reference taken
+ * by do_vfs_open() is transferred to it.
+ */
+struct file_entry *
+malloc_file_entry(struct file * file, uint32_t writable);
+
+struct file_entry *
+get_file_entry(struct file_entry * entry);
+
+/*
+ * drop a reference to the open file description, the file is closed when
+ * the last one is dropped, return the result of closing.
+ */
+int32_t
+put_file_entry(struct file_entry * entry);
+
 int32_t
 do_vfs_read(struct file_entry * entry,
     void * buffer,
@@ -11,6 +11,12 @@
     #error "Not Supported outside of kernel space."
 #endif
 
+/*
+ * The content of each file is aligned to ZELDA_FILE_CONTENT_ALIGN relative to
+ * the start of the drive, which is page aligned. the header is put right
+ * before the content, the gap before the header is zero padded.
+ */
+#define ZELDA_FILE_CONTENT_ALIGN 4096
 struct zelda_file {
     uint8_t path[256];
     uint32_t length;
@@ -184,7 +184,7 @@ __delete_file_entry(struct file * file)
         file->type == FILE_TYPE_MARK ? "FILE_TYPE_MARK" :
             file->type == FILE_TYPE_DIR ? "FILE_TYPE_DIR" :
             "FILE_TYPE_REGULAR");
-    free(file);
+    free_file(file);
 }
 
 static int32_t 
@@ -8,6 +8,9 @@
 #include <kernel/include/printk.h>
 #include <lib/include/string.h>
 #include <kernel/include/zelda_posix.h>
+#include <filesystem/include/fs_hierarchy.h>
+#include <memory/include/malloc.h>
+#include <kernel/include/image_cache.h>
 
 static struct mount_entry mount_entries[MOUNT_ENTRY_SIZE];
 
@@ -267,6 +270,7 @@ test_vfs(void)
 void
 vfs_init(void)
 {
+    fs_hierarchy_init();
 #if defined(INLINE_TEST)
     //test_vfs();
 #endif
@@ -348,6 +352,40 @@ do_vfs_close(struct file * file)
     return OK;
 }
 
+struct file_entry *
+malloc_file_entry(struct file * file, uint32_t writable)
+{
+    struct file_entry * entry = malloc(sizeof(struct file_entry));
+    if (entry) {
+        memset(entry, 0x0, sizeof(struct file_entry));
+        entry->file = file;
+        entry->valid = 1;
+        entry->writable = writable ? 1 : 0;
+        entry->refer_count = 1;
+    }
+    return entry;
+}
+
+struct file_entry *
+get_file_entry(struct file_entry * entry)
+{
+    ASSERT(entry->refer_count);
+    entry->refer_count++;
+    return entry;
+}
+
+int32_t
+put_file_entry(struct file_entry * entry)
+{
+    int32_t ret;
+    ASSERT(entry->refer_count);
+    if (--entry->refer_count)
+        return OK;
+    ret = do_vfs_close(entry->file);
+    free(entry);
+    return ret;
+}
+
 /*
  * the VFS layer raw interface to read file
  * the return value is categorized into three:
@@ -381,8 +419,7 @@ do_vfs_write(struct file_entry * entry,
 {
     int32_t result = 0;
     ASSERT(entry->file->ops);
-    ASSERT(entry->file->ops->write);
-    if (!entry->writable) {
+    if (!entry->writable || !entry->file->ops->write) {
         return -ERR_NOT_SUPPORTED;
     }
     result = entry->file->ops->write(
@@ -391,6 +428,7 @@ do_vfs_write(struct file_entry * entry,
         buffer,
         size);
     if (result > 0) {
+        image_cache_invalidate(entry->file, entry->offset, result);
         entry->offset += result;
     }
     return result;
@@ -426,11 +464,15 @@ do_vfs_lseek(struct file_entry * entry, uint32_t offset, uint32_t whence)
 int32_t
 do_vfs_truncate(struct file_entry * entry, uint32_t offset)
 {
+    int32_t result;
     ASSERT(entry->file->ops);
     if (!entry->file->ops->truncate) {
         return -ERR_NOT_SUPPORTED;
     }
-    return entry->file->ops->truncate(entry->file, offset);
+    result = entry->file->ops->truncate(entry->file, offset);
+    if (result == OK)
+        image_cache_invalidate(entry->file, offset, (uint32_t)-1 - offset);
+    return result;
 }
 
 /*
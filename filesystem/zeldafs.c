@@ -10,6 +10,7 @@
 #include <kernel/include/task.h>
 #include <filesystem/include/vfs.h>
 #include <memory/include/malloc.h>
+#include <memory/include/paging.h>
 #include <filesystem/include/fs_hierarchy.h>
 
 static uint32_t zelda_drive_start = (uint32_t)&_zelda_drive_start;
@@ -39,10 +40,22 @@ zeldafs_file_read(struct file * file, uint32_t offset, void * buffer, int size)
     return length_available;
 }
 
-static int32_t
-zeldafs_file_write(struct file * file, uint32_t offset, void * buffer, int size)
+/*
+ * The drive resides in kernel image which is identically mapped, the content
+ * page can be mapped into userspace directly.
+ */
+static uint32_t
+zeldafs_file_page_frame(struct file * file, uint32_t offset)
 {
-    return -ERR_NOT_SUPPORTED;
+    struct zelda_file * zelda_file = file->priv;
+    uint32_t addr;
+    ASSERT(zelda_file);
+    if (offset >= zelda_file->length)
+        return 0;
+    addr = (uint32_t)zelda_file->content + offset;
+    if (addr & PAGE_MASK)
+        return 0;
+    return addr;
 }
 
 static int32_t
@@ -63,9 +76,9 @@ zeldafs_file_stat(struct file * file, struct stat * buf)
 }
 struct file_operation zeldafs_file_ops = {
     .read = zeldafs_file_read,
-    .write = zeldafs_file_write,
     .size = zeldafs_file_size,
     .stat = zeldafs_file_stat,
+    .page_frame = zeldafs_file_page_frame,
 };
 struct zelda_file *
 search_zelda_file(char * name)
@@ -226,7 +239,15 @@ enumerate_files_in_zelda_drive(void)
 {
     struct zelda_file * _file = NULL;
     uint32_t iptr = zelda_drive_start;
+    uint32_t offset;
     for(; iptr < zelda_drive_end;) {
+        // skip the padding before the header
+        offset = iptr - zelda_drive_start + sizeof(struct zelda_file);
+        offset = (offset + ZELDA_FILE_CONTENT_ALIGN - 1) &
+            ~(ZELDA_FILE_CONTENT_ALIGN - 1);
+        iptr = zelda_drive_start + offset - sizeof(struct zelda_file);
+        if ((iptr + sizeof(struct zelda_file)) > zelda_drive_end)
+            break;
         _file = (struct zelda_file *)iptr; 
         _file->list.next = NULL;
         _file->list.prev = NULL;
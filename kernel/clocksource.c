@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <kernel/include/clocksource.h>
+#include <kernel/include/jiffies.h>
+#include <kernel/include/printk.h>
+#include <x86/include/interrupt.h>
+
+static uint64_t
+jiffies_read(void)
+{
+    return jiffies;
+}
+
+static struct clocksource jiffies_clocksource = {
+    .name = "jiffies",
+    .read = jiffies_read,
+    .khz = HZ / 1000,
+    .rating = 1,
+};
+
+static struct clocksource * clocksource = &jiffies_clocksource;
+// the monotonic time and the counter value when the clocksource was switched
+static uint64_t clock_base_ns = 0;
+static uint64_t clock_base_cycles = 0;
+
+uint64_t
+ktime_get_ns(void)
+{
+    uint64_t now;
+    uint32_t eflags = local_irq_save();
+    now = clock_base_ns + clocksource_cyc2ns(
+        clocksource->read() - clock_base_cycles,
+        clocksource->khz);
+    local_irq_restore(eflags);
+    return now;
+}
+
+void
+register_clocksource(struct clocksource * _clocksource)
+{
+    uint32_t eflags;
+    ASSERT(_clocksource->read);
+    ASSERT(_clocksource->khz);
+    if (_clocksource->rating <= clocksource->rating)
+        return;
+    eflags = local_irq_save();
+    clock_base_ns = ktime_get_ns();
+    clock_base_cycles = _clocksource->read();
+    clocksource = _clocksource;
+    local_irq_restore(eflags);
+    LOG_INFO("Switch clocksource to %s(%d KHz)\n",
+        clocksource->name, clocksource->khz);
+}
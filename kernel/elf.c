@@ -9,6 +9,7 @@
 #include <x86/include/gdt.h>
 #include <lib/include/string.h>
 #include <memory/include/paging.h>
+#include <filesystem/include/vfs.h>
 
 /*
  * This is to validate the content to check whther it's a legal elf32 statically 
@@ -39,7 +40,7 @@ validate_static_elf32_format(uint8_t * mem, int32_t length)
     for (idx = 0; idx < elf_hdr->e_phnum; idx++) {
         program_hdr = (struct elf32_program_header *)(mem + elf_hdr->e_phoff
             + idx * sizeof(struct elf32_program_header));
-        _((program_hdr->p_offset + program_hdr->p_filesz) < length);
+        _(((uint64_t)program_hdr->p_offset + program_hdr->p_filesz) < length);
         if (program_hdr->p_type == PROGRAM_TYPE_LOAD) {
             _(((uint64_t)(program_hdr->p_vaddr)) >= USERSPACE_BOTTOM);
             _(((uint64_t)(program_hdr->p_vaddr) + program_hdr->p_memsz)
@@ -177,7 +178,10 @@ resolve_commands(uint32_t pl3_stack_top, uint8_t * command, uint8_t ** program)
  * XXX: maskable interrupt must be disabled in caller. 
  */
 int32_t
-load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
+load_static_elf32(uint8_t * mem,
+    struct file * file,
+    uint8_t * command,
+    uint32_t * ptask_id)
 {
     int rc = 0;
     int idx = 0;
@@ -242,7 +246,7 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
      * this also includes kernel's 1G space.
      */
     //kernelspace.vma VMA setup
-    _vma = malloc(sizeof(struct vm_area));
+    _vma = malloc_vm_area();
     if (!_vma) {
         LOG_DEBUG("Can not allocate memory for VM area\n");
         ret = -ERR_OUT_OF_MEMORY;
@@ -260,7 +264,8 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
     _vma->virt_addr = 0;
     _vma->phy_addr = 0;
     _vma->length = KERNELSPACE_TOP;
-    list_append(&_task->vma_list, &_vma->list);
+    if (attach_vm_area(&_task->vma_list, &_task->vma_tree, _vma))
+        goto vma_overlap;
     //USER_VMA_TEXT_AND_DATA.0.....n
     for (idx = 0; idx < elf_hdr->e_phnum; idx++) {
         program_hdr = (struct elf32_program_header *)(mem + elf_hdr->e_phoff
@@ -271,7 +276,7 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
             (uint64_t)(program_hdr->p_vaddr + program_hdr->p_memsz))
             heap_start = program_hdr->p_vaddr + program_hdr->p_memsz;
         ASSERT(!(program_hdr->p_vaddr & PAGE_MASK));
-        _vma = malloc(sizeof(struct vm_area));
+        _vma = malloc_vm_area();
         if (!_vma) {
             LOG_DEBUG("Can not allocate memory for VM area");
             ret = -ERR_OUT_OF_MEMORY;
@@ -282,30 +287,34 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
             USER_VMA_TEXT_AND_DATA, _text_and_data_counter++);
         strcpy_safe(_vma->name, (uint8_t *)_text_and_data_vma_name,
             sizeof(_vma->name));
+        /*
+         * The program segment is backed by the executable file, its pages
+         * are filled at the first access.
+         */
         _vma->kernel_vma = 0;
-        _vma->pre_map = 1;
+        _vma->pre_map = 0;
         _vma->exact = 0;
         _vma->page_writethrough = PAGE_WRITEBACK;
         _vma->page_cachedisable = PAGE_CACHE_ENABLED;
-        _vma->write_permission = PAGE_PERMISSION_READ_WRITE;
-        /*
-         * Temporarily make any text&data vma writable.
-         * after copying the program segmet, re-map it as needed.
-         */
-        //_vma->write_permission = program_hdr->p_flags & PROGRAM_WRITE ?
-        //    PAGE_PERMISSION_READ_WRITE : PAGE_PERMISSION_READ_ONLY;
+        _vma->write_permission = program_hdr->p_flags & PROGRAM_WRITE ?
+            PAGE_PERMISSION_READ_WRITE : PAGE_PERMISSION_READ_ONLY;
         _vma->executable = program_hdr->p_flags & PROGRAM_EXECUTE ? 1 : 0;
         _vma->virt_addr = program_hdr->p_vaddr;
         _vma->phy_addr = program_hdr->p_paddr;
         _vma->length = program_hdr->p_memsz;
         _vma->length = _vma->length & PAGE_MASK ?
             (_vma->length & (~PAGE_MASK)) + PAGE_SIZE : _vma->length;
-        list_append(&_task->vma_list, &_vma->list);
+        _vma->file = file;
+        _vma->file_offset = program_hdr->p_offset;
+        _vma->file_size = program_hdr->p_filesz;
+        file->refer_count++;
+        if (attach_vm_area(&_task->vma_list, &_task->vma_tree, _vma))
+            goto vma_overlap;
     }
     // USER_VMA_HEAP vma setup
     heap_start = heap_start & PAGE_MASK ? 
         (heap_start & (~PAGE_MASK)) + PAGE_SIZE : heap_start;
-    _vma = malloc(sizeof(struct vm_area));
+    _vma = malloc_vm_area();
     if (!_vma) {
         LOG_DEBUG("Can not allocate memory for VM area");
         ret = -ERR_OUT_OF_MEMORY;
@@ -323,9 +332,10 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
     _vma->virt_addr = heap_start;
     _vma->phy_addr = 0;
     _vma->length = 0;
-    list_append(&_task->vma_list, &_vma->list);
+    if (attach_vm_area(&_task->vma_list, &_task->vma_tree, _vma))
+        goto vma_overlap;
     // USER_VMA_STACK vma setup
-    _vma = malloc(sizeof(struct vm_area));
+    _vma = malloc_vm_area();
     if (!_vma) {
         LOG_DEBUG("Can not allocate memory for VM area");
         ret = -ERR_OUT_OF_MEMORY;
@@ -344,9 +354,10 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
         DEFAULT_TASK_NON_PRIVILEGED_STACK_SIZE;
     _vma->phy_addr = 0;
     _vma->length = DEFAULT_TASK_NON_PRIVILEGED_STACK_SIZE;
-    list_append(&_task->vma_list, &_vma->list);
+    if (attach_vm_area(&_task->vma_list, &_task->vma_tree, _vma))
+        goto vma_overlap;
     //USER_VMA_SIGNAL_STACK vma setup
-    _vma = malloc(sizeof(struct vm_area));
+    _vma = malloc_vm_area();
     if (!_vma) {
         LOG_DEBUG("Can not allocate memory for VM area");
         ret = -ERR_OUT_OF_MEMORY;
@@ -366,17 +377,17 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
         DEFAULT_TASK_NON_PRIVILEGED_SIGNAL_STACK_SIZE;
     _vma->phy_addr = 0;
     _vma->length = DEFAULT_TASK_NON_PRIVILEGED_SIGNAL_STACK_SIZE;
-    list_append(&_task->vma_list, &_vma->list);
+    if (attach_vm_area(&_task->vma_list, &_task->vma_tree, _vma))
+        goto vma_overlap;
     /*
-     * 2. Page directory setup and pre-map the text&data and stack vm area
+     * 2. Page directory setup and pre-map the stack vm area
      */
-    _task->page_directory = (uint32_t *)get_base_page();
+    _task->page_directory = (uint32_t *)get_zeroed_base_page();
     if (!_task->page_directory) {
         LOG_DEBUG("Can not allocate memory for task.page_directory\n");
         ret = -ERR_OUT_OF_MEMORY;
         goto page_error;
     }
-    memset(_task->page_directory, 0x0, PAGE_SIZE);
     // map the vma with premap set to 1
     LIST_FOREACH_START(&_task->vma_list, _list) {
         _vma = CONTAINER_OF(_list, struct vm_area, list);
@@ -394,31 +405,13 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
     }
     LIST_FOREACH_END();
     /*
-     * 3. switch to task paging directory base and load the elf's program
-     * segment into task memory
+     * 3. switch to task paging directory base to put the command line
+     * onto the task's stack.
      */
     enable_task_paging(_task);
-    /*
-     * 4. copy program segments into VMA.
-     */
-    for (idx = 0; idx < elf_hdr->e_phnum; idx++) {
-        program_hdr = (struct elf32_program_header *)(mem + elf_hdr->e_phoff
-            + idx * sizeof(struct elf32_program_header));
-        if (program_hdr->p_type != PROGRAM_TYPE_LOAD)
-            continue;
-        memcpy((void *)program_hdr->p_vaddr,
-            (void *)(((uint32_t)mem) + program_hdr->p_offset),
-            (int)program_hdr->p_filesz);
-        _vma = search_userspace_vma_by_addr(&_task->vma_list,
-            (uint32_t)program_hdr->p_vaddr);
-        ASSERT(_vma);
-        _vma->write_permission = program_hdr->p_flags & PROGRAM_WRITE ?
-            PAGE_PERMISSION_READ_WRITE : PAGE_PERMISSION_READ_ONLY;
-        userspace_remap_vm_area(_task, _vma);
-    }
     dump_task_vm_areas(_task);
     /*
-     * 5. Prepare initial PL0 stack.
+     * 4. Prepare initial PL0 stack.
      */
     _task->entry = elf_hdr->e_entry;
     _vma = search_userspace_vma(&_task->vma_list, (uint8_t *)USER_VMA_STACK);
@@ -455,7 +448,7 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
     _task->cpu = _cpu;
     _task->interrupt_depth = 1;
     /*
-     * 6. Prepare to be scheduled.
+     * 5. Prepare to be scheduled.
      */
     task_signal_init(_task);
     current = prev_task;
@@ -480,13 +473,19 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
         LIST_FOREACH_END();
         if (_task->page_directory)
             free_base_page((uint32_t)_task->page_directory);
+        goto vma_error;
+    vma_overlap:
+        LOG_DEBUG("task:0x%x's vma:%s overlaps others\n", _task, _vma->name);
+        free_vm_area(_vma);
+        ret = -ERR_INVALID_ARG;
     vma_error:
         while(!list_empty(&_task->vma_list)) {
             _list = list_pop(&_task->vma_list);
             ASSERT(_list);
             _vma = CONTAINER_OF(_list, struct vm_area, list);
-            free(_vma);
+            free_vm_area(_vma);
         }
+        vm_area_tree_init(&_task->vma_tree);
     task_error:
         if (_task) {
             if (_task->privilege_level0_stack)
@@ -502,3 +501,56 @@ load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id)
         enable_kernel_paging();
     return ret;
 }
+
+/*
+ * Load the executable file as a new task, only the ELF headers are read here,
+ * the program segments are paged in on demand.
+ */
+int32_t
+load_static_elf32_file(struct file * file,
+    uint8_t * command,
+    uint32_t * ptask_id)
+{
+    int32_t ret = -ERR_INVALID_ARG;
+    int32_t file_length;
+    int32_t headers_length = 0;
+    int32_t rc;
+    uint8_t * mem = NULL;
+    struct file_entry entry;
+    struct elf32_elf_header * elf_hdr;
+    if (file->type != FILE_TYPE_REGULAR || !file->ops->size)
+        goto out;
+    file_length = file->ops->size(file);
+    if (file_length < sizeof(struct elf32_elf_header))
+        goto out;
+    mem = malloc(ELF32_HEADERS_SIZE);
+    if (!mem) {
+        ret = -ERR_OUT_OF_MEMORY;
+        goto out;
+    }
+    memset(&entry, 0x0, sizeof(entry));
+    entry.file = file;
+    entry.offset = 0;
+    while (headers_length < MIN(file_length, ELF32_HEADERS_SIZE)) {
+        rc = do_vfs_read(&entry, mem + headers_length,
+            MIN(file_length, ELF32_HEADERS_SIZE) - headers_length);
+        if (rc <= 0)
+            goto out;
+        headers_length += rc;
+    }
+    elf_hdr = (struct elf32_elf_header *)mem;
+    // The program headers must reside in the buffer, e_phoff is checked
+    // first so that a crafted one can not wrap the sum around.
+    if (headers_length < sizeof(struct elf32_elf_header) ||
+        elf_hdr->e_phoff > headers_length ||
+        elf_hdr->e_phnum * sizeof(struct elf32_program_header) >
+        (headers_length - elf_hdr->e_phoff))
+        goto out;
+    if (validate_static_elf32_format(mem, file_length))
+        goto out;
+    ret = load_static_elf32(mem, file, command, ptask_id);
+    out:
+        if (mem)
+            free(mem);
+        return ret;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <kernel/include/hrtimer.h>
+#include <kernel/include/clocksource.h>
+#include <kernel/include/printk.h>
+#include <lib/include/string.h>
+#include <x86/include/interrupt.h>
+#include <x86/include/lapic.h>
+
+static struct heap_stub hrtimer_heap;
+
+#define HRTIMER(_node) CONTAINER_OF((_node), struct hrtimer, node)
+
+int32_t
+hrtimer_detached(struct hrtimer * hrtimer)
+{
+    return heap_node_detached(&hrtimer_heap, &hrtimer->node);
+}
+
+int32_t
+hrtimer_pending(void)
+{
+    return !!hrtimer_heap.root;
+}
+
+static int32_t
+hrtimer_compare(struct binary_tree_node * node0,
+    struct binary_tree_node * node1)
+{
+    struct hrtimer * hrtimer0 = HRTIMER(node0);
+    struct hrtimer * hrtimer1 = HRTIMER(node1);
+    return hrtimer0->expires < hrtimer1->expires ?
+        -1 : hrtimer0->expires > hrtimer1->expires ? 1 : 0;
+}
+
+static void
+program_hrtimer_event(uint64_t now)
+{
+    struct hrtimer * hrtimer;
+    if (!hrtimer_heap.root || !lapic_timer_ready())
+        return;
+    hrtimer = HRTIMER(hrtimer_heap.root);
+    lapic_timer_program(hrtimer->expires > now ? hrtimer->expires - now : 0);
+}
+
+void
+register_hrtimer(struct hrtimer * hrtimer)
+{
+    uint32_t eflags;
+    ASSERT(!hrtimer->node.left);
+    ASSERT(!hrtimer->node.right);
+    ASSERT(!hrtimer->node.parent);
+    eflags = local_irq_save();
+    hrtimer->state = timer_state_scheduled;
+    attach_heap_node(&hrtimer_heap, &hrtimer->node, hrtimer_compare);
+    // a cancelled earlier event just fires with nothing to do.
+    if (hrtimer_heap.root == &hrtimer->node)
+        program_hrtimer_event(ktime_get_ns());
+    local_irq_restore(eflags);
+    LOG_TRIVIA("Registered hrtimer:0x%x\n", hrtimer);
+}
+
+void
+cancel_hrtimer(struct hrtimer * hrtimer)
+{
+    uint32_t eflags = local_irq_save();
+    delete_heap_node(&hrtimer_heap, &hrtimer->node, hrtimer_compare);
+    hrtimer->state = timer_state_idle;
+    local_irq_restore(eflags);
+    ASSERT(!hrtimer->node.left);
+    ASSERT(!hrtimer->node.right);
+    ASSERT(!hrtimer->node.parent);
+    LOG_TRIVIA("Cancel hrtimer:0x%x\n", hrtimer);
+}
+
+void
+hrtimer_interrupt(void)
+{
+    struct hrtimer * hrtimer;
+    struct binary_tree_node * current_node;
+    uint64_t now;
+    if (!hrtimer_heap.root)
+        return;
+    now = ktime_get_ns();
+    while ((current_node = hrtimer_heap.root)) {
+        hrtimer = HRTIMER(current_node);
+        ASSERT(hrtimer->state == timer_state_scheduled);
+        if (hrtimer->expires > now)
+            break;
+        current_node = detach_heap_node(&hrtimer_heap, hrtimer_compare);
+        ASSERT(current_node);
+        hrtimer = HRTIMER(current_node);
+        hrtimer->state = timer_state_idle;
+        ASSERT(hrtimer->callback);
+        hrtimer->callback(hrtimer, hrtimer->priv);
+        LOG_TRIVIA("Scheduled hrtimer:0x%x\n", hrtimer);
+    }
+    program_hrtimer_event(now);
+}
+
+void
+hrtimer_init(void)
+{
+    memset(&hrtimer_heap, 0x0, sizeof(hrtimer_heap));
+}
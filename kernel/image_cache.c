@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <kernel/include/image_cache.h>
+#include <kernel/include/printk.h>
+#include <lib/include/string.h>
+#include <lib/include/errorcode.h>
+#include <memory/include/slab.h>
+#include <memory/include/paging.h>
+#include <memory/include/buddy.h>
+#include <memory/include/shrinker.h>
+#include <filesystem/include/vfs.h>
+
+static struct hash_node image_cache_heads[IMAGE_CACHE_HASH_SIZE];
+static struct hash_stub image_cache_stub;
+static struct kmem_cache * image_page_cache;
+static struct image_cache_stat image_cache_stat;
+
+void
+fill_page_frame_from_file(uint32_t frame,
+    struct file * file,
+    uint32_t offset,
+    uint32_t length)
+{
+    int32_t filled;
+    int32_t rc;
+    uint8_t * buffer;
+    struct file_entry entry;
+    ASSERT(length <= PAGE_SIZE);
+    buffer = kernel_map_scratch_frame(frame);
+    memset(buffer, 0x0, PAGE_SIZE);
+    memset(&entry, 0x0, sizeof(entry));
+    entry.file = file;
+    entry.offset = offset;
+    for (filled = 0; filled < length; filled += rc) {
+        rc = do_vfs_read(&entry, buffer + filled, length - filled);
+        if (rc <= 0)
+            break;
+    }
+    kernel_unmap_scratch_frame();
+}
+
+static uint32_t
+image_page_hash(void * blob)
+{
+    struct image_page * key = (struct image_page *)blob;
+    return ((uint32_t)key->file) ^ (key->offset >> 12);
+}
+
+static uint32_t
+image_page_identity(struct hash_node * node, void * blob)
+{
+    struct image_page * key = (struct image_page *)blob;
+    struct image_page * page = CONTAINER_OF(node, struct image_page, node);
+    return page->file == key->file &&
+        page->offset == key->offset &&
+        page->length == key->length;
+}
+
+uint32_t
+image_cache_get_page(struct file * file, uint32_t offset, uint32_t length)
+{
+    struct image_page key;
+    struct image_page * page;
+    struct hash_node * node;
+    uint32_t frame;
+    key.file = file;
+    key.offset = offset;
+    key.length = length;
+    node = search_hash_node(&image_cache_stub,
+        &key,
+        image_page_hash,
+        image_page_identity);
+    if (node) {
+        page = CONTAINER_OF(node, struct image_page, node);
+        get_page_frame(page->frame);
+        image_cache_stat.nr_hits++;
+        return page->frame;
+    }
+    image_cache_stat.nr_misses++;
+    page = kmem_cache_alloc(image_page_cache);
+    if (!page)
+        return 0;
+    frame = get_page();
+    if (!frame) {
+        kmem_cache_free(image_page_cache, page);
+        return 0;
+    }
+    set_page_frame_flags(frame, PAGE_FRAME_PAGE_CACHE);
+    set_page_frame_owner(frame, file);
+    fill_page_frame_from_file(frame, file, offset, length);
+    memset(page, 0x0, sizeof(struct image_page));
+    page->file = file;
+    page->offset = offset;
+    page->length = length;
+    page->frame = frame;
+    ASSERT(add_hash_node(&image_cache_stub,
+        page,
+        &page->node,
+        image_page_hash,
+        image_page_identity) == OK);
+    // one reference for the cache and one for the caller
+    get_page_frame(frame);
+    image_cache_stat.nr_pages++;
+    return frame;
+}
+
+/*
+ * drop up to nr_pages cached pages which are no longer mapped, all the files'
+ * pages are candidates if file is NULL. return the number of dropped pages.
+ */
+static uint32_t
+__image_cache_release(struct file * file, uint32_t nr_pages)
+{
+    int32_t idx;
+    uint32_t nr_released = 0;
+    struct list_elem * _list;
+    struct image_page * page;
+    for (idx = 0; idx < IMAGE_CACHE_HASH_SIZE; idx++) {
+        LIST_FOREACH_START(&image_cache_heads[idx], _list) {
+            page = CONTAINER_OF(_list, struct image_page, node);
+            if (nr_released >= nr_pages)
+                return nr_released;
+            if ((file && page->file != file) ||
+                page_frame_refcount(page->frame) > 1)
+                continue;
+            ASSERT(delete_hash_node(&image_cache_stub,
+                page,
+                image_page_hash,
+                image_page_identity) == OK);
+            put_page_frame(page->frame);
+            kmem_cache_free(image_page_cache, page);
+            image_cache_stat.nr_pages--;
+            nr_released++;
+        }
+        LIST_FOREACH_END();
+    }
+    return nr_released;
+}
+
+void
+image_cache_release(struct file * file)
+{
+    __image_cache_release(file, image_cache_stat.nr_pages);
+}
+
+/*
+ * drop the cached pages of the file which overlap [offset, offset + length)
+ * whether they are mapped or not, except the one of keep_frame.
+ */
+static void
+__image_cache_invalidate(struct file * file,
+    uint32_t offset,
+    uint32_t length,
+    uint32_t keep_frame)
+{
+    int32_t idx;
+    uint64_t end = (uint64_t)offset + length;
+    struct list_elem * _list;
+    struct image_page * page;
+    if (!length)
+        return;
+    for (idx = 0; idx < IMAGE_CACHE_HASH_SIZE; idx++) {
+        LIST_FOREACH_START(&image_cache_heads[idx], _list) {
+            page = CONTAINER_OF(_list, struct image_page, node);
+            // the zeroed tail of a page is stale once the file grows into it
+            if (page->file != file ||
+                page->frame == keep_frame ||
+                (uint64_t)page->offset >= end ||
+                (page->offset + PAGE_SIZE) <= offset)
+                continue;
+            ASSERT(delete_hash_node(&image_cache_stub,
+                page,
+                image_page_hash,
+                image_page_identity) == OK);
+            put_page_frame(page->frame);
+            kmem_cache_free(image_page_cache, page);
+            image_cache_stat.nr_pages--;
+            image_cache_stat.nr_invalidated++;
+        }
+        LIST_FOREACH_END();
+    }
+}
+
+void
+image_cache_invalidate(struct file * file, uint32_t offset, uint32_t length)
+{
+    __image_cache_invalidate(file, offset, length, 0);
+}
+
+int32_t
+image_cache_writeback_page(uint32_t frame,
+    struct file * file,
+    uint32_t offset,
+    uint32_t length)
+{
+    int32_t rc;
+    uint8_t * buffer;
+    ASSERT(length <= PAGE_SIZE);
+    ASSERT(file->ops->write);
+    buffer = kernel_map_scratch_frame(frame);
+    rc = file->ops->write(file, offset, buffer, length);
+    kernel_unmap_scratch_frame();
+    if (rc > 0)
+        __image_cache_invalidate(file, offset, rc, frame);
+    return rc;
+}
+
+static uint32_t
+image_cache_shrink(uint32_t nr_frames)
+{
+    return __image_cache_release(NULL, nr_frames);
+}
+
+static struct shrinker image_cache_shrinker = {
+    .name = "image-cache",
+    .shrink = image_cache_shrink,
+};
+
+void
+get_image_cache_stat(struct image_cache_stat * stat)
+{
+    memcpy(stat, &image_cache_stat, sizeof(struct image_cache_stat));
+}
+
+void
+dump_image_cache_stat(void)
+{
+    LOG_INFO("Dump executable image cache:\n");
+    LOG_INFO("   cached pages: %d\n", image_cache_stat.nr_pages);
+    LOG_INFO("   hits: %d\n", image_cache_stat.nr_hits);
+    LOG_INFO("   misses: %d\n", image_cache_stat.nr_misses);
+    LOG_INFO("   invalidated: %d\n", image_cache_stat.nr_invalidated);
+}
+
+void
+image_cache_init(void)
+{
+    image_cache_stub.stub_mask = IMAGE_CACHE_HASH_SIZE - 1;
+    image_cache_stub.heads = image_cache_heads;
+    memset(image_cache_heads, 0x0, sizeof(image_cache_heads));
+    memset(&image_cache_stat, 0x0, sizeof(image_cache_stat));
+    image_page_cache = kmem_cache_create((const uint8_t *)"image_page",
+        sizeof(struct image_page),
+        sizeof(uint32_t));
+    ASSERT(image_page_cache);
+    register_shrinker(&image_cache_shrinker);
+}
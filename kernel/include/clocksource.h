@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _CLOCKSOURCE_H
+#define _CLOCKSOURCE_H
+#include <lib/include/types.h>
+
+#define NSEC_PER_MSEC 1000000
+#define NSEC_PER_SEC 1000000000
+
+/*
+ * A clocksource is a free running counter which never goes backwards, the
+ * monotonic clock is read from the registered clocksource with the highest
+ * rating, it's the jiffies until a better one is calibrated.
+ */
+struct clocksource {
+    const char * name;
+    uint64_t (*read)(void);
+    // the number of counter cycles per milisecond
+    uint32_t khz;
+    int32_t rating;
+};
+
+static inline uint64_t
+clocksource_cyc2ns(uint64_t cycles, uint32_t khz)
+{
+    uint64_t ms = div_u64_u32(cycles, khz);
+    uint64_t remainder = cycles - ms * khz;
+    return ms * NSEC_PER_MSEC + div_u64_u32(remainder * NSEC_PER_MSEC, khz);
+}
+
+/*
+ * switch the monotonic clock to the clocksource if it's rated higher than
+ * the current one, the clock does not jump at the switch.
+ */
+void
+register_clocksource(struct clocksource * clocksource);
+
+/*
+ * the nanoseconds elapsed since the timer started.
+ */
+uint64_t
+ktime_get_ns(void);
+
+#endif
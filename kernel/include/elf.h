@@ -5,6 +5,8 @@
 #define _ELF_H
 #include <lib/include/types.h>
 
+struct file;
+
 /*
  * I borrow the definition from /uer/include/elf.h
  */
@@ -65,6 +67,20 @@ struct elf32_program_header{
 int
 validate_static_elf32_format(uint8_t * mem, int32_t length);
 
+/*
+ * the ELF header and program headers must be within the first
+ * ELF32_HEADERS_SIZE bytes of the executable.
+ */
+#define ELF32_HEADERS_SIZE 4096
+
+int32_t
+load_static_elf32(uint8_t * mem,
+    struct file * file,
+    uint8_t * command,
+    uint32_t * ptask_id);
+
 int32_t
-load_static_elf32(uint8_t * mem, uint8_t * command, uint32_t * ptask_id);
+load_static_elf32_file(struct file * file,
+    uint8_t * command,
+    uint32_t * ptask_id);
 #endif
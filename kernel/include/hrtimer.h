@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _HRTIMER_H
+#define _HRTIMER_H
+#include <kernel/include/timer.h>
+
+/*
+ * The high resolution timers expire at the nanoseconds of the monotonic
+ * clock, they are kept in a heap of their own which is maintained the same
+ * way as the jiffies timers. The local APIC timer is programmed for the
+ * earliest one, without it, the timers expire at the tick.
+ */
+struct hrtimer {
+    struct binary_tree_node node;
+    enum timer_state state;
+    uint64_t expires;
+    void (*callback)(struct hrtimer * hrtimer, void * priv);
+    void * priv;
+};
+
+int32_t
+hrtimer_detached(struct hrtimer * hrtimer);
+
+int32_t
+hrtimer_pending(void);
+
+void
+register_hrtimer(struct hrtimer * hrtimer);
+
+void
+cancel_hrtimer(struct hrtimer * hrtimer);
+
+/*
+ * run the expired timers and program the event device for the next one,
+ * it's called from the event device interrupt and every tick.
+ */
+void
+hrtimer_interrupt(void);
+
+void
+hrtimer_init(void);
+#endif
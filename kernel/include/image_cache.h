@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _IMAGE_CACHE_H
+#define _IMAGE_CACHE_H
+#include <lib/include/types.h>
+#include <lib/include/hash_table.h>
+
+struct file;
+
+/*
+ * The executable image cache shares the page frames of read-only file-backed
+ * segments among all the tasks running the same binary. The pages of
+ * MAP_SHARED file mappings are the same frames mapped writable, so all the
+ * tasks mapping a file page share one frame of it. A cached page is
+ * identified by the file, the file offset of the page and the number of bytes
+ * filled from the file, the rest of the page is zeroed.
+ * The cache holds one reference to the frame, every mapping holds another.
+ */
+#define IMAGE_CACHE_HASH_SIZE 64
+
+struct image_page {
+    struct hash_node node;
+    struct file * file;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t frame;
+};
+
+struct image_cache_stat {
+    uint32_t nr_pages;
+    uint32_t nr_hits;
+    uint32_t nr_misses;
+    uint32_t nr_invalidated;
+};
+
+/*
+ * fill the page frame with `length` bytes of the file starting at `offset`,
+ * the rest of the frame is zeroed.
+ */
+void
+fill_page_frame_from_file(uint32_t frame,
+    struct file * file,
+    uint32_t offset,
+    uint32_t length);
+
+/*
+ * return the shared frame with a reference taken for the caller,
+ * 0 is returned upon memory outage.
+ */
+uint32_t
+image_cache_get_page(struct file * file, uint32_t offset, uint32_t length);
+
+/*
+ * release the cached pages of the file which are no longer mapped.
+ */
+void
+image_cache_release(struct file * file);
+
+/*
+ * drop the cached pages which overlap [offset, offset + length) of the file
+ * once its content is changed, the mapped ones included. A mapping keeps the
+ * frame it has, which is no longer shared with the later mappings.
+ */
+void
+image_cache_invalidate(struct file * file, uint32_t offset, uint32_t length);
+
+/*
+ * write length bytes of the frame of a MAP_SHARED page back to the file at
+ * offset. The frame's own cached page stays since it holds what's written,
+ * the other ones of the range are invalidated.
+ * return the result of the file write.
+ */
+int32_t
+image_cache_writeback_page(uint32_t frame,
+    struct file * file,
+    uint32_t offset,
+    uint32_t length);
+
+void
+get_image_cache_stat(struct image_cache_stat * stat);
+
+void
+dump_image_cache_stat(void);
+
+void
+image_cache_init(void);
+
+#endif
@@ -10,6 +10,8 @@
 #include <kernel/include/printk.h>
 #include <lib/include/list.h>
 #include <lib/include/hash_table.h>
+#include <lib/include/bitmap.h>
+#include <lib/include/avl_tree.h>
 #include <kernel/include/userspace_vma.h>
 #include <filesystem/include/file.h>
 #include <kernel/include/timer.h>
@@ -28,6 +30,32 @@ enum task_state {
     TASK_STATE_MAX,
 };
 
+/*
+ * A runnable task of a higher scheduling class always runs before the ones of
+ * a lower class.
+ * SCHED_CLASS_KERNEL: the tasks are ordered by static priority and
+ * round-robined at the same priority, every priority has its own run queue.
+ * SCHED_CLASS_NORMAL: the tasks share the fair run queue, a tree ordered by
+ * vruntime, the runtime weighted by the static priority. The task which has
+ * run the least is picked.
+ * A bitmap of the non-empty run queues gives the next one in O(1).
+ */
+enum sched_class {
+    // the kernel bottom halves, i.e. the work queue tasks
+    SCHED_CLASS_KERNEL = 0,
+    SCHED_CLASS_NORMAL,
+    SCHED_CLASS_MAX,
+};
+
+#define NR_TASK_PRIORITIES (TASK_PRIORITY_LOWEST - TASK_PRIORITY_HIGHEST + 1)
+#define FAIR_RUN_QUEUE NR_TASK_PRIORITIES
+#define NR_RUN_QUEUES (FAIR_RUN_QUEUE + 1)
+#define TASK_RUN_QUEUE(task) \
+    ((task)->sched_class == SCHED_CLASS_NORMAL ? \
+    FAIR_RUN_QUEUE : (task)->static_priority)
+// the weight of TASK_PRIORITY_DEFAULT
+#define FAIR_WEIGHT_DEFAULT 1024
+
 struct signal_entry {
     int32_t valid:1;
     int32_t signaled:1;
@@ -41,16 +69,51 @@ struct signal_entry {
     uint32_t user_entry;
 };
 
+/*
+ * The memory accounting of a task, the counters are maintained as userspace
+ * pages and page tables are mapped and unmapped.
+ */
+struct task_mm_stat {
+    // the present userspace pages
+    uint32_t nr_resident_pages;
+    uint32_t nr_page_tables;
+    uint32_t nr_page_faults;
+    uint32_t nr_cow_faults;
+};
+
 struct task {
     // The task_id which identifies the task mainly in userland.
     // the task is stored and searched in the global hash table. the `node`
     // ease the work to store and search
     uint32_t task_id;
     struct hash_node node;
+    /*
+     * the linkage in the run queue while the task is runnable, or in the
+     * exiting list. a blocked task is not linked, it's reachable through the
+     * wait queues it waits on.
+     */
     struct list_elem list;
+    uint8_t on_run_queue;
+    uint8_t sched_class;
+    uint8_t static_priority;
+    // the runtime scaled by FAIR_WEIGHT_DEFAULT / weight, SCHED_CLASS_NORMAL
+    uint64_t vruntime;
+    struct avl_node fair_node;
+    /*
+     * the cpu time in TSC cycles, the time between two switches is charged
+     * to user or system time by the privilege level the task is switched
+     * out at.
+     */
+    uint64_t exec_start;
+    uint64_t user_runtime;
+    uint64_t system_runtime;
+    // the jiffies when the task is created
+    uint64_t start_time;
     // wait queue, when the task exits, it notifies all the tasks which are
     // waiting for termmination of the task
     struct wait_queue_head wq_termination; 
+    // the entry of the queue of the tasks waiting for memory
+    struct wait_queue oom_wait;
     // `state` is the current state of the task
     // `non_stop_state` is the state of the task before the task goes into 
     // TASK_STATE_UNINTERRUPTIBLE as STOPPED state, we first save the state in
@@ -69,8 +132,12 @@ struct task {
     struct x86_cpustate * signaled_cpu;
     /*
      * per-task VMAs and  page Directory
+     * the vma_list keeps the VMAs for iteration, the vma_tree indexes them
+     * by address for lookup.
      */
     struct list_elem vma_list;
+    struct vm_area_tree vma_tree;
+    struct task_mm_stat mm_stat;
 
     /*
      * If the task is in PL3 context, before switching task, we should 
@@ -113,7 +180,9 @@ struct task {
     struct signal_entry sig_entries[SIG_MAX];
 
     // The file descriptor entries
-    struct file_entry file_entries[MAX_FILE_DESCRIPTR_PER_TASK];
+    struct file_entry * file_entries[MAX_FILE_DESCRIPTR_PER_TASK];
+    // the bit is set if the file entry is valid
+    uint32_t fd_bitmap[BITMAP_WORDS(MAX_FILE_DESCRIPTR_PER_TASK)];
 
     // the name of the task, it could be duplicated
     uint8_t name[MAX_PATH];
@@ -174,7 +243,8 @@ transit_state(struct task * task, enum task_state target_state);
 void
 set_work_directory(struct task * task, uint8_t * cwd);
 
-struct list_elem * get_task_list_head(void);
+uint32_t get_nr_running_tasks(void);
+int32_t set_task_priority(struct task * task, int32_t priority);
 struct task * malloc_task(void);
 void free_task(struct task * _task);
 
@@ -203,6 +273,8 @@ userspace_map_page(struct task * task,
 int userspace_remap_vm_area(struct task * task, struct vm_area * vma);
 
 int userspace_evict_vma(struct task * task, struct vm_area * vma);
+
+int userspace_protect_vm_area(struct task * task, struct vm_area * vma);
 int
 userspace_evict_page(struct task * task,
     uint32_t virt_addr,
@@ -211,8 +283,15 @@ int reclaim_page_table(struct task * task, uint32_t virt_addr);
 
 uint32_t reclaim_task(struct task * task);
 int enable_task_paging(struct task * task);
+int switch_task_paging(struct task * task);
+void unload_task_paging(struct task * task);
 void dump_tasks(void);
 
+int
+userspace_fork_vm_area(struct task * parent,
+    struct task * child,
+    struct vm_area * vma);
+
 uint32_t
 handle_userspace_page_fault(struct task * task,
     struct x86_cpustate * cpu,
@@ -229,12 +308,22 @@ create_kernel_task(void (*entry)(void),
     struct task ** task_ptr,
     uint8_t * task_name);
 
+uint32_t
+fork_task(struct task * parent, struct x86_cpustate * cpu, uint32_t * ptask_id);
+
 void
 yield_cpu(void);
 
 int32_t
 sleep(uint32_t milisecond);
 
+/*
+ * sleep with a high resolution timer, the time left is stored in remaining
+ * if the sleep is interrupted.
+ */
+int32_t
+nanosleep(uint64_t nanosecond, uint64_t * remaining);
+
 void
 task_misc_init(void);
 
@@ -247,4 +336,10 @@ raw_task_wake_up(struct task * task);
 uint32_t
 do_task_traverse(struct taskent * taskp, int32_t count);
 
+int32_t
+out_of_memory(void);
+
+int32_t
+wait_for_memory(struct x86_cpustate * cpu, uint32_t * p_esp);
+
 #endif
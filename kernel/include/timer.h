@@ -34,4 +34,11 @@ cancel_timer(struct timer_entry * entry);
 
 void
 schedule_timer(void);
+
+/*
+ * retrieve the expiry jiffies of the earliest scheduled timer,
+ * -ERR_NOT_FOUND is returned if no timer is scheduled.
+ */
+int32_t
+timer_next_expiry(uint64_t * expiry);
 #endif
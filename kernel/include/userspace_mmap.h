@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _USERSPACE_MMAP_H
+#define _USERSPACE_MMAP_H
+#include <kernel/include/task.h>
+#include <kernel/include/zelda_posix.h>
+
+/*
+ * create a memory mapping in [USERSPACE_MMAP_BOTTOM, USERSPACE_MMAP_TOP),
+ * the mapped address is put in paddr. The pages are not populated until
+ * they are accessed: an anonymous page is zeroed and a file page is filled
+ * from the file at page fault.
+ */
+int32_t
+do_mmap(struct task * task, struct mmap_args * args, uint32_t * paddr);
+
+/*
+ * remove the mappings in [addr, addr + length), the mappings partially
+ * within the range are split.
+ */
+int32_t
+do_munmap(struct task * task, uint32_t addr, uint32_t length);
+
+/*
+ * change the permission of the mappings in [addr, addr + length), the range
+ * must be fully mapped.
+ */
+int32_t
+do_mprotect(struct task * task, uint32_t addr, uint32_t length, int32_t prot);
+
+#endif
@@ -5,9 +5,12 @@
 #define _USERSPACE_VMA_H
 #include <lib/include/types.h>
 #include <lib/include/list.h>
+#include <lib/include/avl_tree.h>
 #define VM_AREA_NAME_SIZE 64
+struct file;
 struct vm_area {
     struct list_elem list;
+    struct avl_node node;
     uint8_t name[VM_AREA_NAME_SIZE];
     
     uint32_t kernel_vma:1;
@@ -17,11 +20,37 @@ struct vm_area {
     uint32_t page_writethrough:1;
     uint32_t page_cachedisable:1;
     uint32_t executable:1;
+    // MAP_SHARED: the pages are shared with other tasks and across fork.
+    uint32_t shared:1;
+    // the anonymous pages are zeroed at page fault.
+    uint32_t zero_fill:1;
+    // the file was mapped through a writable fd.
+    uint32_t file_writable:1;
 
     uint64_t virt_addr;
     uint64_t phy_addr;
 
     uint64_t length;
+
+    /*
+     * The file-backed vm area is filled from file at page fault, the
+     * content at [file_offset, file_offset + file_size) of the file is mapped
+     * at virt_addr, the rest of the area is zero filled.
+     * the vm area holds a reference to the file.
+     */
+    struct file * file;
+    uint32_t file_offset;
+    uint32_t file_size;
+};
+
+/*
+ * The VMAs of a task never overlap, so the tree ordered by the start address
+ * answers both the point and the range queries in O(log n). The last VMA
+ * found is cached for the sequential page faults.
+ */
+struct vm_area_tree {
+    struct avl_tree avl;
+    struct vm_area * last_hit;
 };
 
 #define KERNEL_VMA "kernelspace.vma"
@@ -29,6 +58,7 @@ struct vm_area {
 #define USER_VMA_HEAP "userspace.vma.heap"
 #define USER_VMA_STACK "userspace.vma.stack"
 #define USER_VMA_SIGNAL_STACK "userspace.vma.signal_stack"
+#define USER_VMA_MMAP "userspace.vma.mmap"
 
 #define VMA_EXTEND_UPWARD 0x1
 #define VMA_EXTEND_DOWNWARD 0x2
@@ -37,13 +67,60 @@ struct vm_area *
 search_userspace_vma(struct list_elem * head, uint8_t * vma_name);
 
 struct vm_area *
-search_userspace_vma_by_addr(struct list_elem * head, uint32_t vaddr);
+search_userspace_vma_by_addr(struct vm_area_tree * tree, uint32_t vaddr);
+
+/*
+ * return any vma which overlaps [start, end), NULL if there is none.
+ */
+struct vm_area *
+search_userspace_vma_in_range(struct vm_area_tree * tree,
+    uint32_t start,
+    uint32_t end);
+
+void
+vm_area_tree_init(struct vm_area_tree * tree);
+
+int32_t
+vm_area_in_tree(struct vm_area_tree * tree, struct vm_area * target_vma);
+
+/*
+ * put the vma in both the list and the tree,
+ * return -ERR_EXIST if it overlaps any vma.
+ */
+int32_t
+attach_vm_area(struct list_elem * vmas_head,
+    struct vm_area_tree * tree,
+    struct vm_area * _vma);
+
+void
+detach_vm_area(struct list_elem * vmas_head,
+    struct vm_area_tree * tree,
+    struct vm_area * _vma);
+
+/*
+ * split the vma at the page aligned address within it, the upper part is
+ * returned as a new attached vma. return NULL upon memory outage.
+ */
+struct vm_area *
+split_vm_area(struct list_elem * vmas_head,
+    struct vm_area_tree * tree,
+    struct vm_area * _vma,
+    uint32_t addr);
 
 int __extend_vm_area(struct vm_area * _vma, int direction, int length);
 
 int
-extend_vm_area(struct list_elem * vmas_head,
+extend_vm_area(struct vm_area_tree * tree,
     struct vm_area * target_vma,
     int direction,
     int length);
+
+struct vm_area *
+malloc_vm_area(void);
+
+void
+free_vm_area(struct vm_area * _vma);
+
+void
+userspace_vma_init(void);
 #endif
@@ -54,8 +54,45 @@ struct taskent {
     uint32_t entry;
     uint32_t privilege_level;
     uint32_t schedule_counter;
+    // memory accounting, the sizes are in bytes
+    uint32_t resident_size;
+    uint32_t virtual_size;
+    uint32_t heap_size;
+    uint32_t page_table_size;
+    uint32_t privileged_stack_size;
+    uint32_t nr_page_faults;
+    uint32_t nr_cow_faults;
+    // scheduling class and static priority
+    uint32_t sched_class;
+    uint32_t priority;
+    // cpu time in miliseconds, cpu_usage is in per mille since the task starts
+    uint32_t user_time;
+    uint32_t system_time;
+    uint32_t cpu_usage;
 }__attribute__((packed));
 
+/*
+ * The static priority of a task within its scheduling class,
+ * the smaller the value is, the earlier the task is picked.
+ */
+#define TASK_PRIORITY_HIGHEST 0
+#define TASK_PRIORITY_LOWEST 7
+#define TASK_PRIORITY_DEFAULT 4
+
+/*
+ * clock_gettime() and nanosleep(), only the monotonic clock is supported,
+ * it counts from the timer initialization. The guard is shared with the
+ * host libc headers, which would define the same structure.
+ */
+#define CLOCK_MONOTONIC 1
+#ifndef _STRUCT_TIMESPEC
+#define _STRUCT_TIMESPEC 1
+struct timespec {
+    int32_t tv_sec;
+    int32_t tv_nsec;
+};
+#endif
+
 // The File SEEK macro from: Linux/fs.h
 
 #define SEEK_SET 0 /* seek relative to beginning of file */
@@ -114,6 +151,38 @@ enum SYSCALL_INDEX {
     // instead, we realize Linux interface:getdents
     SYS_GETDENTS_IDX,
     SYS_GETTASKENTS_IDX,
+    SYS_FORK_IDX,
+    SYS_MMAP_IDX,
+    SYS_MUNMAP_IDX,
+    SYS_MPROTECT_IDX,
+    SYS_SETTASKPRIORITY_IDX,
+    SYS_CLOCK_GETTIME_IDX,
+    SYS_NANOSLEEP_IDX,
+};
+
+// The memory mapping flags from: newlib/include/sys/mman.h
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x1
+#define MAP_PRIVATE 0x2
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap() takes 6 parameters which exceeds the syscall convention, they are
+ * delivered in memory.
+ */
+struct mmap_args {
+    uint32_t addr;
+    uint32_t length;
+    int32_t prot;
+    int32_t flags;
+    int32_t fd;
+    uint32_t offset;
 };
 
 enum SIGNAL {
@@ -7,6 +7,7 @@
 #include <x86/include/interrupt.h>
 #include <x86/include/ioport.h>
 #include <x86/include/pit.h>
+#include <x86/include/lapic.h>
 #include <device/include/keyboard.h>
 #include <memory/include/physical_memory.h>
 #include <memory/include/paging.h>
@@ -14,6 +15,8 @@
 #include <device/include/serial.h>
 #include <lib/include/string.h>
 #include <memory/include/malloc.h>
+#include <memory/include/slab.h>
+#include <memory/include/buddy.h>
 #include <kernel/include/task.h>
 #include <device/include/pci.h>
 #include <device/include/ata.h>
@@ -26,6 +29,7 @@
 #include <kernel/include/rtc.h>
 #include <lib/include/heap_sort.h>
 #include <kernel/include/timer.h>
+#include <kernel/include/hrtimer.h>
 #include <filesystem/include/devfs.h>
 #include <device/include/pseudo_terminal.h>
 #include <device/include/console.h>
@@ -63,14 +67,17 @@ static void
 init2(void)
 {
     probe_physical_memory(boot_info);
+    page_frame_array_init();
     kernel_vma_init();
     paging_fault_init();
     paging_init();
     malloc_init();
+    slab_init();
 }
 static void
 init3(void)
 {
+    lapic_init();
     pit_init();
     keyboard_init();
     pci_init();
@@ -98,6 +105,8 @@ post_init(void)
    ptty_post_init();
    console_init();
    timer_init();
+   hrtimer_init();
+   buddy_post_init();
    pci_post_init();
    task_init();
    ethernet_rx_post_init();
@@ -14,10 +14,14 @@
 #include <filesystem/include/vfs.h>
 #include <filesystem/include/zeldafs.h>
 #include <kernel/include/elf.h>
+#include <kernel/include/image_cache.h>
+#include <memory/include/slab.h>
+#include <x86/include/tsc.h>
+#include <x86/include/pit.h>
 /*
  * The task state transition diagram, any exceptional transition is not allowed
  *
- *Running Queue            Blocking Queue                Exiting Queue
+ *Running Queue            Wait Queues                   Exiting Queue
  *  |                           |                             +
  *  | <--[TASK:STATE_RUNNING]   |                             |
  *  |                           |                             |
@@ -57,17 +61,46 @@
  *  |                           |
  *  v                           v
  */
-static struct list_elem task_list_head;
+/*
+ * The run queues hold the runnable tasks except `current`, the tasks are moved
+ * in and out by transit_state() as their states change, so picking the next
+ * task never looks at a blocked one. bit n of the bitmap is set if the nth
+ * run queue is not empty.
+ */
+static struct list_elem task_run_queues[NR_RUN_QUEUES];
+static uint32_t run_queue_bitmap;
+static uint32_t nr_running_tasks;
+/*
+ * The fair run queue of SCHED_CLASS_NORMAL, min_vruntime follows the vruntime
+ * of the picked tasks, a task which joins the queue again starts no earlier
+ * than it so that it can not monopolize the cpu after a long sleep.
+ */
+static struct avl_tree fair_tree;
+static uint64_t min_vruntime;
+/*
+ * 2^32 / weight of each priority, the weights are 1.25 times apart and
+ * the default priority weighs FAIR_WEIGHT_DEFAULT.
+ */
+static const uint32_t fair_weight_inverses[NR_TASK_PRIORITIES] = {
+    1717300, 2157191, 2708050, 3363326, 4194304, 5237765, 6557202, 8165337
+};
 static struct list_elem task_exit_list_head;
+/*
+ * the tasks which wait for the victims of out_of_memory() to exit, they are
+ * waken up each time an exited task is reclaimed.
+ */
+static struct wait_queue_head oom_wait_queue;
 static struct list_elem task_zombie_list_head;
-static struct list_elem task_blocking_list_head;
 struct task * current;
 static uint32_t __ready_to_schedule;
 static struct task * kernel_idle_task = NULL;
+// the userland init task is never killed by the OOM killer.
+static uint32_t init_task_id = (uint32_t)-1;
 static enum task_state transition_table[TASK_STATE_MAX][TASK_STATE_MAX];
 static struct hash_node kernel_task_hash_heads[KERNEL_TASK_HASH_TABLE_SIZE];
 static struct hash_stub kernel_task_hash_stub;
 static uint32_t task_seed = 0x0;
+static struct kmem_cache * task_cache;
 static void
 kernel_task_hash_table_init(void)
 {
@@ -148,14 +181,76 @@ task_state_to_string(enum task_state stat)
     }
     return str;
 }
+static int32_t
+fair_compare(struct avl_node * node0, struct avl_node * node1)
+{
+    struct task * task0 = CONTAINER_OF(node0, struct task, fair_node);
+    struct task * task1 = CONTAINER_OF(node1, struct task, fair_node);
+    if (task0->vruntime != task1->vruntime)
+        return task0->vruntime < task1->vruntime ? -1 : 1;
+    if (task0->task_id == task1->task_id)
+        return 0;
+    return task0->task_id < task1->task_id ? -1 : 1;
+}
+
+static void
+__enqueue_task(struct task * task)
+{
+    uint32_t queue = TASK_RUN_QUEUE(task);
+    ASSERT(!task->on_run_queue);
+    if (queue == FAIR_RUN_QUEUE) {
+        task->vruntime = MAX(task->vruntime, min_vruntime);
+        ASSERT(avl_tree_insert(&fair_tree, &task->fair_node) == OK);
+    } else {
+        list_append(&task_run_queues[queue], &task->list);
+    }
+    run_queue_bitmap |= 1 << queue;
+    task->on_run_queue = 1;
+    nr_running_tasks++;
+}
+
+static void
+__dequeue_task(struct task * task)
+{
+    uint32_t queue = TASK_RUN_QUEUE(task);
+    ASSERT(task->on_run_queue);
+    if (queue == FAIR_RUN_QUEUE) {
+        ASSERT(avl_tree_delete(&fair_tree, &task->fair_node) == OK);
+        if (!fair_tree.nr_nodes)
+            run_queue_bitmap &= ~(1 << queue);
+    } else {
+        list_unlink(&task_run_queues[queue], &task->list);
+        if (list_empty(&task_run_queues[queue]))
+            run_queue_bitmap &= ~(1 << queue);
+    }
+    task->on_run_queue = 0;
+    nr_running_tasks--;
+}
+
+/*
+ * change the state of a task, a task which is not `current` joins the run
+ * queue as it becomes runnable and leaves it as it blocks or exits,
+ * `current` is queued by schedule() as it's switched out.
+ */
 void
 transit_state(struct task * task, enum task_state target_state)
 {
     enum task_state prev_state;
+    uint32_t eflags = local_irq_save();
     prev_state = task->state;
     task->state = target_state;
     ASSERT(target_state < TASK_STATE_MAX);
     ASSERT(transition_table[prev_state][target_state]);
+    if (task != current && prev_state != target_state) {
+        if (target_state == TASK_STATE_RUNNING) {
+            __enqueue_task(task);
+        } else if (task->on_run_queue) {
+            __dequeue_task(task);
+            if (target_state == TASK_STATE_EXITING)
+                list_append(&task_exit_list_head, &task->list);
+        }
+    }
+    local_irq_restore(eflags);
     LOG_TRIVIA("Task:0x%x state transition from:%s to %s\n",
         task,
         task_state_to_string(prev_state),
@@ -170,10 +265,34 @@ set_work_directory(struct task * task, uint8_t * cwd)
     LOG_TRIVIA("Task:0x%x cwd changed to:%s\n", task, task->cwd);
 }
 
-struct list_elem *
-get_task_list_head(void)
+uint32_t
+get_nr_running_tasks(void)
+{
+    return nr_running_tasks;
+}
+
+/*
+ * change the static priority of a task, a queued task moves to the tail of
+ * its new run queue, the vruntime of a SCHED_CLASS_NORMAL task grows at the
+ * new weight from now on.
+ */
+int32_t
+set_task_priority(struct task * task, int32_t priority)
 {
-    return &task_list_head;
+    uint32_t eflags;
+    if (priority < TASK_PRIORITY_HIGHEST || priority > TASK_PRIORITY_LOWEST)
+        return -ERR_INVALID_ARG;
+    eflags = local_irq_save();
+    if (task->on_run_queue) {
+        __dequeue_task(task);
+        task->static_priority = priority;
+        __enqueue_task(task);
+    } else {
+        task->static_priority = priority;
+    }
+    local_irq_restore(eflags);
+    LOG_DEBUG("task:0x%x priority:%d\n", task, priority);
+    return OK;
 }
 
 int
@@ -194,18 +313,67 @@ schedule_disable(void)
     __ready_to_schedule = 0;
 }
 
+/*
+ * make a newly created task runnable
+ */
 void
 task_put(struct task * _task)
 {
-    list_append(&task_list_head, &_task->list);
+    uint32_t eflags = local_irq_save();
+    ASSERT(_task->state == TASK_STATE_RUNNING);
+    if (_task != current && !_task->on_run_queue)
+        __enqueue_task(_task);
+    local_irq_restore(eflags);
 }
+/*
+ * take the task at the head of the highest non-empty run queue, or the one
+ * with the smallest vruntime of the fair run queue,
+ * NULL if no task is runnable
+ */
 struct task *
 task_get(void)
 {
-    struct list_elem * _elem = list_fetch(&task_list_head);
-    if(!_elem)
+    uint32_t queue;
+    struct task * _task;
+    struct list_elem * _elem;
+    struct avl_node * _node;
+    if (!run_queue_bitmap)
         return NULL;
-    return CONTAINER_OF(_elem, struct task, list);
+    queue = bit_ffs(run_queue_bitmap);
+    if (queue == FAIR_RUN_QUEUE) {
+        _node = avl_tree_first(&fair_tree);
+        ASSERT(_node);
+        _task = CONTAINER_OF(_node, struct task, fair_node);
+        min_vruntime = MAX(min_vruntime, _task->vruntime);
+    } else {
+        _elem = list_first_elem(&task_run_queues[queue]);
+        ASSERT(_elem);
+        _task = CONTAINER_OF(_elem, struct task, list);
+    }
+    __dequeue_task(_task);
+    return _task;
+}
+
+/*
+ * charge the cycles since the task was switched in, cpu is where it's
+ * switched out.
+ */
+static void
+account_task_runtime(struct task * task,
+    struct x86_cpustate * cpu,
+    uint64_t now)
+{
+    uint64_t delta = now - task->exec_start;
+    // it's not switched in by schedule(), i.e. the boot context
+    if (!task->exec_start)
+        return;
+    if ((cpu->cs & 0x3) == DPL_3)
+        task->user_runtime += delta;
+    else
+        task->system_runtime += delta;
+    if (task->sched_class == SCHED_CLASS_NORMAL)
+        task->vruntime +=
+            (delta * fair_weight_inverses[task->static_priority]) >> 22;
 }
 /*
  * allocate a task structure, return NULL upon memory outage
@@ -214,11 +382,16 @@ struct task *
 malloc_task(void)
 {
     struct task * _task = NULL;
-    _task = malloc(sizeof(struct task));
+    _task = kmem_cache_alloc(task_cache);
     if (_task) {
         memset(_task, 0x0, sizeof(struct task));
         _task->task_id = task_seed++;
+        _task->sched_class = SCHED_CLASS_NORMAL;
+        _task->static_priority = TASK_PRIORITY_DEFAULT;
+        _task->start_time = jiffies;
         initialize_wait_queue_head(&_task->wq_termination);
+        initialize_wait_queue_entry(&_task->oom_wait, _task);
+        vm_area_tree_init(&_task->vma_tree);
     }
     return _task;
 }
@@ -229,48 +402,26 @@ free_task(struct task * _task)
     if (_task) {
         if(_task->privilege_level0_stack)
             free(_task->privilege_level0_stack);
-        free(_task);
+        kmem_cache_free(task_cache, _task);
     }
 }
 
-static void
-process_blocking_task_list(void)
-{
-    struct list_elem * _list = NULL;
-    struct task * _task = NULL;
-    LIST_FOREACH_START(&task_blocking_list_head, _list) {
-        _task = CONTAINER_OF(_list, struct task, list);
-        switch (_task->state)
-        {
-            case TASK_STATE_RUNNING:
-            case TASK_STATE_EXITING:
-                list_delete(&task_blocking_list_head, _list);
-                task_put(_task);
-                break;
-            case TASK_STATE_INTERRUPTIBLE:
-            case TASK_STATE_UNINTERRUPTIBLE:
-                break;
-            case TASK_STATE_ZOMBIE:
-                list_delete(&task_blocking_list_head, _list);
-                list_append(&task_zombie_list_head, _list);
-                break;
-            default:
-                __not_reach();
-                break;
-        }
-    }
-    LIST_FOREACH_END();
-}
 static void
 process_exit_task_list(void)
 {
     struct list_elem * _list = NULL;
     struct task * _task = NULL;
+    struct wait_queue * wait;
     while ((_list = list_fetch(&task_exit_list_head))) {
         _task = CONTAINER_OF(_list, struct task, list);
         ASSERT(_task->state == TASK_STATE_EXITING);
         wake_up(&_task->wq_termination);
         reclaim_task(_task);
+        // the memory of the task is given back
+        while ((_list = list_fetch(&oom_wait_queue.pivot))) {
+            wait = CONTAINER_OF(_list, struct wait_queue, list);
+            raw_task_wake_up(wait->task);
+        }
     }
 }
 /*
@@ -281,46 +432,43 @@ process_exit_task_list(void)
 uint32_t
 schedule(struct x86_cpustate * cpu)
 {
-    int terminate = 0;
     uint32_t esp = (uint32_t)cpu;
+    uint64_t now = rdtsc();
     struct task * _next_task = NULL;
 
+    // the tasks which exited in the previous rounds are off their stacks.
+    process_exit_task_list();
     if(current) {
-        if (current != kernel_idle_task)
-            task_put(current);
+        account_task_runtime(current, cpu, now);
+        if (current != kernel_idle_task) {
+            switch(current->state)
+            {
+                case TASK_STATE_RUNNING:
+                    __enqueue_task(current);
+                    break;
+                case TASK_STATE_EXITING:
+                    list_append(&task_exit_list_head, &current->list);
+                    LOG_DEBUG("task:0x%x is ready to exit\n", current);
+                    break;
+                case TASK_STATE_ZOMBIE:
+                    list_append(&task_zombie_list_head, &current->list);
+                    LOG_DEBUG("A zombie task:0x%x\n", current);
+                    break;
+                case TASK_STATE_INTERRUPTIBLE:
+                case TASK_STATE_UNINTERRUPTIBLE:
+                    // it's queued again once it's waken up or continued.
+                    break;
+                default:
+                    __not_reach();
+                    break;
+            }
+        }
         current = NULL;
     }
-    // process other auxiliary tasks queue
-    process_blocking_task_list();
-    process_exit_task_list();
     // pick next task to execute.
-    while ((_next_task = task_get())) {
-        switch(_next_task->state)
-        {
-            case TASK_STATE_EXITING:
-                list_append(&task_exit_list_head, &_next_task->list);
-                LOG_DEBUG("task:0x%x is ready to exit\n", _next_task);
-                break;
-            case TASK_STATE_RUNNING:
-                terminate = 1;
-                break;
-            case TASK_STATE_ZOMBIE:
-                list_append(&task_zombie_list_head, &_next_task->list);
-                LOG_DEBUG("A zombie task:0x%x\n", _next_task);
-                break;
-            case TASK_STATE_INTERRUPTIBLE:
-            case TASK_STATE_UNINTERRUPTIBLE:
-                list_append(&task_blocking_list_head, &_next_task->list);
-                break;
-            default:
-                __not_reach();
-                break;
-        }
-
-        if (terminate)
-            break;
-    }
+    _next_task = task_get();
     if(_next_task) {
+        ASSERT(_next_task->state == TASK_STATE_RUNNING);
         esp = (uint32_t)_next_task->cpu;
         current = _next_task;
         // Actually every time when the contexted switched from PL3 to PL0
@@ -336,7 +484,8 @@ schedule(struct x86_cpustate * cpu)
     }
     ASSERT(current);
     current->schedule_counter++;
-    enable_task_paging(current);
+    current->exec_start = now;
+    switch_task_paging(current);
     set_tss_privilege_level0_stack(current->privilege_level0_stack_top);
     return esp;
 }
@@ -353,9 +502,10 @@ reclaim_task(struct task * task)
     ASSERT(!task->list.prev);
     ASSERT(!task->list.next);
     // Do not access per-task memory any more
-    // XXX:Do NOT modify current PAGING layout, because task recycling only
-    // happens when it's in non-running task queues.
-    // enable_kernel_paging();
+    // XXX:the task is not running, but its page directory may be still
+    // loaded for the kernel task which runs after it.
+    unload_task_paging(task);
+    remove_wait_queue_entry(&oom_wait_queue, &task->oom_wait);
 
     // Evict all the userspace pages
     {
@@ -379,22 +529,23 @@ reclaim_task(struct task * task)
             _list = list_pop(&task->vma_list);
             ASSERT(_list);
             _vma = CONTAINER_OF(_list, struct vm_area, list);
-            free(_vma);
+            free_vm_area(_vma);
         }
+        vm_area_tree_init(&task->vma_tree);
     }
     // close all the file descriptor
     {
         int idx = 0;
         int32_t vfs_result = 0;
-        for (idx = 0; idx < MAX_FILE_DESCRIPTR_PER_TASK; idx++) {
-            if (!task->file_entries[idx].valid)
-                continue;
-            ASSERT(task->file_entries[idx].file);
-            vfs_result = do_vfs_close(task->file_entries[idx].file);
-            task->file_entries[idx].valid = 0;
-            task->file_entries[idx].writable = 0;
-            task->file_entries[idx].offset = 0;
-            task->file_entries[idx].file = NULL;
+        for (idx = bitmap_find_first_set(task->fd_bitmap,
+                MAX_FILE_DESCRIPTR_PER_TASK, 0);
+            idx >= 0;
+            idx = bitmap_find_first_set(task->fd_bitmap,
+                MAX_FILE_DESCRIPTR_PER_TASK, idx + 1)) {
+            ASSERT(task->file_entries[idx]);
+            vfs_result = put_file_entry(task->file_entries[idx]);
+            task->file_entries[idx] = NULL;
+            bitmap_clear(task->fd_bitmap, idx);
             LOG_TRIVIA("close remaining open file descriptor: {task:0x%x, "
                 "fd:%d, result:%d}\n", task, idx,vfs_result);
         }
@@ -414,13 +565,17 @@ dump_tasks(void)
 {
     struct list_elem * _elem;
     struct task * _task;
-    LOG_INFO("Dump tasks:\n");
-    LIST_FOREACH_START(&task_list_head, _elem) {
-        _task = CONTAINER_OF(_elem, struct task, list);
-        LOG_INFO("task-%d(0x%x) program:%s entry:0x%x\n",
-            _task->task_id, _task, _task->name, _task->entry);
+    int idx;
+    LOG_INFO("Dump tasks(runnable:%d):\n", nr_running_tasks);
+    for (idx = 0; idx < KERNEL_TASK_HASH_TABLE_SIZE; idx++) {
+        LIST_FOREACH_START(&kernel_task_hash_heads[idx], _elem) {
+            _task = CONTAINER_OF(_elem, struct task, node);
+            LOG_INFO("task-%d(0x%x) program:%s entry:0x%x state:%s\n",
+                _task->task_id, _task, _task->name, _task->entry,
+                task_state_to_string(_task->state));
+        }
+        LIST_FOREACH_END();
     }
-    LIST_FOREACH_END();
 }
 /*
  * This is self-explanatory, it will create a task which runs at PL0.
@@ -480,10 +635,142 @@ create_kernel_task(void (*entry)(void),
     // other sub-system as new data structure, the task is messed up.
     return OK;
     task_error:
-        if (task) {
-            if (task->privilege_level0_stack)
-                free(task->privilege_level0_stack);
-            free(task);
+        free_task(task);
+    return ret;
+}
+/*
+ * Duplicate the PL3 task `parent` which traps into kernel with `cpu`, the
+ * child shares all the pages with parent in copy-on-write manner, and returns
+ * to userland with the same context except that the return value is 0.
+ * OK is returned if successful and *ptask_id is set to the child's task id.
+ */
+uint32_t
+fork_task(struct task * parent, struct x86_cpustate * cpu, uint32_t * ptask_id)
+{
+    int idx;
+    uint32_t ret = -ERR_OUT_OF_MEMORY;
+    uint32_t cpu_offset;
+    struct vm_area * _vma;
+    struct vm_area * _child_vma;
+    struct list_elem * _list;
+    struct x86_cpustate * child_cpu;
+    struct task * child = NULL;
+    ASSERT(parent->privilege_level == DPL_3);
+    if (parent->signal_scheduled) {
+        LOG_DEBUG("task:0x%x can not fork in signal context\n", parent);
+        return -ERR_INVALID_ARG;
+    }
+    child = malloc_task();
+    if (!child)
+        goto task_error;
+    child->privilege_level = DPL_3;
+    child->state = TASK_STATE_RUNNING;
+    child->sched_class = parent->sched_class;
+    child->static_priority = parent->static_priority;
+    child->entry = parent->entry;
+    strcpy_safe(child->name, parent->name, sizeof(child->name));
+    strcpy_safe(child->cwd, parent->cwd, sizeof(child->cwd));
+    /*
+     * 1. PL0 stacks, the trap frame is put at the same offset as parent's.
+     */
+    child->privilege_level0_stack =
+        malloc_align_mapped(DEFAULT_TASK_PRIVILEGED_STACK_SIZE, 4);
+    if (!child->privilege_level0_stack)
+        goto task_error;
+    child->privilege_level0_stack_top = (uint32_t)child->privilege_level0_stack
+        + (parent->privilege_level0_stack_top -
+        (uint32_t)parent->privilege_level0_stack);
+    child->signaled_privilege_level0_stack =
+        malloc_align_mapped(DEFAULT_TASK_PRIVILEGED_SIGNAL_STACK_SIZE, 4);
+    if (!child->signaled_privilege_level0_stack)
+        goto task_error;
+    child->signaled_privilege_level0_stack_top =
+        (uint32_t)child->signaled_privilege_level0_stack +
+        (parent->signaled_privilege_level0_stack_top -
+        (uint32_t)parent->signaled_privilege_level0_stack);
+    cpu_offset = (uint32_t)cpu - (uint32_t)parent->privilege_level0_stack;
+    ASSERT(cpu_offset < DEFAULT_TASK_PRIVILEGED_STACK_SIZE);
+    child_cpu = (struct x86_cpustate *)
+        ((uint32_t)child->privilege_level0_stack + cpu_offset);
+    memcpy(child_cpu, cpu, sizeof(struct x86_cpustate));
+    SYSCALL_RETURN(child_cpu) = 0;
+    child->cpu = child_cpu;
+    child->interrupt_depth = 1;
+    /*
+     * 2. duplicate the vm areas and share their pages
+     */
+    child->page_directory = (uint32_t *)get_zeroed_base_page();
+    if (!child->page_directory)
+        goto vma_error;
+    LIST_FOREACH_START(&parent->vma_list, _list) {
+        _vma = CONTAINER_OF(_list, struct vm_area, list);
+        _child_vma = malloc_vm_area();
+        if (!_child_vma) {
+            ret = -ERR_OUT_OF_MEMORY;
+            goto vma_error;
+        }
+        memcpy(_child_vma, _vma, sizeof(struct vm_area));
+        _child_vma->list.prev = NULL;
+        _child_vma->list.next = NULL;
+        if (_child_vma->file)
+            _child_vma->file->refer_count++;
+        ASSERT(attach_vm_area(&child->vma_list,
+            &child->vma_tree,
+            _child_vma) == OK);
+        if (_vma->kernel_vma)
+            continue;
+        ret = userspace_fork_vm_area(parent, child, _vma);
+        if (ret != OK)
+            goto vma_error;
+    }
+    LIST_FOREACH_END();
+    /*
+     * 3. signal dispositions and file descriptors are inherited, the open
+     *    file descriptions(thus the file offsets) are shared.
+     */
+    memcpy(child->sig_entries, parent->sig_entries, sizeof(child->sig_entries));
+    for (idx = 0; idx < SIG_MAX; idx++)
+        child->sig_entries[idx].signaled = 0;
+    for (idx = bitmap_find_first_set(parent->fd_bitmap,
+            MAX_FILE_DESCRIPTR_PER_TASK, 0);
+        idx >= 0;
+        idx = bitmap_find_first_set(parent->fd_bitmap,
+            MAX_FILE_DESCRIPTR_PER_TASK, idx + 1)) {
+        child->file_entries[idx] = get_file_entry(parent->file_entries[idx]);
+        bitmap_set(child->fd_bitmap, idx);
+    }
+    /*
+     * 4. the parent's writable pages turn read-only, flush its TLB.
+     */
+    enable_task_paging(parent);
+    ASSERT(OK == register_task_in_task_table(child));
+    task_put(child);
+    if (ptask_id)
+        *ptask_id = child->task_id;
+    LOG_DEBUG("task-%d:0x%x forked task-%d:0x%x\n",
+        parent->task_id, parent, child->task_id, child);
+    return OK;
+    vma_error:
+        LIST_FOREACH_START(&child->vma_list, _list) {
+            _vma = CONTAINER_OF(_list, struct vm_area, list);
+            if (!_vma->kernel_vma)
+                userspace_evict_vma(child, _vma);
+        }
+        LIST_FOREACH_END();
+        while (!list_empty(&child->vma_list)) {
+            _list = list_pop(&child->vma_list);
+            _vma = CONTAINER_OF(_list, struct vm_area, list);
+            free_vm_area(_vma);
+        }
+        vm_area_tree_init(&child->vma_tree);
+        if (child->page_directory)
+            free_base_page((uint32_t)child->page_directory);
+        enable_task_paging(parent);
+    task_error:
+        if (child) {
+            if (child->signaled_privilege_level0_stack)
+                free(child->signaled_privilege_level0_stack);
+            free_task(child);
         }
     return ret;
 }
@@ -657,6 +944,54 @@ unregister_task_from_task_table(struct task * task)
     return result;
 }
 
+/*
+ * fill the memory accounting of a task entry, the page directory counts as a
+ * page table page.
+ */
+static void
+fill_taskent_mm_stat(struct taskent * taskp, struct task * _task)
+{
+    struct list_elem * _list;
+    struct vm_area * _vma;
+    taskp->resident_size = _task->mm_stat.nr_resident_pages * PAGE_SIZE;
+    taskp->page_table_size = (_task->mm_stat.nr_page_tables +
+        (_task->page_directory ? 1 : 0)) * PAGE_SIZE;
+    taskp->nr_page_faults = _task->mm_stat.nr_page_faults;
+    taskp->nr_cow_faults = _task->mm_stat.nr_cow_faults;
+    taskp->privileged_stack_size =
+        (_task->privilege_level0_stack ?
+            DEFAULT_TASK_PRIVILEGED_STACK_SIZE : 0) +
+        (_task->signaled_privilege_level0_stack ?
+            DEFAULT_TASK_PRIVILEGED_SIGNAL_STACK_SIZE : 0);
+    taskp->virtual_size = 0;
+    taskp->heap_size = 0;
+    LIST_FOREACH_START(&_task->vma_list, _list) {
+        _vma = CONTAINER_OF(_list, struct vm_area, list);
+        if (_vma->kernel_vma)
+            continue;
+        taskp->virtual_size += (uint32_t)_vma->length;
+        if (!strcmp(_vma->name, (uint8_t *)USER_VMA_HEAP))
+            taskp->heap_size = (uint32_t)_vma->length;
+    }
+    LIST_FOREACH_END();
+}
+
+static void
+fill_taskent_cpu_stat(struct taskent * taskp, struct task * _task)
+{
+    uint64_t elapsed = div_u64_u32((jiffies - _task->start_time) * 1000, HZ);
+    uint64_t busy = tsc_to_ms(_task->user_runtime + _task->system_runtime);
+    taskp->user_time = (uint32_t)tsc_to_ms(_task->user_runtime);
+    taskp->system_time = (uint32_t)tsc_to_ms(_task->system_runtime);
+    // the divisor of div_u64_u32 is 32-bit, scale down after 49 days.
+    while (elapsed >> 32) {
+        elapsed >>= 1;
+        busy >>= 1;
+    }
+    taskp->cpu_usage = elapsed ?
+        (uint32_t)div_u64_u32(busy * 1000, (uint32_t)elapsed) : 0;
+}
+
 uint32_t
 do_task_traverse(struct taskent * taskp, int32_t count)
 {
@@ -681,6 +1016,10 @@ do_task_traverse(struct taskent * taskp, int32_t count)
                 strcpy_safe(taskp[nr_task].cwd,
                     _task->cwd,
                     sizeof(taskp[nr_task].cwd));
+                fill_taskent_mm_stat(&taskp[nr_task], _task);
+                taskp[nr_task].sched_class = _task->sched_class;
+                taskp[nr_task].priority = _task->static_priority;
+                fill_taskent_cpu_stat(&taskp[nr_task], _task);
                 nr_task++;
             } else {
                 to_terminate = 1;
@@ -693,15 +1032,90 @@ do_task_traverse(struct taskent * taskp, int32_t count)
     }
     return nr_task;
 }
+/*
+ * The last resort when the page frames run out even after the shrinkers are
+ * called: the PL3 task with the largest resident set is killed, the init
+ * task is exempted. Only one victim is killed at a time, while a task is
+ * still exiting or being killed, its memory is about to be reclaimed and no
+ * other task is chosen.
+ * return OK if a victim is killed or pending, the caller waits for it to
+ * exit with wait_for_memory(). return -ERR_NOT_FOUND if there is no task to kill.
+ */
+int32_t
+out_of_memory(void)
+{
+    int idx = 0;
+    struct hash_node * _node = NULL;
+    struct task * _task = NULL;
+    struct task * victim = NULL;
+    for (idx = 0; idx < KERNEL_TASK_HASH_TABLE_SIZE; idx++) {
+        LIST_FOREACH_START(&kernel_task_hash_heads[idx], _node) {
+            _task = CONTAINER_OF(_node, struct task, node);
+            if (_task->privilege_level != DPL_3 ||
+                _task->task_id == init_task_id)
+                continue;
+            if (_task->state == TASK_STATE_EXITING ||
+                _task->sig_entries[SIGKILL].signaled)
+                return OK;
+            if (!victim || _task->mm_stat.nr_resident_pages >
+                victim->mm_stat.nr_resident_pages)
+                victim = _task;
+        }
+        LIST_FOREACH_END();
+    }
+    if (!victim)
+        return -ERR_NOT_FOUND;
+    LOG_WARN("Out of memory: kill task-%d(%s) with %d resident pages\n",
+        victim->task_id,
+        victim->name,
+        victim->mm_stat.nr_resident_pages);
+    signal_task(victim, SIGKILL);
+    return OK;
+}
+
+/*
+ * put current task to sleep until a task exits and its memory is reclaimed,
+ * it's called from the page fault handler once out_of_memory() returns OK so
+ * that the faulting task does not spin while a victim can not exit yet. The
+ * faulting instruction is retried as the task is resumed.
+ * a signal pending to the PL3 context is delivered on the way back instead.
+ * return -ERR_BUSY if there is no task context to wait in, or OK with the esp
+ * of the task to switch to.
+ */
+int32_t
+wait_for_memory(struct x86_cpustate * cpu, uint32_t * p_esp)
+{
+    if (!current || current == kernel_idle_task || !ready_to_schedule())
+        return -ERR_BUSY;
+    if (!signal_pending(current) || (cpu->cs & 0x3) != DPL_3) {
+        add_wait_queue_entry(&oom_wait_queue, &current->oom_wait);
+        transit_state(current, TASK_STATE_INTERRUPTIBLE);
+    }
+    *p_esp = schedule(cpu);
+    return OK;
+}
 /*
  * This is the kernel idle task which will always be selected and select 
+ *
+ * When nothing is runnable, the periodic tick is stopped until the earliest
+ * timer expires or another interrupt arrives.
  */
 static void
 kernel_idle_task_body(void)
 {
     do {
-        sti();
-        hlt();
+        // Clear the spare base pages and frames before the cpu goes to sleep
+        refill_zeroed_base_pages();
+        refill_zeroed_page_frames();
+        cli();
+        if (!get_nr_running_tasks())
+            tick_nohz_idle_enter();
+        // `sti` takes effect after `hlt`, no wakeup is lost in between.
+        asm volatile("sti;"
+            "hlt;");
+        // run the tasks waken up by the interrupt without waiting a tick.
+        if (get_nr_running_tasks())
+            yield_cpu();
     } while (1);
 }
 
@@ -709,6 +1123,12 @@ kernel_idle_task_body(void)
 void
 task_init(void)
 {
+    task_cache = kmem_cache_create((const uint8_t *)"task",
+        sizeof(struct task),
+        sizeof(uint32_t));
+    ASSERT(task_cache);
+    userspace_vma_init();
+    image_cache_init();
     task_misc_init();
     task_signal_sub_init();
     ASSERT(OK == create_kernel_task(kernel_idle_task_body,
@@ -717,12 +1137,13 @@ task_init(void)
     ASSERT(kernel_idle_task);
     LOG_INFO("registered kernel idle task:0x%x\n", kernel_idle_task);
     {
-        struct zelda_file * zfile = search_zelda_file(USERLAND_INIT_PATH);
-        ASSERT(zfile);
-        ASSERT(!validate_static_elf32_format(zfile->content, zfile->length));
-        ASSERT(!load_static_elf32(zfile->content,
+        struct file * file = do_vfs_open((uint8_t *)USERLAND_INIT_PATH,
+            O_RDONLY, 0x0);
+        ASSERT(file);
+        ASSERT(!load_static_elf32_file(file,
             (uint8_t *)"cwd=\"/\" tty=/dev/console "USERLAND_INIT_PATH"",
-            NULL));
+            &init_task_id));
+        ASSERT(!do_vfs_close(file));
     }
     dump_tasks();
 }
@@ -730,11 +1151,17 @@ task_init(void)
 __attribute__((constructor)) void
 task_pre_init(void)
 {
+    int idx;
     current = NULL;
     __ready_to_schedule = 0;
-    list_init(&task_list_head);
+    for (idx = 0; idx < NR_RUN_QUEUES; idx++)
+        list_init(&task_run_queues[idx]);
+    run_queue_bitmap = 0;
+    nr_running_tasks = 0;
+    avl_tree_init(&fair_tree, fair_compare, NULL);
+    min_vruntime = 0;
     list_init(&task_exit_list_head);
     list_init(&task_zombie_list_head);
-    list_init(&task_blocking_list_head);
+    initialize_wait_queue_head(&oom_wait_queue);
     kernel_task_hash_table_init();
 }
@@ -7,11 +7,15 @@
 #include <kernel/include/system_call.h>
 #include <kernel/include/zelda_posix.h>
 #include <kernel/include/timer.h>
+#include <kernel/include/hrtimer.h>
+#include <kernel/include/clocksource.h>
 #include <lib/include/string.h>
 #include <filesystem/include/vfs.h>
 #include <kernel/include/userspace_vma.h>
 #include <memory/include/malloc.h>
 #include <kernel/include/elf.h>
+#include <kernel/include/userspace_mmap.h>
+#include <x86/include/gdt.h>
 
 #define CPU_YIELD_TRAP_VECTOR 0x88
 
@@ -45,6 +49,45 @@ sleep(uint32_t milisecond)
     return ret;
 }
 
+static void
+hrtimer_sleep_callback(struct hrtimer * hrtimer, void * priv)
+{
+    struct task * _task = (struct task *)priv;
+    raw_task_wake_up(_task);
+}
+
+int32_t
+nanosleep(uint64_t nanosecond, uint64_t * remaining)
+{
+    int ret = OK;
+    uint64_t now;
+    uint32_t eflags;
+    struct hrtimer hrtimer;
+    memset(&hrtimer, 0x0, sizeof(hrtimer));
+    ASSERT(current);
+    hrtimer.state = timer_state_idle;
+    hrtimer.expires = ktime_get_ns() + nanosecond;
+    hrtimer.priv = current;
+    hrtimer.callback = hrtimer_sleep_callback;
+    // the timer may expire in no time, it must not fire before the task
+    // goes to sleep.
+    eflags = local_irq_save();
+    register_hrtimer(&hrtimer);
+    transit_state(current, TASK_STATE_INTERRUPTIBLE);
+    yield_cpu();
+    local_irq_restore(eflags);
+    if (signal_pending(current)) {
+        if (!hrtimer_detached(&hrtimer))
+            cancel_hrtimer(&hrtimer);
+        now = ktime_get_ns();
+        if (remaining)
+            *remaining = hrtimer.expires > now ? hrtimer.expires - now : 0;
+        ret = -ERR_INTERRUPTED;
+    }
+    ASSERT(hrtimer_detached(&hrtimer));
+    return ret;
+}
+
 void
 yield_cpu(void)
 {
@@ -97,6 +140,39 @@ call_sys_sleep(struct x86_cpustate * cpu, uint32_t milisecond)
 {
     return sleep(milisecond);
 }
+
+static int32_t
+call_sys_clock_gettime(struct x86_cpustate * cpu,
+    uint32_t clock_id,
+    struct timespec * tp)
+{
+    uint64_t now;
+    if (clock_id != CLOCK_MONOTONIC)
+        return -ERR_NOT_SUPPORTED;
+    now = ktime_get_ns();
+    tp->tv_sec = (int32_t)div_u64_u32(now, NSEC_PER_SEC);
+    tp->tv_nsec = (int32_t)(now - (uint64_t)tp->tv_sec * NSEC_PER_SEC);
+    return OK;
+}
+
+static int32_t
+call_sys_nanosleep(struct x86_cpustate * cpu,
+    struct timespec * req,
+    struct timespec * rem)
+{
+    int32_t ret;
+    uint64_t remaining = 0;
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= NSEC_PER_SEC)
+        return -ERR_INVALID_ARG;
+    ret = nanosleep((uint64_t)req->tv_sec * NSEC_PER_SEC + req->tv_nsec,
+        &remaining);
+    if (ret == -ERR_INTERRUPTED && rem) {
+        rem->tv_sec = (int32_t)div_u64_u32(remaining, NSEC_PER_SEC);
+        rem->tv_nsec = (int32_t)(remaining -
+            (uint64_t)rem->tv_sec * NSEC_PER_SEC);
+    }
+    return ret;
+}
 // If task_id lower than 0. we send signal to `current`
 
 static int32_t
@@ -123,15 +199,9 @@ call_sys_kill(struct x86_cpustate * cpu, uint32_t task_id, uint32_t signal)
 static int32_t
 search_unoccupied_file_descriptor(struct task * task)
 {
-    int idx = 0;
-    int32_t result = -1;
-    for (idx = 0; idx < MAX_FILE_DESCRIPTR_PER_TASK; idx++) {
-        if (!task->file_entries[idx].valid) {
-            result = idx;
-            break;
-        }
-    }
-    return result;   
+    return bitmap_find_first_zero(task->fd_bitmap,
+        MAX_FILE_DESCRIPTR_PER_TASK,
+        0);
 }
 
 static int32_t
@@ -152,7 +222,7 @@ call_sys_open(struct x86_cpustate * cpu,
         return -ERR_OUT_OF_RESOURCE;
     }
     ASSERT(fd >= 0 && fd < MAX_FILE_DESCRIPTR_PER_TASK);
-    ASSERT(!current->file_entries[fd].valid);
+    ASSERT(!current->file_entries[fd]);
     if (flags & O_CREAT) {
         file = do_vfs_create(path, flags, mode);
         if (!file) {
@@ -163,15 +233,16 @@ call_sys_open(struct x86_cpustate * cpu,
     if (!file) {
         return -ERR_GENERIC;
     }
-    current->file_entries[fd].writable = 0;
-    current->file_entries[fd].valid = 1;
-    current->file_entries[fd].file = file;
-    current->file_entries[fd].offset = 0;
-    if ((flags & O_WRONLY) || (flags & O_RDWR)) {
-        current->file_entries[fd].writable = 1;
+    // a file without write support is never opened writable.
+    current->file_entries[fd] = malloc_file_entry(file,
+        ((flags & O_WRONLY) || (flags & O_RDWR)) && file->ops->write);
+    if (!current->file_entries[fd]) {
+        do_vfs_close(file);
+        return -ERR_OUT_OF_MEMORY;
     }
+    bitmap_set(current->fd_bitmap, fd);
     if (((flags & O_WRONLY) || (flags & O_RDWR)) && (flags & O_TRUNC)) {
-        do_vfs_truncate(&current->file_entries[fd], 0x0);
+        do_vfs_truncate(current->file_entries[fd], 0x0);
     }
     LOG_TRIVIA("open a file {task:0x%x, path:%s, fd:%d}\n",
         current, path, fd);
@@ -186,14 +257,12 @@ call_sys_close(struct x86_cpustate * cpu, int32_t fd)
         return -ERR_INVALID_ARG;
     }
     ASSERT(current);
-    if (!current->file_entries[fd].valid) {
+    if (!current->file_entries[fd]) {
         return -ERR_INVALID_ARG;
     }
-    ret = do_vfs_close(current->file_entries[fd].file);
-    current->file_entries[fd].valid = 0;
-    current->file_entries[fd].writable = 0;
-    current->file_entries[fd].file = NULL;
-    current->file_entries[fd].offset = 0;
+    ret = put_file_entry(current->file_entries[fd]);
+    current->file_entries[fd] = NULL;
+    bitmap_clear(current->fd_bitmap, fd);
     LOG_TRIVIA("error closing file {task:0x%x, fd:%d, result:%d}\n",
         current, fd, ret);
     return ret;
@@ -208,10 +277,10 @@ call_sys_read(struct x86_cpustate * cpu,
     ASSERT(current);
     if (fd < 0 ||
         fd >= MAX_FILE_DESCRIPTR_PER_TASK ||
-        !current->file_entries[fd].valid) {
+        !current->file_entries[fd]) {
         return -ERR_INVALID_ARG;
     }
-    read_result = do_vfs_read(&current->file_entries[fd], buffer, size_to_read);
+    read_result = do_vfs_read(current->file_entries[fd], buffer, size_to_read);
     return read_result;
 }
 
@@ -225,10 +294,10 @@ call_sys_write(struct x86_cpustate * cpu,
     ASSERT(current);
     if (fd < 0 ||
         fd >= MAX_FILE_DESCRIPTR_PER_TASK ||
-        !current->file_entries[fd].valid) {
+        !current->file_entries[fd]) {
         return -ERR_INVALID_ARG;
     }
-    write_result = do_vfs_write(&current->file_entries[fd],
+    write_result = do_vfs_write(current->file_entries[fd],
         buffer, size_to_write);
     return write_result;
 }
@@ -241,10 +310,10 @@ call_sys_lseek(struct x86_cpustate * cpu,
     ASSERT(current);
     if (fd < 0 ||
         fd >= MAX_FILE_DESCRIPTR_PER_TASK ||
-        !current->file_entries[fd].valid) {
+        !current->file_entries[fd]) {
         return -ERR_INVALID_ARG;
     }
-    return do_vfs_lseek(&current->file_entries[fd],
+    return do_vfs_lseek(current->file_entries[fd],
         offset,
         whence);
 }
@@ -265,10 +334,10 @@ call_sys_fstat(struct x86_cpustate * cpu,
     ASSERT(current);
     if (fd < 0 ||
         fd >= MAX_FILE_DESCRIPTR_PER_TASK ||
-        !current->file_entries[fd].valid) {
+        !current->file_entries[fd]) {
         return -ERR_INVALID_ARG;
     }
-    file = current->file_entries[fd].file;
+    file = current->file_entries[fd]->file;
     ASSERT(file);
     if (!file->ops->stat) {
         return -ERR_NOT_SUPPORTED;
@@ -299,12 +368,58 @@ call_sys_sbrk(struct x86_cpustate * cpu, int32_t increment)
         return -1;
     }
     previous_program_break = (uint32_t)(data_vma->virt_addr + data_vma->length);
-    result = extend_vm_area(&current->vma_list,
+    result = extend_vm_area(&current->vma_tree,
         data_vma,
         VMA_EXTEND_UPWARD,
         increment);
     return result == OK ? previous_program_break : -1;
 }
+static uint32_t
+call_sys_mmap(struct x86_cpustate * cpu, struct mmap_args * args)
+{
+    uint32_t addr = 0;
+    ASSERT(current);
+    if (do_mmap(current, args, &addr) != OK)
+        return (uint32_t)MAP_FAILED;
+    return addr;
+}
+
+static uint32_t
+call_sys_munmap(struct x86_cpustate * cpu, uint32_t addr, uint32_t length)
+{
+    ASSERT(current);
+    return do_munmap(current, addr, length);
+}
+
+static uint32_t
+call_sys_mprotect(struct x86_cpustate * cpu,
+    uint32_t addr,
+    uint32_t length,
+    int32_t prot)
+{
+    ASSERT(current);
+    return do_mprotect(current, addr, length, prot);
+}
+
+/*
+ * set the priority of the PL3 task, or of the calling task if task_id is
+ * negative.
+ */
+static uint32_t
+call_sys_settaskpriority(struct x86_cpustate * cpu,
+    int32_t task_id,
+    int32_t priority)
+{
+    struct task * task;
+    ASSERT(current);
+    task = task_id < 0 ? current : search_task_by_id(task_id);
+    if (!task)
+        return -ERR_NOT_FOUND;
+    if (task->privilege_level != DPL_3)
+        return -ERR_NOT_SUPPORTED;
+    return set_task_priority(task, priority);
+}
+
 static uint32_t
 call_sys_isatty(struct x86_cpustate * cpu, int32_t fd)
 {
@@ -312,10 +427,10 @@ call_sys_isatty(struct x86_cpustate * cpu, int32_t fd)
     ASSERT(current);
     if (fd < 0||
         fd >= MAX_FILE_DESCRIPTR_PER_TASK ||
-        !current->file_entries[fd].valid) {
+        !current->file_entries[fd]) {
         return 0;
     }
-    file = current->file_entries[fd].file;
+    file = current->file_entries[fd]->file;
     ASSERT(file);
     if (!file->ops->isatty) {
         return 0;
@@ -334,10 +449,10 @@ call_sys_ioctl(struct x86_cpustate * cpu,
     ASSERT(current);
     if (fd < 0||
         fd >= MAX_FILE_DESCRIPTR_PER_TASK ||
-        !current->file_entries[fd].valid) {
+        !current->file_entries[fd]) {
         return -ERR_INVALID_ARG;
     }
-    file = current->file_entries[fd].file;
+    file = current->file_entries[fd]->file;
     ASSERT(file);
     if (!file->ops->ioctl) {
         return -ERR_NOT_SUPPORTED;
@@ -382,52 +497,6 @@ call_sys_chdir(struct x86_cpustate * cpu, void * path)
     return OK;
 }
 
-static void *
-load_file_into_memory(uint8_t * path, int32_t * file_length)
-{
-    void * buffer = NULL;
-    struct stat _stat;
-    struct file * file = do_vfs_open(path, O_RDONLY, 0x0);
-    struct file_entry entry;
-    memset(&_stat, 0x0, sizeof(_stat));
-    memset(&entry, 0x0, sizeof(entry));
-    if (!file)
-        goto error_out;
-    if (file->type != FILE_TYPE_REGULAR)
-        goto error_file;
-    if (do_vfs_stat(path, &_stat))
-        goto error_file;
-    if (_stat.st_size <= 0)
-        goto error_file;
-    buffer = malloc_mapped(_stat.st_size);
-    if (!buffer)
-        goto error_file;
-    entry.file = file;
-    entry.offset = 0x0;
-    {
-        uint32_t left = _stat.st_size;
-        uint32_t index = 0;
-        uint32_t rc = 0;
-        while(left > 0) {
-            rc = do_vfs_read(&entry, ((uint8_t *)buffer) + index, left);
-            if (rc <= 0)
-                break;
-            left -= rc;
-            index += rc;
-        }
-        if (left > 0)
-            goto error_buff;
-    }
-    *file_length = _stat.st_size;
-    return buffer;
-    error_buff:
-        if (buffer)
-            free(buffer);
-    error_file:
-        ASSERT(!do_vfs_close(file));
-    error_out:
-        return NULL;
-}
 static uint32_t
 call_sys_execve(struct x86_cpustate * cpu,
     uint8_t * filename,
@@ -435,8 +504,7 @@ call_sys_execve(struct x86_cpustate * cpu,
     uint8_t ** envp)
 {
     uint32_t ret = -ERR_GENERIC;
-    void * file_memory = NULL;
-    int32_t file_length = 0x0;
+    struct file * file = NULL;
     int32_t task_id = -1;
 
     uint8_t absolute_path[MAX_PATH];
@@ -480,28 +548,25 @@ call_sys_execve(struct x86_cpustate * cpu,
         }
         LOG_DEBUG("Elf32 command line:%s\n", commands_line); 
     }
-    file_memory = load_file_into_memory(absolute_path, &file_length);
-    if (!file_memory) {
-        LOG_ERROR("Elf32 loading file:%s into memory fails\n", absolute_path);
-        goto error_out;
-    }
-    if (validate_static_elf32_format(file_memory, file_length)) {
-        LOG_ERROR("Elf32 error validating file format(length:%d)\n",
-            file_length);
+    file = do_vfs_open(absolute_path, O_RDONLY, 0x0);
+    if (!file) {
+        LOG_ERROR("Elf32 opening file:%s fails\n", absolute_path);
         goto error_out;
     }
-    if (load_static_elf32(file_memory, commands_line, (uint32_t *)&task_id)) {
+    /*
+     * The program segments are paged in from the file, the task's vm areas
+     * hold their own references to it.
+     */
+    if (load_static_elf32_file(file, commands_line, (uint32_t *)&task_id)) {
         LOG_ERROR("Elf32 error loading program:%s\n", absolute_path);
         goto error_out;
     }
     ASSERT(task_id >= 0);
     ret = task_id;
-    free(file_memory);
-    return ret;
 
     error_out:
-        if (file_memory)
-            free(file_memory);
+        if (file)
+            ASSERT(!do_vfs_close(file));
         return ret;
 }
 static struct utsname zelda_uts = {
@@ -558,6 +623,21 @@ call_sys_getdents(struct x86_cpustate * cpu,
     return do_vfs_getdents(absolute_path, dirp, count);
 }
 
+/*
+ * the child's task id is returned to parent, and 0 to child.
+ */
+static int32_t
+call_sys_fork(struct x86_cpustate * cpu)
+{
+    int32_t ret;
+    uint32_t task_id = 0;
+    ASSERT(current);
+    ret = fork_task(current, cpu, &task_id);
+    if (ret != OK)
+        return ret;
+    return task_id;
+}
+
 static uint32_t
 call_sys_gettaskents(struct x86_cpustate * cpu,
     struct taskent * taskp,
@@ -594,4 +674,13 @@ task_misc_init(void)
     register_system_call(SYS_GETDENTS_IDX, 3, (call_ptr)call_sys_getdents);
     register_system_call(SYS_GETTASKENTS_IDX, 2,
         (call_ptr)call_sys_gettaskents);
+    register_system_call(SYS_FORK_IDX, 0, (call_ptr)call_sys_fork);
+    register_system_call(SYS_MMAP_IDX, 1, (call_ptr)call_sys_mmap);
+    register_system_call(SYS_MUNMAP_IDX, 2, (call_ptr)call_sys_munmap);
+    register_system_call(SYS_MPROTECT_IDX, 3, (call_ptr)call_sys_mprotect);
+    register_system_call(SYS_SETTASKPRIORITY_IDX, 2,
+        (call_ptr)call_sys_settaskpriority);
+    register_system_call(SYS_CLOCK_GETTIME_IDX, 2,
+        (call_ptr)call_sys_clock_gettime);
+    register_system_call(SYS_NANOSLEEP_IDX, 2, (call_ptr)call_sys_nanosleep);
 }
@@ -5,23 +5,73 @@
 #include <kernel/include/elf.h>
 #include <kernel/include/printk.h>
 #include <memory/include/paging.h>
+#include <memory/include/buddy.h>
 #include <lib/include/string.h>
 #include <kernel/include/userspace_vma.h>
 #include <x86/include/gdt.h>
-int vma_in_task(struct task * task, struct vm_area * vma)
+#include <filesystem/include/vfs.h>
+#include <kernel/include/image_cache.h>
+/*
+ * whether the task's page directory is the one loaded in kernel page
+ * directory, a kernel task keeps running on the loaded one.
+ */
+static inline int
+task_paging_loaded(struct task * task)
 {
-    struct list_elem * _list;
-    struct vm_area * _vma;
-    int _found = 0;
-    LIST_FOREACH_START(&task->vma_list, _list) {
-        _vma = CONTAINER_OF(_list, struct vm_area, list);
-        if (_vma == vma){
-            _found = 1;
-            break;
-        }
+    return task->page_directory &&
+        task->page_directory == get_loaded_user_page_directory();
+}
+
+/*
+ * propagate the change of the mapping at virt_addr to MMU if the task's page
+ * directory is loaded: the directory entry is copied again and the TLB entry
+ * is invalidated, so that no CR3 reload is needed.
+ */
+static void
+flush_task_page(struct task * task, uint32_t virt_addr)
+{
+    uint32_t pd_index = (virt_addr >> 22) & 0x3ff;
+    uint32_t * kernel_page_directory;
+    if (!task_paging_loaded(task))
+        return;
+    kernel_page_directory = (uint32_t *)get_kernel_page_directory();
+    kernel_page_directory[pd_index] = task->page_directory[pd_index];
+    flush_tlb_entry(virt_addr);
+}
+
+/*
+ * allocate a frame of anonymous memory for the task, the frame is tagged
+ * with its owner.
+ */
+static uint32_t
+get_user_page(struct task * task)
+{
+    uint32_t frame = get_page();
+    if (frame) {
+        set_page_frame_flags(frame, PAGE_FRAME_USER);
+        set_page_frame_owner(frame, task);
     }
-    LIST_FOREACH_END();
-    return _found;
+    return frame;
+}
+
+/*
+ * the same as get_user_page() but the frame is all zero, it's taken from
+ * the pre-zeroed pool if possible.
+ */
+static uint32_t
+get_zeroed_user_page(struct task * task)
+{
+    uint32_t frame = get_zeroed_page_frame();
+    if (frame) {
+        set_page_frame_flags(frame, PAGE_FRAME_USER);
+        set_page_frame_owner(frame, task);
+    }
+    return frame;
+}
+
+int vma_in_task(struct task * task, struct vm_area * vma)
+{
+    return vm_area_in_tree(&task->vma_tree, vma);
 }
 void
 dump_task_vm_areas(struct task * _task)
@@ -51,23 +101,12 @@ int
 userspace_map_vm_area(struct task * task, struct vm_area * vma)
 {
     int rc = 0;
-    int found = 0;
     int partially_mapped = 0;
-    struct list_elem * _list;
-    struct vm_area * _vma;
     uint64_t addr = 0;
     uint32_t v_addr = 0;
     uint32_t p_addr = 0;
 
-    LIST_FOREACH_START(&task->vma_list, _list) {
-        _vma = CONTAINER_OF(_list, struct vm_area, list);
-        if (_vma == vma) {
-            found = 1;
-            break;
-        }
-    }
-    LIST_FOREACH_END();
-    if (!found) {
+    if (!vma_in_task(task, vma)) {
         LOG_ERROR("The vma:0x%x is not in task:0x%x\n", vma, task);
         return -ERR_INVALID_ARG;
     }
@@ -76,7 +115,7 @@ userspace_map_vm_area(struct task * task, struct vm_area * vma)
         v_addr = (uint32_t)addr;
         // Prepare physical address
         if (!vma->exact) {
-            p_addr = get_page();
+            p_addr = get_user_page(task);
             if (!p_addr) {
                 LOG_DEBUG("can not allocate generic page for task:0x%x"
                     " vma:0x%x\n", task, vma);
@@ -124,14 +163,14 @@ userspace_map_page(struct task * task,
     }
     pde = PDE32_PTR(&task->page_directory[pd_index]);
     if(!pde->present) {
-        page_table = get_base_page();
+        page_table = get_zeroed_base_page();
         if(!page_table) {
             LOG_DEBUG("Failed to allocate page table for directory"
                 " vaddr:0x%x\n",
                 virt_addr);
             return -ERR_OUT_OF_MEMORY;
         }
-        memset((void*)page_table, 0x0, PAGE_SIZE);
+        task->mm_stat.nr_page_tables++;
         task->page_directory[pd_index] = create_pde32(
             PAGE_PERMISSION_READ_WRITE,
             PAGE_PERMISSION_USER,
@@ -144,6 +183,9 @@ userspace_map_page(struct task * task,
     }
     ASSERT(pde->present);
     page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
+    // a present page is remapped at copy on write
+    if (!PTE32_PTR(&page_table_ptr[pt_index])->present)
+        task->mm_stat.nr_resident_pages++;
     page_table_ptr[pt_index] = create_pte32(
         write_permission,
         PAGE_PERMISSION_USER,
@@ -153,6 +195,7 @@ userspace_map_page(struct task * task,
     pte = PTE32_PTR(&page_table_ptr[pt_index]);
     ASSERT(pte->present);
     ASSERT((pte->pg_frame << 12) == (phy_addr & (~PAGE_MASK)));
+    flush_task_page(task, virt_addr);
     return OK;
 }
 /*
@@ -183,8 +226,11 @@ reclaim_page_table(struct task * task, uint32_t virt_addr)
     if (non_empty) {
         return -ERR_BUSY;
     }
-    free_base_page((uint32_t)page_table_ptr);
     task->page_directory[pd_index] = 0x0;
+    flush_task_page(task, virt_addr);
+    free_base_page((uint32_t)page_table_ptr);
+    ASSERT(task->mm_stat.nr_page_tables);
+    task->mm_stat.nr_page_tables--;
     LOG_DEBUG("reclaim task:0x%x's page directory entry:0x%x\n",
         task, pd_index);
     return OK;
@@ -209,7 +255,7 @@ userspace_evict_page(struct task * task,
     struct vm_area * _vma = NULL;
     uint32_t * page_table_ptr = NULL;
     ASSERT(task->page_directory);
-    _vma = search_userspace_vma_by_addr(&task->vma_list, virt_addr);
+    _vma = search_userspace_vma_by_addr(&task->vma_tree, virt_addr);
     if (!_vma) {
         LOG_TRIVIA("find no vm area for task:0x%x's virt_addr:0x%x\n",
             task, virt_addr);
@@ -227,15 +273,84 @@ userspace_evict_page(struct task * task,
         return -ERR_NOT_PRESENT;   
     }
     phy_page = (((uint32_t)pte->pg_frame) << 12);
-    if (!_vma->exact) {
-        free_page(phy_page);
+    if (!_vma->exact && !(pte->available & PTE_FRAME_NOT_OWNED)) {
+        // the frame may be still shared with other tasks after fork.
+        if (get_page_frame_owner(phy_page) == task)
+            set_page_frame_owner(phy_page, NULL);
+        put_page_frame(phy_page);
     }
     page_table_ptr[pt_index] = 0x0;
+    flush_task_page(task, virt_addr);
+    ASSERT(task->mm_stat.nr_resident_pages);
+    task->mm_stat.nr_resident_pages--;
     if (_reclaim_page_table) {
         reclaim_page_table(task, virt_addr);
     }
     return OK;
 }
+
+/*
+ * return the pointer to the page table entry of the virtual address,
+ * NULL if the page table is not present.
+ */
+static uint32_t *
+userspace_pte_ptr(struct task * task, uint32_t virt_addr)
+{
+    uint32_t pd_index = (virt_addr >> 22) & 0x3ff;
+    uint32_t pt_index = (virt_addr >> 12) & 0x3ff;
+    struct pde32 * pde = PDE32_PTR(&task->page_directory[pd_index]);
+    uint32_t * page_table_ptr;
+    if (!pde->present)
+        return NULL;
+    page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
+    return &page_table_ptr[pt_index];
+}
+
+/*
+ * write the dirty pages of a MAP_SHARED file mapping back to the file, the
+ * pages mapped from the file directly need no write-back.
+ * The dirty bit of the PTE is moved to the frame as PAGE_FRAME_DIRTY, so the
+ * stores of the other tasks sharing the frame are written back as well, the
+ * flag is cleared only once the page is written back.
+ */
+static void
+userspace_writeback_vm_area(struct task * task, struct vm_area * vma)
+{
+    uint64_t addr;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t frame;
+    uint32_t * pte_ptr;
+    struct pte32 * pte;
+    if (!vma->file->ops->write)
+        return;
+    for (addr = vma->virt_addr;
+        addr < (vma->virt_addr + vma->length); addr += PAGE_SIZE) {
+        offset = (uint32_t)(addr - vma->virt_addr);
+        if (offset >= vma->file_size)
+            break;
+        pte_ptr = userspace_pte_ptr(task, (uint32_t)addr);
+        if (!pte_ptr)
+            continue;
+        pte = PTE32_PTR(pte_ptr);
+        if (!pte->present || (pte->available & PTE_FRAME_NOT_OWNED))
+            continue;
+        frame = pte->pg_frame << 12;
+        if (pte->dirty) {
+            set_page_frame_flags(frame, PAGE_FRAME_DIRTY);
+            pte->dirty = 0;
+        }
+        if (!(get_page_frame_flags(frame) & PAGE_FRAME_DIRTY))
+            continue;
+        length = MIN(PAGE_SIZE, vma->file_size - offset);
+        if (image_cache_writeback_page(frame,
+            vma->file,
+            vma->file_offset + offset,
+            length) == (int32_t)length)
+            clear_page_frame_flags(frame, PAGE_FRAME_DIRTY);
+    }
+}
+
 /*
  * Evict all pages in a vma, it automatically reclaim the unsed page 
  * tables and physical pages.
@@ -254,6 +369,8 @@ userspace_evict_vma(struct task * task, struct vm_area * vma)
     if (vma->kernel_vma)
         return -ERR_INVALID_ARG;
     LOG_DEBUG("Evict task:0x%x's %s\n", task, vma->name);
+    if (vma->shared && vma->file)
+        userspace_writeback_vm_area(task, vma);
     for (addr = vma->virt_addr;
         addr < (vma->virt_addr + vma->length); addr += PAGE_SIZE) {
         current_page_directory = (((uint32_t)addr) >> 22) & 0x3ff;
@@ -265,10 +382,68 @@ userspace_evict_vma(struct task * task, struct vm_area * vma)
     return OK;
 }
 
+/*
+ * Share the present pages of parent's vma with child, the vma must have been
+ * duplicated in child's vma_list.
+ * A writable page of a non-exact private vma is mapped read-only in both
+ * tasks and the frame gets one more reference, it's copied at the first
+ * write. The pages of MAP_SHARED vma stay writable in both tasks.
+ * return OK if all pages are shared, the caller must evict the child's vma
+ * otherwise.
+ */
+int
+userspace_fork_vm_area(struct task * parent,
+    struct task * child,
+    struct vm_area * vma)
+{
+    int rc;
+    uint64_t addr;
+    uint32_t * pte_ptr;
+    struct pte32 * pte;
+    uint32_t phy_addr;
+    uint8_t write_permission;
+    int not_owned;
+    ASSERT(!vma->kernel_vma);
+    for (addr = vma->virt_addr;
+        addr < (vma->virt_addr + vma->length); addr += PAGE_SIZE) {
+        pte_ptr = userspace_pte_ptr(parent, (uint32_t)addr);
+        if (!pte_ptr) {
+            // skip the whole page table
+            addr = (addr & ~((uint64_t)0x3fffff)) + 0x400000 - PAGE_SIZE;
+            continue;
+        }
+        pte = PTE32_PTR(pte_ptr);
+        if (!pte->present)
+            continue;
+        phy_addr = pte->pg_frame << 12;
+        write_permission = pte->write_permission;
+        not_owned = vma->exact || (pte->available & PTE_FRAME_NOT_OWNED);
+        if (!not_owned && !vma->shared) {
+            write_permission = PAGE_PERMISSION_READ_ONLY;
+            pte->write_permission = PAGE_PERMISSION_READ_ONLY;
+        }
+        rc = userspace_map_page(child,
+            (uint32_t)addr,
+            phy_addr,
+            write_permission,
+            vma->page_writethrough,
+            vma->page_cachedisable);
+        if (rc != OK)
+            return rc;
+        if (!not_owned)
+            get_page_frame(phy_addr);
+        else if (!vma->exact)
+            PTE32_PTR(userspace_pte_ptr(child, (uint32_t)addr))->available |=
+                PTE_FRAME_NOT_OWNED;
+    }
+    return OK;
+}
+
 /*
  * Load per-task page directory into PDBR(CR3), each time the per-task page
  * directory is about to be loaded, the kernel part of directory entries will
  * be copied to local directory.
+ * The kernel mappings are global, only userspace TLB entries are flushed.
  * TODO: need investigation on why Loading a different page directory into CR3
  * can cause a messy crash.
  * FIXME: currently we have a workaround: COPY pages directory entry to kernel
@@ -278,19 +453,35 @@ userspace_evict_vma(struct task * task, struct vm_area * vma)
 int
 enable_task_paging(struct task * task)
 {
-    int idx = 0;
-    uint32_t directory_index_top = USERSPACE_BOTTOM >> 12 >> 10;
-    uint32_t * kernel_page_directory = (uint32_t *)get_kernel_page_directory();
-    for(idx = directory_index_top; idx < 1024; idx++)
-        kernel_page_directory[idx] = task->page_directory ?
-            task->page_directory[idx] : 0x0;
-    __asm__ volatile("movl %%eax, %%cr3;"
-        :
-        :"a"(kernel_page_directory));
+    load_user_page_directory(task->page_directory);
     LOG_TRIVIA("enable page directory of task:0x%x\n", task);
     return OK;
 }
 
+/*
+ * Switch to the task's address space when it's scheduled. CR3 is reloaded
+ * only if the task's page directory is not the loaded one, a kernel task
+ * never touches userspace and runs on whatever is loaded.
+ */
+int
+switch_task_paging(struct task * task)
+{
+    if (!task->page_directory || task_paging_loaded(task))
+        return OK;
+    return enable_task_paging(task);
+}
+
+/*
+ * unload the task's page directory before it's released, the kernel page
+ * directory must not refer to its page tables any more.
+ */
+void
+unload_task_paging(struct task * task)
+{
+    if (task_paging_loaded(task))
+        enable_kernel_paging();
+}
+
 
 int
 userspace_remap_vm_area(struct task * task, struct vm_area * vma)
@@ -320,6 +511,176 @@ userspace_remap_vm_area(struct task * task, struct vm_area * vma)
     return OK;   
 }
 
+/*
+ * Apply vma's new permission to its present pages. A page becoming writable
+ * is left read-only, it's upgraded by the write fault which takes care of the
+ * shared frames.
+ */
+int
+userspace_protect_vm_area(struct task * task, struct vm_area * vma)
+{
+    uint64_t addr;
+    uint32_t * pte_ptr;
+    struct pte32 * pte;
+    if (vma->write_permission == PAGE_PERMISSION_READ_WRITE)
+        return OK;
+    for (addr = vma->virt_addr;
+        addr < (vma->virt_addr + vma->length); addr += PAGE_SIZE) {
+        pte_ptr = userspace_pte_ptr(task, (uint32_t)addr);
+        if (!pte_ptr) {
+            addr = (addr & ~((uint64_t)0x3fffff)) + 0x400000 - PAGE_SIZE;
+            continue;
+        }
+        pte = PTE32_PTR(pte_ptr);
+        if (pte->present) {
+            pte->write_permission = PAGE_PERMISSION_READ_ONLY;
+            flush_task_page(task, (uint32_t)addr);
+        }
+    }
+    return OK;
+}
+
+/*
+ * Copy on write: the frame is copied to a private one unless current task is
+ * the only user of the frame, in which case the page is made writable again.
+ * The image cache frames back the text of other tasks, a private page of
+ * them is always copied. The page of a MAP_SHARED vma is made writable in
+ * place, so is the image cache frame it's mapped to, which is the one frame
+ * of the file page all the MAP_SHARED mappings share.
+ * The file's own frames are never written, they are copied even for a
+ * MAP_SHARED vma, a file providing them is not writable anyway.
+ */
+static uint32_t
+handle_userspace_cow_fault(struct task * task,
+    struct vm_area * vma,
+    uint32_t linear_addr)
+{
+    uint32_t result;
+    uint32_t paddr;
+    uint32_t new_paddr;
+    uint32_t not_owned;
+    uint32_t page_cache;
+    uint32_t * pte_ptr = userspace_pte_ptr(task, linear_addr);
+    struct pte32 * pte;
+    ASSERT(pte_ptr);
+    pte = PTE32_PTR(pte_ptr);
+    ASSERT(pte->present);
+    not_owned = pte->available & PTE_FRAME_NOT_OWNED;
+    paddr = pte->pg_frame << 12;
+    page_cache = get_page_frame_flags(paddr) & PAGE_FRAME_PAGE_CACHE;
+    if (!not_owned && (vma->shared ||
+        (!page_cache && page_frame_refcount(paddr) == 1))) {
+        // the page of a file is about to be modified
+        if (vma->shared && vma->file)
+            set_page_frame_flags(paddr, PAGE_FRAME_DIRTY);
+        pte->write_permission = PAGE_PERMISSION_READ_WRITE;
+        flush_task_page(task, linear_addr);
+        return OK;
+    }
+    new_paddr = get_user_page(task);
+    if (!new_paddr) {
+        LOG_DEBUG("can not allocate page to copy on write for task:0x%x's "
+            "vma:0x%x\n", task, vma);
+        return -ERR_OUT_OF_RESOURCE;
+    }
+    copy_page_frame(new_paddr, paddr);
+    result = userspace_map_page(task,
+        linear_addr & ~PAGE_MASK,
+        new_paddr,
+        PAGE_PERMISSION_READ_WRITE,
+        vma->page_writethrough,
+        vma->page_cachedisable);
+    ASSERT(result == OK);
+    if (!not_owned)
+        put_page_frame(paddr);
+    LOG_TRIVIA("Copy on write task:0x%x's virt:0x%x phy:0x%x --> 0x%x\n",
+        task, linear_addr, paddr, new_paddr);
+    return OK;
+}
+
+/*
+ * Fill a page of file-backed vma: a read-only page which is completely
+ * covered by the file content is mapped to the file's own frame if the file
+ * can provide it, otherwise a frame is allocated and filled from the file.
+ * The file's own frames and the image cache frames of private vma are mapped
+ * read-only, a write to them is handled by the copy on write fault.
+ */
+static uint32_t
+handle_userspace_file_fault(struct task * task,
+    struct vm_area * vma,
+    uint32_t linear_addr)
+{
+    uint32_t result;
+    uint32_t paddr = 0;
+    uint32_t page_addr = linear_addr & ~PAGE_MASK;
+    uint32_t page_offset = page_addr - (uint32_t)vma->virt_addr;
+    uint32_t length;
+    struct file * file = vma->file;
+    uint32_t shared_page = vma->shared ||
+        vma->write_permission == PAGE_PERMISSION_READ_ONLY;
+    if (shared_page &&
+        (page_offset + PAGE_SIZE) <= vma->file_size &&
+        file->ops->page_frame)
+        paddr = file->ops->page_frame(file, vma->file_offset + page_offset);
+    if (paddr) {
+        result = userspace_map_page(task,
+            page_addr,
+            paddr,
+            PAGE_PERMISSION_READ_ONLY,
+            vma->page_writethrough,
+            vma->page_cachedisable);
+        if (result == OK)
+            PTE32_PTR(userspace_pte_ptr(task, page_addr))->available |=
+                PTE_FRAME_NOT_OWNED;
+        return result;
+    }
+    length = page_offset < vma->file_size ?
+        MIN(PAGE_SIZE, vma->file_size - page_offset) : 0;
+    /*
+     * The read-only pages are shared through the image cache by all the
+     * tasks running the same binary. The MAP_SHARED pages are the same
+     * frames mapped writable, the stores of one task are seen by all the
+     * others mapping the file, and they are written back to the file at
+     * munmap or exit. the writable private ones are copied.
+     */
+    if (shared_page) {
+        paddr = image_cache_get_page(file,
+            vma->file_offset + page_offset,
+            length);
+        if (!paddr) {
+            LOG_DEBUG("can not allocate image page for task:0x%x's "
+                "vma:0x%x\n", task, vma);
+            return -ERR_OUT_OF_RESOURCE;
+        }
+        result = userspace_map_page(task,
+            page_addr,
+            paddr,
+            vma->shared ? vma->write_permission : PAGE_PERMISSION_READ_ONLY,
+            vma->page_writethrough,
+            vma->page_cachedisable);
+        if (result != OK)
+            put_page_frame(paddr);
+        return result;
+    }
+    paddr = get_user_page(task);
+    if (!paddr) {
+        LOG_DEBUG("can not allocate page for task:0x%x's file-backed "
+            "vma:0x%x\n", task, vma);
+        return -ERR_OUT_OF_RESOURCE;
+    }
+    fill_page_frame_from_file(paddr, file, vma->file_offset + page_offset,
+        length);
+    result = userspace_map_page(task,
+        page_addr,
+        paddr,
+        vma->write_permission,
+        vma->page_writethrough,
+        vma->page_cachedisable);
+    if (result != OK)
+        free_page(paddr);
+    return result;
+}
+
 uint32_t
 handle_userspace_page_fault(struct task * task,
     struct x86_cpustate * cpu,
@@ -331,14 +692,31 @@ handle_userspace_page_fault(struct task * task,
     ASSERT(task->page_directory);
     ASSERT(task->privilege_level == DPL_3);
     ASSERT(linear_addr >= ((uint32_t)USERSPACE_BOTTOM));
-    vma = search_userspace_vma_by_addr(&task->vma_list, linear_addr);
+    task->mm_stat.nr_page_faults++;
+    vma = search_userspace_vma_by_addr(&task->vma_tree, linear_addr);
     if (!vma) {
         return -ERR_NOT_FOUND;
     }
+    if (cpu->errorcode & 0x1) {
+        // The page is present, it's a write to a read-only page.
+        if ((cpu->errorcode & 0x2) &&
+            !vma->exact &&
+            vma->write_permission == PAGE_PERMISSION_READ_WRITE) {
+            task->mm_stat.nr_cow_faults++;
+            return handle_userspace_cow_fault(task, vma, linear_addr);
+        }
+        LOG_ERROR("Paging permission violation, task:0x%x linear_addr:0x%x\n",
+            task, linear_addr);
+        signal_task(task, SIGSEGV);
+        return OK;
+    }
+    if (vma->file)
+        return handle_userspace_file_fault(task, vma, linear_addr);
     if (vma->exact) {
         paddr = (uint32_t)(vma->phy_addr + linear_addr - vma->virt_addr);
     } else {
-        paddr = get_page();
+        paddr = vma->zero_fill ? get_zeroed_user_page(task) :
+            get_user_page(task);
         if (!paddr) {
             LOG_DEBUG("can not allocate generic free page for task:0x%x's "
                 "vma:0x%x\n", task, vma);
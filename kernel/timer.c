@@ -65,6 +65,18 @@ schedule_timer(void)
         LOG_TRIVIA("Scheduled timer:0x%x\n", timer);
     }
 }
+
+int32_t
+timer_next_expiry(uint64_t * expiry)
+{
+    struct timer_entry * timer;
+    if (!timer_heap.root)
+        return -ERR_NOT_FOUND;
+    timer = CONTAINER_OF(timer_heap.root, struct timer_entry, node);
+    *expiry = timer->time_to_expire;
+    return OK;
+}
+
 void
 timer_init(void)
 {
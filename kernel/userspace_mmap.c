@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <kernel/include/userspace_mmap.h>
+#include <kernel/include/printk.h>
+#include <lib/include/string.h>
+#include <lib/include/errorcode.h>
+#include <memory/include/paging.h>
+#include <filesystem/include/vfs.h>
+
+#define PAGE_ROUNDUP(length) (((length) + PAGE_MASK) & ~PAGE_MASK)
+
+/*
+ * search a free area for the mapping, the hint address is preferred.
+ * return 0 if the mmap space is exhausted.
+ */
+static uint32_t
+search_mmap_area(struct task * task, uint32_t hint, uint32_t length)
+{
+    uint32_t addr;
+    struct vm_area * _vma;
+    if (hint >= USERSPACE_MMAP_BOTTOM &&
+        length <= (USERSPACE_MMAP_TOP - hint) &&
+        !search_userspace_vma_in_range(&task->vma_tree, hint, hint + length))
+        return hint;
+    addr = USERSPACE_MMAP_BOTTOM;
+    while (length <= (USERSPACE_MMAP_TOP - addr)) {
+        _vma = search_userspace_vma_in_range(&task->vma_tree,
+            addr,
+            addr + length);
+        if (!_vma)
+            return addr;
+        addr = (uint32_t)(_vma->virt_addr + _vma->length);
+    }
+    return 0;
+}
+
+static int32_t
+validate_mmap_range(uint32_t addr, uint32_t length)
+{
+    if (!length || (addr & PAGE_MASK))
+        return -ERR_INVALID_ARG;
+    if (addr < USERSPACE_MMAP_BOTTOM ||
+        addr >= USERSPACE_MMAP_TOP ||
+        length > (USERSPACE_MMAP_TOP - addr))
+        return -ERR_INVALID_ARG;
+    return OK;
+}
+
+int32_t
+do_mmap(struct task * task, struct mmap_args * args, uint32_t * paddr)
+{
+    int32_t rc;
+    int32_t file_length;
+    uint32_t addr;
+    uint32_t length;
+    int32_t type = args->flags & (MAP_SHARED | MAP_PRIVATE);
+    struct file_entry * entry;
+    struct file * file = NULL;
+    struct vm_area * _vma;
+    if (!args->length ||
+        args->length > (USERSPACE_MMAP_TOP - USERSPACE_MMAP_BOTTOM) ||
+        (type != MAP_SHARED && type != MAP_PRIVATE) ||
+        (args->offset & PAGE_MASK) ||
+        (args->prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return -ERR_INVALID_ARG;
+    // a page can not be made inaccessible but still present.
+    if (args->prot == PROT_NONE)
+        return -ERR_NOT_SUPPORTED;
+    length = PAGE_ROUNDUP(args->length);
+    if (!(args->flags & MAP_ANONYMOUS)) {
+        if (args->fd < 0 ||
+            args->fd >= MAX_FILE_DESCRIPTR_PER_TASK ||
+            !task->file_entries[args->fd])
+            return -ERR_INVALID_ARG;
+        entry = task->file_entries[args->fd];
+        file = entry->file;
+        ASSERT(file);
+        if (file->type != FILE_TYPE_REGULAR ||
+            !file->ops->read ||
+            !file->ops->size)
+            return -ERR_NOT_SUPPORTED;
+        if (type == MAP_SHARED &&
+            (args->prot & PROT_WRITE) &&
+            (!entry->writable || !file->ops->write))
+            return -ERR_INVALID_ARG;
+    }
+    if (args->flags & MAP_FIXED) {
+        addr = args->addr;
+        if ((rc = validate_mmap_range(addr, length)))
+            return rc;
+        if ((rc = do_munmap(task, addr, length)))
+            return rc;
+    } else {
+        addr = search_mmap_area(task, args->addr & ~PAGE_MASK, length);
+        if (!addr)
+            return -ERR_OUT_OF_RESOURCE;
+    }
+    _vma = malloc_vm_area();
+    if (!_vma)
+        return -ERR_OUT_OF_MEMORY;
+    memset(_vma, 0x0, sizeof(struct vm_area));
+    strcpy_safe(_vma->name, (uint8_t *)USER_VMA_MMAP, sizeof(_vma->name));
+    _vma->write_permission = args->prot & PROT_WRITE ?
+        PAGE_PERMISSION_READ_WRITE : PAGE_PERMISSION_READ_ONLY;
+    _vma->executable = args->prot & PROT_EXEC ? 1 : 0;
+    _vma->page_writethrough = PAGE_WRITEBACK;
+    _vma->page_cachedisable = PAGE_CACHE_ENABLED;
+    _vma->shared = type == MAP_SHARED ? 1 : 0;
+    _vma->virt_addr = addr;
+    _vma->length = length;
+    if (file) {
+        file_length = file->ops->size(file);
+        _vma->file = file;
+        _vma->file_writable = entry->writable;
+        _vma->file_offset = args->offset;
+        _vma->file_size = file_length > args->offset ?
+            MIN(length, file_length - args->offset) : 0;
+        file->refer_count++;
+    } else {
+        _vma->zero_fill = 1;
+    }
+    ASSERT(attach_vm_area(&task->vma_list, &task->vma_tree, _vma) == OK);
+    LOG_DEBUG("task:0x%x mmap 0x%x<---->0x%x(prot:%x flags:%x)\n",
+        task, addr, addr + length, args->prot, args->flags);
+    *paddr = addr;
+    return OK;
+}
+
+int32_t
+do_munmap(struct task * task, uint32_t addr, uint32_t length)
+{
+    int32_t rc;
+    uint32_t end;
+    struct vm_area * _vma;
+    if (length > (USERSPACE_MMAP_TOP - USERSPACE_MMAP_BOTTOM))
+        return -ERR_INVALID_ARG;
+    length = PAGE_ROUNDUP(length);
+    if ((rc = validate_mmap_range(addr, length)))
+        return rc;
+    end = addr + length;
+    while ((_vma = search_userspace_vma_in_range(&task->vma_tree,
+        addr,
+        end))) {
+        if (_vma->virt_addr < addr) {
+            _vma = split_vm_area(&task->vma_list,
+                &task->vma_tree,
+                _vma,
+                addr);
+            if (!_vma)
+                return -ERR_OUT_OF_MEMORY;
+        }
+        if ((_vma->virt_addr + _vma->length) > end &&
+            !split_vm_area(&task->vma_list, &task->vma_tree, _vma, end))
+            return -ERR_OUT_OF_MEMORY;
+        userspace_evict_vma(task, _vma);
+        detach_vm_area(&task->vma_list, &task->vma_tree, _vma);
+        free_vm_area(_vma);
+    }
+    return OK;
+}
+
+int32_t
+do_mprotect(struct task * task, uint32_t addr, uint32_t length, int32_t prot)
+{
+    int32_t rc;
+    uint32_t end;
+    uint32_t scan;
+    struct vm_area * _vma;
+    if (length > (USERSPACE_MMAP_TOP - USERSPACE_MMAP_BOTTOM) ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return -ERR_INVALID_ARG;
+    if (prot == PROT_NONE)
+        return -ERR_NOT_SUPPORTED;
+    length = PAGE_ROUNDUP(length);
+    if ((rc = validate_mmap_range(addr, length)))
+        return rc;
+    end = addr + length;
+    for (scan = addr; scan < end;
+        scan = (uint32_t)(_vma->virt_addr + _vma->length)) {
+        _vma = search_userspace_vma_by_addr(&task->vma_tree, scan);
+        if (!_vma)
+            return -ERR_NOT_PRESENT;
+        if ((prot & PROT_WRITE) &&
+            _vma->shared &&
+            _vma->file &&
+            (!_vma->file_writable || !_vma->file->ops->write))
+            return -ERR_NOT_SUPPORTED;
+    }
+    for (scan = addr; scan < end;
+        scan = (uint32_t)(_vma->virt_addr + _vma->length)) {
+        _vma = search_userspace_vma_by_addr(&task->vma_tree, scan);
+        ASSERT(_vma);
+        if (_vma->virt_addr < scan) {
+            _vma = split_vm_area(&task->vma_list,
+                &task->vma_tree,
+                _vma,
+                scan);
+            if (!_vma)
+                return -ERR_OUT_OF_MEMORY;
+        }
+        if ((_vma->virt_addr + _vma->length) > end &&
+            !split_vm_area(&task->vma_list, &task->vma_tree, _vma, end))
+            return -ERR_OUT_OF_MEMORY;
+        _vma->write_permission = prot & PROT_WRITE ?
+            PAGE_PERMISSION_READ_WRITE : PAGE_PERMISSION_READ_ONLY;
+        _vma->executable = prot & PROT_EXEC ? 1 : 0;
+        userspace_protect_vm_area(task, _vma);
+    }
+    return OK;
+}
@@ -5,6 +5,33 @@
 #include <lib/include/string.h>
 #include <lib/include/errorcode.h>
 #include <kernel/include/printk.h>
+#include <memory/include/slab.h>
+#include <filesystem/include/vfs.h>
+#include <kernel/include/image_cache.h>
+
+static struct kmem_cache * vm_area_cache;
+
+/*
+ * allocate a vm_area structure from vm_area cache,
+ * return NULL upon memory outage
+ */
+struct vm_area *
+malloc_vm_area(void)
+{
+    return kmem_cache_alloc(vm_area_cache);
+}
+
+void
+free_vm_area(struct vm_area * _vma)
+{
+    if (_vma->file) {
+        // the pages of the vma must have been evicted.
+        image_cache_release(_vma->file);
+        do_vfs_close(_vma->file);
+    }
+    kmem_cache_free(vm_area_cache, _vma);
+}
+
 struct vm_area *
 search_userspace_vma(struct list_elem * head, uint8_t * vma_name)
 {
@@ -19,21 +46,144 @@ search_userspace_vma(struct list_elem * head, uint8_t * vma_name)
     return _vma;
 }
 
+static int32_t
+vm_area_compare(struct avl_node * node0, struct avl_node * node1)
+{
+    struct vm_area * _vma0 = CONTAINER_OF(node0, struct vm_area, node);
+    struct vm_area * _vma1 = CONTAINER_OF(node1, struct vm_area, node);
+    if (_vma0->virt_addr == _vma1->virt_addr)
+        return 0;
+    return _vma0->virt_addr < _vma1->virt_addr ? -1 : 1;
+}
+
+void
+vm_area_tree_init(struct vm_area_tree * tree)
+{
+    avl_tree_init(&tree->avl, vm_area_compare, NULL);
+    tree->last_hit = NULL;
+}
+
+/*
+ * search the vma with the highest start address below end, it's the only
+ * candidate to overlap [start, end).
+ */
+static struct vm_area *
+__search_userspace_vma_in_range(struct vm_area_tree * tree,
+    uint64_t start,
+    uint64_t end)
+{
+    struct avl_node * node = tree->avl.root;
+    struct vm_area * _vma;
+    struct vm_area * _candidate = NULL;
+    while (node) {
+        _vma = CONTAINER_OF(node, struct vm_area, node);
+        if (_vma->virt_addr < end) {
+            _candidate = _vma;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    if (_candidate && (_candidate->virt_addr + _candidate->length) > start)
+        return _candidate;
+    return NULL;
+}
+
+int32_t
+vm_area_in_tree(struct vm_area_tree * tree, struct vm_area * target_vma)
+{
+    struct avl_node * node = tree->avl.root;
+    int32_t cmp;
+    while (node) {
+        cmp = vm_area_compare(&target_vma->node, node);
+        if (!cmp)
+            return node == &target_vma->node;
+        node = cmp < 0 ? node->left : node->right;
+    }
+    return 0;
+}
+
 struct vm_area *
-search_userspace_vma_by_addr(struct list_elem * head, uint32_t vaddr)
+search_userspace_vma_by_addr(struct vm_area_tree * tree, uint32_t vaddr)
 {
-    struct list_elem * _list = NULL;
-    struct vm_area * _vma = NULL;
+    struct vm_area * _vma = tree->last_hit;
     uint64_t _vaddr = vaddr;
-    
-    LIST_FOREACH_START(head, _list) {
-        _vma = CONTAINER_OF(_list, struct vm_area, list);
-        if (_vaddr >= _vma->virt_addr &&
-            _vaddr < (_vma->virt_addr + _vma->length))
-            return _vma;
+    if (_vma &&
+        _vaddr >= _vma->virt_addr &&
+        _vaddr < (_vma->virt_addr + _vma->length))
+        return _vma;
+    _vma = __search_userspace_vma_in_range(tree, _vaddr, _vaddr + 1);
+    if (_vma)
+        tree->last_hit = _vma;
+    return _vma;
+}
+
+struct vm_area *
+search_userspace_vma_in_range(struct vm_area_tree * tree,
+    uint32_t start,
+    uint32_t end)
+{
+    return __search_userspace_vma_in_range(tree, start, end);
+}
+
+int32_t
+attach_vm_area(struct list_elem * vmas_head,
+    struct vm_area_tree * tree,
+    struct vm_area * _vma)
+{
+    // an empty vma(e.g. the initial heap) must not reside in other vma either
+    if (__search_userspace_vma_in_range(tree,
+        _vma->virt_addr,
+        _vma->virt_addr + MAX(_vma->length, 1)))
+        return -ERR_EXIST;
+    ASSERT(avl_tree_insert(&tree->avl, &_vma->node) == OK);
+    list_append(vmas_head, &_vma->list);
+    return OK;
+}
+
+void
+detach_vm_area(struct list_elem * vmas_head,
+    struct vm_area_tree * tree,
+    struct vm_area * _vma)
+{
+    ASSERT(avl_tree_delete(&tree->avl, &_vma->node) == OK);
+    list_unlink(vmas_head, &_vma->list);
+    if (tree->last_hit == _vma)
+        tree->last_hit = NULL;
+}
+
+struct vm_area *
+split_vm_area(struct list_elem * vmas_head,
+    struct vm_area_tree * tree,
+    struct vm_area * _vma,
+    uint32_t addr)
+{
+    uint32_t delta;
+    struct vm_area * _upper_vma;
+    ASSERT(!(addr & PAGE_MASK));
+    ASSERT(addr > _vma->virt_addr &&
+        addr < (_vma->virt_addr + _vma->length));
+    _upper_vma = malloc_vm_area();
+    if (!_upper_vma)
+        return NULL;
+    delta = addr - (uint32_t)_vma->virt_addr;
+    memcpy(_upper_vma, _vma, sizeof(struct vm_area));
+    _upper_vma->list.prev = NULL;
+    _upper_vma->list.next = NULL;
+    _upper_vma->virt_addr += delta;
+    _upper_vma->length -= delta;
+    if (_upper_vma->exact)
+        _upper_vma->phy_addr += delta;
+    _vma->length = delta;
+    if (_vma->file) {
+        _upper_vma->file_offset += delta;
+        _upper_vma->file_size = _vma->file_size > delta ?
+            _vma->file_size - delta : 0;
+        _vma->file_size = MIN(_vma->file_size, delta);
+        _vma->file->refer_count++;
     }
-    LIST_FOREACH_END();
-    return NULL;
+    ASSERT(attach_vm_area(vmas_head, tree, _upper_vma) == OK);
+    return _upper_vma;
 }
 
 int
@@ -57,46 +207,39 @@ __extend_vm_area(struct vm_area * _vma, int direction, int length)
 }
 
 /*
- * Make sure target_vma in vmas_head list.
- * and the extended vma does not overlap with other areas
+ * Make sure target_vma in the tree.
+ * and the extended vma does not overlap with other areas, the order of the
+ * tree is kept even the start address of the vma is lowered.
  */
 int
-extend_vm_area(struct list_elem * vmas_head,
+extend_vm_area(struct vm_area_tree * tree,
     struct vm_area * target_vma,
     int direction,
     int length)
 {
-    int found = 0;
-
     uint64_t extended_start;
     uint64_t extended_end;
-    struct list_elem * _list = NULL;
-    struct vm_area * _vma = NULL;
     ASSERT(direction == VMA_EXTEND_UPWARD || direction == VMA_EXTEND_DOWNWARD);
-
+    if (!vm_area_in_tree(tree, target_vma))
+        return -ERR_INVALID_ARG;
+    // only the extended part is checked
     extended_start = direction == VMA_EXTEND_UPWARD ?
-        target_vma->virt_addr :
+        target_vma->virt_addr + target_vma->length :
         target_vma->virt_addr - length;
     extended_end = direction == VMA_EXTEND_UPWARD ?
         target_vma->virt_addr + target_vma->length + length:
-        target_vma->virt_addr + target_vma->length; 
-    LIST_FOREACH_START(vmas_head, _list) {
-        _vma = CONTAINER_OF(_list, struct vm_area, list);
-        if (_vma == target_vma) {
-            found = 1;
-            continue;
-        }
-        if (_vma->virt_addr < extended_start && 
-            (_vma->virt_addr + _vma->length) > extended_start)
-            return -ERR_INVALID_ARG;
-        if (_vma->virt_addr < extended_end &&
-            (_vma->virt_addr + _vma->length) > extended_end)
-            return -ERR_INVALID_ARG;
-    }
-    LIST_FOREACH_END();
-
-    if (!found) {
+        target_vma->virt_addr;
+    if (length > 0 &&
+        __search_userspace_vma_in_range(tree, extended_start, extended_end))
         return -ERR_INVALID_ARG;
-    }
     return __extend_vm_area(target_vma, direction, length);
 }
+
+void
+userspace_vma_init(void)
+{
+    vm_area_cache = kmem_cache_create((const uint8_t *)"vm_area",
+        sizeof(struct vm_area),
+        sizeof(uint32_t));
+    ASSERT(vm_area_cache);
+}
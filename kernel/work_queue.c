@@ -41,6 +41,8 @@ register_work_queue(struct work_queue * work_queue_blob, uint8_t * _name)
         name);
     if (!result) {
         wq_task->priv = work_queue_blob;
+        // the bottom halves run ahead of any PL3 task
+        wq_task->sched_class = SCHED_CLASS_KERNEL;
         task_put(wq_task);
         LOG_DEBUG("Create work queue :%s as task:0x%x\n", name, wq_task);
     } else {
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <lib/include/avl_tree.h>
+#include <lib/include/errorcode.h>
+#include <kernel/include/printk.h>
+
+#define HEIGHT(node) ((node) ? (node)->height : 0)
+
+static void
+avl_update(struct avl_tree * tree, struct avl_node * node)
+{
+    node->height = MAX(HEIGHT(node->left), HEIGHT(node->right)) + 1;
+    if (tree->augment)
+        tree->augment(node);
+}
+
+static struct avl_node *
+avl_rotate_right(struct avl_tree * tree, struct avl_node * node)
+{
+    struct avl_node * left = node->left;
+    node->left = left->right;
+    left->right = node;
+    avl_update(tree, node);
+    avl_update(tree, left);
+    return left;
+}
+
+static struct avl_node *
+avl_rotate_left(struct avl_tree * tree, struct avl_node * node)
+{
+    struct avl_node * right = node->right;
+    node->right = right->left;
+    right->left = node;
+    avl_update(tree, node);
+    avl_update(tree, right);
+    return right;
+}
+
+/*
+ * restore the balance of the subtree whose children are balanced and differ
+ * in height by at most 2, return the new root of the subtree.
+ */
+static struct avl_node *
+avl_rebalance(struct avl_tree * tree, struct avl_node * node)
+{
+    int32_t balance = HEIGHT(node->left) - HEIGHT(node->right);
+    if (balance > 1) {
+        if (HEIGHT(node->left->left) < HEIGHT(node->left->right))
+            node->left = avl_rotate_left(tree, node->left);
+        return avl_rotate_right(tree, node);
+    }
+    if (balance < -1) {
+        if (HEIGHT(node->right->right) < HEIGHT(node->right->left))
+            node->right = avl_rotate_right(tree, node->right);
+        return avl_rotate_left(tree, node);
+    }
+    avl_update(tree, node);
+    return node;
+}
+
+static struct avl_node *
+__avl_tree_insert(struct avl_tree * tree,
+    struct avl_node * root,
+    struct avl_node * node,
+    int32_t * result)
+{
+    int32_t cmp;
+    if (!root)
+        return node;
+    cmp = tree->compare(node, root);
+    if (cmp < 0)
+        root->left = __avl_tree_insert(tree, root->left, node, result);
+    else if (cmp > 0)
+        root->right = __avl_tree_insert(tree, root->right, node, result);
+    else
+        *result = -ERR_EXIST;
+    return avl_rebalance(tree, root);
+}
+
+static struct avl_node *
+__avl_tree_delete_min(struct avl_tree * tree,
+    struct avl_node * root,
+    struct avl_node ** pmin)
+{
+    if (!root->left) {
+        *pmin = root;
+        return root->right;
+    }
+    root->left = __avl_tree_delete_min(tree, root->left, pmin);
+    return avl_rebalance(tree, root);
+}
+
+static struct avl_node *
+__avl_tree_delete(struct avl_tree * tree,
+    struct avl_node * root,
+    struct avl_node * node,
+    int32_t * result)
+{
+    int32_t cmp;
+    struct avl_node * successor = NULL;
+    if (!root) {
+        *result = -ERR_NOT_FOUND;
+        return NULL;
+    }
+    cmp = tree->compare(node, root);
+    if (cmp < 0)
+        root->left = __avl_tree_delete(tree, root->left, node, result);
+    else if (cmp > 0)
+        root->right = __avl_tree_delete(tree, root->right, node, result);
+    else if (root != node)
+        *result = -ERR_NOT_FOUND;
+    else {
+        // replace the node with its successor
+        if (!root->right)
+            return root->left;
+        root->right = __avl_tree_delete_min(tree, root->right, &successor);
+        successor->left = root->left;
+        successor->right = root->right;
+        root = successor;
+    }
+    return avl_rebalance(tree, root);
+}
+
+void
+avl_tree_init(struct avl_tree * tree,
+    int32_t (*compare)(struct avl_node * node0, struct avl_node * node1),
+    void (*augment)(struct avl_node * node))
+{
+    tree->root = NULL;
+    tree->nr_nodes = 0;
+    tree->compare = compare;
+    tree->augment = augment;
+}
+
+int32_t
+avl_tree_insert(struct avl_tree * tree, struct avl_node * node)
+{
+    int32_t result = OK;
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    if (tree->augment)
+        tree->augment(node);
+    tree->root = __avl_tree_insert(tree, tree->root, node, &result);
+    if (result == OK)
+        tree->nr_nodes++;
+    return result;
+}
+
+int32_t
+avl_tree_delete(struct avl_tree * tree, struct avl_node * node)
+{
+    int32_t result = OK;
+    tree->root = __avl_tree_delete(tree, tree->root, node, &result);
+    if (result == OK)
+        tree->nr_nodes--;
+    return result;
+}
+
+struct avl_node *
+avl_tree_first(struct avl_tree * tree)
+{
+    struct avl_node * node = tree->root;
+    while (node && node->left)
+        node = node->left;
+    return node;
+}
+
+#if defined(INLINE_TEST)
+#include <lib/include/string.h>
+
+struct avl_test_node {
+    struct avl_node node;
+    uint32_t key;
+    // the number of nodes in the subtree, maintained by augment callback.
+    uint32_t size;
+};
+
+static int32_t
+avl_test_compare(struct avl_node * node0, struct avl_node * node1)
+{
+    struct avl_test_node * test0 = CONTAINER_OF(node0,
+        struct avl_test_node, node);
+    struct avl_test_node * test1 = CONTAINER_OF(node1,
+        struct avl_test_node, node);
+    if (test0->key == test1->key)
+        return 0;
+    return test0->key < test1->key ? -1 : 1;
+}
+
+static void
+avl_test_augment(struct avl_node * node)
+{
+    struct avl_test_node * test = CONTAINER_OF(node,
+        struct avl_test_node, node);
+    struct avl_test_node * child;
+    test->size = 1;
+    if (node->left) {
+        child = CONTAINER_OF(node->left, struct avl_test_node, node);
+        test->size += child->size;
+    }
+    if (node->right) {
+        child = CONTAINER_OF(node->right, struct avl_test_node, node);
+        test->size += child->size;
+    }
+}
+
+/*
+ * verify the order, the balance and the augmented data of the subtree,
+ * return the number of nodes.
+ */
+static uint32_t
+avl_test_verify(struct avl_node * node, uint32_t low, uint32_t high)
+{
+    uint32_t nr_nodes;
+    struct avl_test_node * test;
+    if (!node)
+        return 0;
+    test = CONTAINER_OF(node, struct avl_test_node, node);
+    ASSERT(test->key >= low && test->key <= high);
+    ASSERT(node->height ==
+        MAX(HEIGHT(node->left), HEIGHT(node->right)) + 1);
+    ASSERT((HEIGHT(node->left) - HEIGHT(node->right)) <= 1 &&
+        (HEIGHT(node->right) - HEIGHT(node->left)) <= 1);
+    nr_nodes = avl_test_verify(node->left, low, test->key - 1) +
+        avl_test_verify(node->right, test->key + 1, high) + 1;
+    ASSERT(test->size == nr_nodes);
+    return nr_nodes;
+}
+
+__attribute__((constructor)) void
+avl_tree_inline_test(void)
+{
+#define NR_TEST_NODES 128
+    static struct avl_test_node nodes[NR_TEST_NODES];
+    struct avl_tree tree;
+    int32_t idx;
+    avl_tree_init(&tree, avl_test_compare, avl_test_augment);
+    memset(nodes, 0x0, sizeof(nodes));
+    // 37 is coprime to 128, the keys are inserted out of order.
+    for (idx = 0; idx < NR_TEST_NODES; idx++) {
+        nodes[idx].key = (idx * 37) % NR_TEST_NODES + 1;
+        ASSERT(avl_tree_insert(&tree, &nodes[idx].node) == OK);
+    }
+    ASSERT(avl_test_verify(tree.root, 0, ~0) == NR_TEST_NODES);
+    ASSERT(tree.root->height <= 10);
+    ASSERT(avl_tree_first(&tree) == &nodes[0].node);
+    for (idx = 0; idx < NR_TEST_NODES; idx += 2)
+        ASSERT(avl_tree_delete(&tree, &nodes[idx].node) == OK);
+    ASSERT(avl_tree_delete(&tree, &nodes[0].node) == -ERR_NOT_FOUND);
+    ASSERT(avl_test_verify(tree.root, 0, ~0) == NR_TEST_NODES / 2);
+    ASSERT(tree.nr_nodes == NR_TEST_NODES / 2);
+    ASSERT(avl_tree_insert(&tree, &nodes[0].node) == OK);
+    nodes[2].key = nodes[0].key;
+    ASSERT(avl_tree_insert(&tree, &nodes[2].node) == -ERR_EXIST);
+    for (idx = 0; idx < NR_TEST_NODES; idx++)
+        if (idx == 0 || (idx & 0x1))
+            ASSERT(avl_tree_delete(&tree, &nodes[idx].node) == OK);
+    ASSERT(!tree.root && !tree.nr_nodes);
+}
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <lib/include/bitmap.h>
+#include <kernel/include/printk.h>
+
+/*
+ * the mask of bits no less than bit within a word
+ */
+#define WORD_MASK_FROM(bit) (~0U << ((bit) % BITS_PER_WORD))
+
+void
+bitmap_set_range(uint32_t * bitmap, uint32_t start, uint32_t nr_bits)
+{
+    uint32_t end = start + nr_bits;
+    for (; start < end && (start % BITS_PER_WORD); start++)
+        bitmap_set(bitmap, start);
+    for (; (start + BITS_PER_WORD) <= end; start += BITS_PER_WORD)
+        bitmap[BITMAP_WORD(start)] = ~0U;
+    for (; start < end; start++)
+        bitmap_set(bitmap, start);
+}
+
+void
+bitmap_clear_range(uint32_t * bitmap, uint32_t start, uint32_t nr_bits)
+{
+    uint32_t end = start + nr_bits;
+    for (; start < end && (start % BITS_PER_WORD); start++)
+        bitmap_clear(bitmap, start);
+    for (; (start + BITS_PER_WORD) <= end; start += BITS_PER_WORD)
+        bitmap[BITMAP_WORD(start)] = 0;
+    for (; start < end; start++)
+        bitmap_clear(bitmap, start);
+}
+
+int32_t
+bitmap_find_first_zero(uint32_t * bitmap, uint32_t nr_bits, uint32_t start)
+{
+    uint32_t word_idx = BITMAP_WORD(start);
+    uint32_t word;
+    uint32_t bit;
+    if (start >= nr_bits)
+        return -1;
+    word = ~bitmap[word_idx] & WORD_MASK_FROM(start);
+    while (!word) {
+        word_idx++;
+        if (word_idx * BITS_PER_WORD >= nr_bits)
+            return -1;
+        word = ~bitmap[word_idx];
+    }
+    bit = word_idx * BITS_PER_WORD + bit_ffs(word);
+    return bit < nr_bits ? (int32_t)bit : -1;
+}
+
+int32_t
+bitmap_find_first_set(uint32_t * bitmap, uint32_t nr_bits, uint32_t start)
+{
+    uint32_t word_idx = BITMAP_WORD(start);
+    uint32_t word;
+    uint32_t bit;
+    if (start >= nr_bits)
+        return -1;
+    word = bitmap[word_idx] & WORD_MASK_FROM(start);
+    while (!word) {
+        word_idx++;
+        if (word_idx * BITS_PER_WORD >= nr_bits)
+            return -1;
+        word = bitmap[word_idx];
+    }
+    bit = word_idx * BITS_PER_WORD + bit_ffs(word);
+    return bit < nr_bits ? (int32_t)bit : -1;
+}
+
+int32_t
+bitmap_find_last_set(uint32_t * bitmap, uint32_t nr_bits)
+{
+    int32_t word_idx = BITMAP_WORD(nr_bits - 1);
+    uint32_t word;
+    if (!nr_bits)
+        return -1;
+    word = bitmap[word_idx];
+    if ((nr_bits % BITS_PER_WORD))
+        word &= ~WORD_MASK_FROM(nr_bits);
+    while (!word) {
+        word_idx--;
+        if (word_idx < 0)
+            return -1;
+        word = bitmap[word_idx];
+    }
+    return word_idx * BITS_PER_WORD + bit_fls(word);
+}
+
+int32_t
+bitmap_find_zero_area(uint32_t * bitmap,
+    uint32_t nr_bits,
+    uint32_t start,
+    uint32_t nr,
+    uint32_t align)
+{
+    int32_t idx;
+    int32_t occupied;
+    ASSERT(align && !(align & (align - 1)));
+    idx = start;
+    while (1) {
+        idx = bitmap_find_first_zero(bitmap, nr_bits, idx);
+        if (idx < 0)
+            return -1;
+        idx = (idx + align - 1) & ~(align - 1);
+        if ((idx + nr) > nr_bits)
+            return -1;
+        // the area is free if no bit is set within it
+        occupied = bitmap_find_first_set(bitmap, idx + nr, idx);
+        if (occupied < 0)
+            return idx;
+        idx = occupied + 1;
+    }
+}
+
+#if defined(INLINE_TEST)
+#include <lib/include/string.h>
+
+__attribute__((constructor)) void
+bitmap_inline_test(void)
+{
+    uint32_t bitmap[BITMAP_WORDS(100)];
+    memset(bitmap, 0x0, sizeof(bitmap));
+    ASSERT(bitmap_find_first_zero(bitmap, 100, 0) == 0);
+    ASSERT(bitmap_find_first_set(bitmap, 100, 0) == -1);
+    ASSERT(bitmap_find_last_set(bitmap, 100) == -1);
+    bitmap_set_range(bitmap, 0, 70);
+    ASSERT(bitmap_test(bitmap, 69));
+    ASSERT(!bitmap_test(bitmap, 70));
+    ASSERT(bitmap_find_first_zero(bitmap, 100, 0) == 70);
+    ASSERT(bitmap_find_last_set(bitmap, 100) == 69);
+    bitmap_clear_range(bitmap, 3, 5);
+    ASSERT(bitmap_find_first_zero(bitmap, 100, 0) == 3);
+    ASSERT(bitmap_find_first_set(bitmap, 100, 3) == 8);
+    ASSERT(bitmap_find_zero_area(bitmap, 100, 0, 4, 1) == 3);
+    ASSERT(bitmap_find_zero_area(bitmap, 100, 0, 4, 4) == 4);
+    ASSERT(bitmap_find_zero_area(bitmap, 100, 0, 4, 8) == 72);
+    ASSERT(bitmap_find_zero_area(bitmap, 100, 0, 6, 1) == 70);
+    ASSERT(bitmap_find_zero_area(bitmap, 100, 0, 31, 1) == -1);
+    bitmap_set_range(bitmap, 70, 30);
+    ASSERT(bitmap_find_first_zero(bitmap, 100, 8) == -1);
+}
+#endif
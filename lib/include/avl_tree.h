@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _AVL_TREE_H
+#define _AVL_TREE_H
+#include <lib/include/types.h>
+
+/*
+ * The AVL tree is intrusive: embed struct avl_node in the object and use
+ * CONTAINER_OF() to get the object. The heights of the two subtrees of any
+ * node differ by at most one, so the search/insertion/deletion are all
+ * O(log n).
+ * The optional augment callback recomputes the per-node data derived from
+ * the node and its children, it's invoked bottom-up whenever the subtree
+ * rooted at a node changes.
+ */
+struct avl_node {
+    struct avl_node * left;
+    struct avl_node * right;
+    int32_t height;
+};
+
+struct avl_tree {
+    struct avl_node * root;
+    uint32_t nr_nodes;
+    int32_t (*compare)(struct avl_node * node0, struct avl_node * node1);
+    void (*augment)(struct avl_node * node);
+};
+
+void
+avl_tree_init(struct avl_tree * tree,
+    int32_t (*compare)(struct avl_node * node0, struct avl_node * node1),
+    void (*augment)(struct avl_node * node));
+
+/*
+ * return -ERR_EXIST if there is a node comparing equal to the node.
+ */
+int32_t
+avl_tree_insert(struct avl_tree * tree, struct avl_node * node);
+
+/*
+ * return -ERR_NOT_FOUND if the node is not in the tree.
+ */
+int32_t
+avl_tree_delete(struct avl_tree * tree, struct avl_node * node);
+
+struct avl_node *
+avl_tree_first(struct avl_tree * tree);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _BITMAP_H
+#define _BITMAP_H
+#include <lib/include/types.h>
+
+/*
+ * The bitmap is an array of 32-bit words, bit n is at bit (n % 32) of word
+ * (n / 32). A set bit indicates the object is occupied.
+ * All the searches work word by word: a fully occupied word is skipped with
+ * one comparison and the bit within a word is located with bsf/bsr.
+ */
+#define BITS_PER_WORD 32
+#define BITMAP_WORDS(nr_bits) (((nr_bits) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define BITMAP_WORD(bit) ((bit) / BITS_PER_WORD)
+#define BITMAP_MASK(bit) (1 << ((bit) % BITS_PER_WORD))
+
+/*
+ * index of the least/most significant set bit, the word must not be zero
+ */
+static inline int32_t
+bit_ffs(uint32_t word)
+{
+    int32_t bit;
+    asm volatile("bsfl %1, %0;"
+        :"=r"(bit)
+        :"rm"(word));
+    return bit;
+}
+
+static inline int32_t
+bit_fls(uint32_t word)
+{
+    int32_t bit;
+    asm volatile("bsrl %1, %0;"
+        :"=r"(bit)
+        :"rm"(word));
+    return bit;
+}
+
+static inline void
+bitmap_set(uint32_t * bitmap, uint32_t bit)
+{
+    bitmap[BITMAP_WORD(bit)] |= BITMAP_MASK(bit);
+}
+
+static inline void
+bitmap_clear(uint32_t * bitmap, uint32_t bit)
+{
+    bitmap[BITMAP_WORD(bit)] &= ~BITMAP_MASK(bit);
+}
+
+static inline int32_t
+bitmap_test(uint32_t * bitmap, uint32_t bit)
+{
+    return !!(bitmap[BITMAP_WORD(bit)] & BITMAP_MASK(bit));
+}
+
+void
+bitmap_set_range(uint32_t * bitmap, uint32_t start, uint32_t nr_bits);
+
+void
+bitmap_clear_range(uint32_t * bitmap, uint32_t start, uint32_t nr_bits);
+
+/*
+ * search the first clear/set bit in [start, nr_bits),
+ * return -1 if there is no such bit.
+ */
+int32_t
+bitmap_find_first_zero(uint32_t * bitmap, uint32_t nr_bits, uint32_t start);
+
+int32_t
+bitmap_find_first_set(uint32_t * bitmap, uint32_t nr_bits, uint32_t start);
+
+/*
+ * search the last set bit in [0, nr_bits), return -1 if all bits are clear.
+ */
+int32_t
+bitmap_find_last_set(uint32_t * bitmap, uint32_t nr_bits);
+
+/*
+ * search nr contiguous clear bits in [start, nr_bits) whose first bit is
+ * aligned to align(a power of 2), return -1 if there is no such area.
+ */
+int32_t
+bitmap_find_zero_area(uint32_t * bitmap,
+    uint32_t nr_bits,
+    uint32_t start,
+    uint32_t nr,
+    uint32_t align);
+
+#endif
@@ -53,6 +53,12 @@ struct list_elem * list_fetch(struct list_elem * head);
  */
 void list_delete(struct list_elem * head, struct list_elem * elem);
 
+/*
+ * unlink an element at any place in O(1) time,
+ * the caller must guarantee the elem is in the list
+ */
+void list_unlink(struct list_elem * head, struct list_elem * elem);
+
 #define LIST_FOREACH_START(head, elem) { \
     struct list_elem * __elem = (head)->next; \
     struct list_elem * __next = NULL; \
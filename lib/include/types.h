@@ -45,6 +45,24 @@ page_round_addr(uint32_t addr)
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
+/*
+ * 64-bit by 32-bit division, the kernel is not linked with libgcc which
+ * provides the generic 64-bit division.
+ */
+static inline uint64_t
+div_u64_u32(uint64_t dividend, uint32_t divisor)
+{
+    uint32_t high = (uint32_t)(dividend >> 32);
+    uint32_t quotient_high = high / divisor;
+    uint32_t remainder = high % divisor;
+    uint32_t quotient_low;
+    // the remainder is less than the divisor, divl never overflows
+    asm("divl %2;"
+        :"=a"(quotient_low), "=d"(remainder)
+        :"rm"(divisor), "0"((uint32_t)dividend), "1"(remainder));
+    return (((uint64_t)quotient_high) << 32) | quotient_low;
+}
+
 #define HIGH_BYTE(word) ((uint8_t)(((word) >> 8) & 0xff))
 #define LOW_BYTE(word) ((uint8_t)((word) & 0xff))
 #define MAKE_WORD(high_byte, low_byte) \
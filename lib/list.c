@@ -105,6 +105,25 @@ list_delete(struct list_elem * head, struct list_elem * elem)
     elem->next = NULL;
 }
 
+void
+list_unlink(struct list_elem * head, struct list_elem * elem)
+{
+    if (head->prev == elem) {
+        ASSERT(!elem->next);
+        head->prev = elem->prev;
+    }
+    if (head->next == elem) {
+        ASSERT(!elem->prev);
+        head->next = elem->next;
+    }
+    if (elem->next)
+        elem->next->prev = elem->prev;
+    if (elem->prev)
+        elem->prev->next = elem->next;
+    elem->prev = NULL;
+    elem->next = NULL;
+}
+
 int32_t
 element_in_list(struct list_elem * head, struct list_elem * elem)
 {
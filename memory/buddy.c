@@ -0,0 +1,641 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <memory/include/buddy.h>
+#include <memory/include/paging.h>
+#include <kernel/include/printk.h>
+#include <lib/include/string.h>
+#include <filesystem/include/devfs.h>
+#include <memory/include/shrinker.h>
+#include <x86/include/interrupt.h>
+
+struct page_frame * page_frames;
+uint32_t nr_page_frames;
+static struct free_area free_areas[BUDDY_MAX_ORDER + 1];
+static uint32_t nr_free_frames;
+static struct per_cpu_pages pcp_pages[NR_PCP_INSTANCES];
+
+static inline struct per_cpu_pages *
+this_cpu_pages(void)
+{
+    return &pcp_pages[0];
+}
+
+static inline void
+__add_free_block(uint32_t pfn, int32_t order)
+{
+    struct page_frame * frame = &page_frames[pfn];
+    ASSERT(!(frame->flags & PAGE_FRAME_FREE));
+    frame->order = order;
+    frame->flags |= PAGE_FRAME_FREE;
+    list_prepend(&free_areas[order].head, &frame->list);
+    free_areas[order].nr_free++;
+    nr_free_frames += 1 << order;
+}
+
+static inline void
+__del_free_block(uint32_t pfn, int32_t order)
+{
+    struct page_frame * frame = &page_frames[pfn];
+    ASSERT(frame->flags & PAGE_FRAME_FREE);
+    ASSERT(frame->order == order);
+    list_unlink(&free_areas[order].head, &frame->list);
+    frame->flags &= ~PAGE_FRAME_FREE;
+    free_areas[order].nr_free--;
+    nr_free_frames -= 1 << order;
+}
+
+/*
+ * Put a block back, merging it with its buddy as long as the buddy is free
+ * and of the same order.
+ */
+static void
+__free_block(uint32_t pfn, int32_t order)
+{
+    uint32_t buddy_pfn;
+    struct page_frame * buddy;
+    for (; order < BUDDY_MAX_ORDER; order++) {
+        buddy_pfn = pfn ^ (1 << order);
+        if (buddy_pfn >= nr_page_frames)
+            break;
+        buddy = &page_frames[buddy_pfn];
+        if (!(buddy->flags & PAGE_FRAME_FREE) || buddy->order != order)
+            break;
+        __del_free_block(buddy_pfn, order);
+        pfn &= ~(1 << order);
+    }
+    __add_free_block(pfn, order);
+}
+
+/*
+ * Take a block from the smallest non-empty free list whose order is no less
+ * than the requested one, the surplus halves are put back.
+ * return NR_PAGE_FRAMES if no block is available.
+ */
+static uint32_t
+__alloc_block(int32_t order)
+{
+    int32_t _order;
+    uint32_t pfn;
+    struct list_elem * _list;
+    for (_order = order; _order <= BUDDY_MAX_ORDER; _order++) {
+        if (!list_empty(&free_areas[_order].head))
+            break;
+    }
+    if (_order > BUDDY_MAX_ORDER)
+        return NR_PAGE_FRAMES;
+    _list = list_first_elem(&free_areas[_order].head);
+    pfn = PAGE_FRAME_TO_PFN(CONTAINER_OF(_list, struct page_frame, list));
+    __del_free_block(pfn, _order);
+    while (_order > order) {
+        _order--;
+        __add_free_block(pfn + (1 << _order), _order);
+    }
+    return pfn;
+}
+
+/*
+ * Release an arbitrary run of frames by splitting it into the largest
+ * naturally aligned blocks.
+ */
+static void
+__free_range(uint32_t pfn, uint32_t nr_frames)
+{
+    int32_t order;
+    while (nr_frames) {
+        for (order = 0; order < BUDDY_MAX_ORDER; order++) {
+            if ((pfn & (1 << order)) || (2 << order) > nr_frames)
+                break;
+        }
+        __free_block(pfn, order);
+        pfn += 1 << order;
+        nr_frames -= 1 << order;
+    }
+}
+
+/*
+ * allocate physically continuous pages, the registered shrinkers are asked
+ * to give memory back before it fails.
+ * return the address of the 1st page, 0 if no such run is available or
+ * nr_pages exceeds 2^BUDDY_MAX_ORDER.
+ */
+uint32_t
+get_pages(int nr_pages)
+{
+    int32_t order = 0;
+    int32_t idx;
+    uint32_t pfn;
+    uint32_t eflags;
+    if (nr_pages <= 0)
+        return 0;
+    while ((1 << order) < nr_pages)
+        order++;
+    if (order > BUDDY_MAX_ORDER)
+        return 0;
+    eflags = local_irq_save();
+    pfn = __alloc_block(order);
+    if (pfn == NR_PAGE_FRAMES) {
+        // The frames held by the page caches may make a block
+        drain_pcp_pages();
+        pfn = __alloc_block(order);
+    }
+    if (pfn == NR_PAGE_FRAMES && shrink_memory(1 << order)) {
+        // the shrinkers free single frames into the page caches
+        drain_pcp_pages();
+        pfn = __alloc_block(order);
+    }
+    if (pfn == NR_PAGE_FRAMES) {
+        local_irq_restore(eflags);
+        return 0;
+    }
+    // Give back the tail the caller does not ask for
+    if ((1 << order) > nr_pages)
+        __free_range(pfn + nr_pages, (1 << order) - nr_pages);
+    for (idx = 0; idx < nr_pages; idx++) {
+        page_frames[pfn + idx].refcount = 1;
+        page_frames[pfn + idx].owner = NULL;
+    }
+    local_irq_restore(eflags);
+    return pfn << 12;
+}
+
+/*
+ * move up to batch frames from the buddy system into the page cache
+ */
+static void
+__pcp_refill(struct per_cpu_pages * pcp)
+{
+    uint32_t idx;
+    uint32_t pfn;
+    for (idx = 0; idx < pcp->batch; idx++) {
+        pfn = __alloc_block(0);
+        if (pfn == NR_PAGE_FRAMES)
+            break;
+        page_frames[pfn].flags |= PAGE_FRAME_PCP;
+        list_append(&pcp->head, &page_frames[pfn].list);
+        pcp->count++;
+    }
+}
+
+/*
+ * return the nr_frames coldest frames, which are at the tail of the cache,
+ * to the buddy system.
+ */
+static void
+__pcp_drain(struct per_cpu_pages * pcp, uint32_t nr_frames)
+{
+    struct list_elem * _list;
+    struct page_frame * frame;
+    for (; nr_frames && pcp->count; nr_frames--) {
+        _list = list_pop(&pcp->head);
+        ASSERT(_list);
+        frame = CONTAINER_OF(_list, struct page_frame, list);
+        ASSERT(frame->flags & PAGE_FRAME_PCP);
+        frame->flags &= ~PAGE_FRAME_PCP;
+        pcp->count--;
+        __free_block(PAGE_FRAME_TO_PFN(frame), 0);
+    }
+}
+
+void
+drain_pcp_pages(void)
+{
+    int32_t idx;
+    uint32_t eflags = local_irq_save();
+    for (idx = 0; idx < NR_PCP_INSTANCES; idx++)
+        __pcp_drain(&pcp_pages[idx], pcp_pages[idx].count);
+    local_irq_restore(eflags);
+}
+
+uint32_t
+get_page(void)
+{
+    struct per_cpu_pages * pcp;
+    struct list_elem * _list;
+    struct page_frame * frame;
+    uint32_t eflags = local_irq_save();
+    pcp = this_cpu_pages();
+    if (!pcp->count) {
+        pcp->nr_misses++;
+        __pcp_refill(pcp);
+        if (!pcp->count) {
+            local_irq_restore(eflags);
+            return get_pages(1);
+        }
+    } else {
+        pcp->nr_hits++;
+    }
+    _list = list_fetch(&pcp->head);
+    ASSERT(_list);
+    frame = CONTAINER_OF(_list, struct page_frame, list);
+    ASSERT(frame->flags & PAGE_FRAME_PCP);
+    frame->flags &= ~PAGE_FRAME_PCP;
+    frame->refcount = 1;
+    frame->owner = NULL;
+    pcp->count--;
+    local_irq_restore(eflags);
+    return PAGE_FRAME_TO_PFN(frame) << 12;
+}
+
+void
+free_pages(uint32_t pg_addr, int nr_pages)
+{
+    int32_t idx;
+    uint32_t eflags;
+    ASSERT(!(pg_addr & PAGE_MASK));
+    if (nr_pages <= 0)
+        return;
+    eflags = local_irq_save();
+    for (idx = 0; idx < nr_pages; idx++) {
+        page_frames[(pg_addr >> 12) + idx].refcount = 0;
+        page_frames[(pg_addr >> 12) + idx].flags = 0;
+    }
+    __free_range(pg_addr >> 12, nr_pages);
+    local_irq_restore(eflags);
+}
+
+void
+free_page(uint32_t pg_addr)
+{
+    struct per_cpu_pages * pcp;
+    struct page_frame * frame = &page_frames[pg_addr >> 12];
+    uint32_t eflags;
+    ASSERT(!(pg_addr & PAGE_MASK));
+    ASSERT(!(frame->flags & (PAGE_FRAME_FREE | PAGE_FRAME_PCP)));
+    eflags = local_irq_save();
+    pcp = this_cpu_pages();
+    frame->refcount = 0;
+    frame->flags = PAGE_FRAME_PCP;
+    list_prepend(&pcp->head, &frame->list);
+    pcp->count++;
+    if (pcp->count > pcp->high)
+        __pcp_drain(pcp, pcp->batch);
+    local_irq_restore(eflags);
+}
+
+void
+get_page_frame(uint32_t pg_addr)
+{
+    struct page_frame * frame = &page_frames[pg_addr >> 12];
+    ASSERT(!(frame->flags & (PAGE_FRAME_FREE | PAGE_FRAME_PCP)));
+    ASSERT(frame->refcount);
+    frame->refcount++;
+}
+
+void
+put_page_frame(uint32_t pg_addr)
+{
+    struct page_frame * frame = &page_frames[pg_addr >> 12];
+    ASSERT(!(frame->flags & (PAGE_FRAME_FREE | PAGE_FRAME_PCP)));
+    ASSERT(frame->refcount);
+    frame->refcount--;
+    if (!frame->refcount)
+        free_page(pg_addr & ~PAGE_MASK);
+}
+
+uint32_t
+page_frame_refcount(uint32_t pg_addr)
+{
+    return page_frames[pg_addr >> 12].refcount;
+}
+
+static inline struct page_frame *
+allocated_page_frame(uint32_t pg_addr)
+{
+    struct page_frame * frame = &page_frames[pg_addr >> 12];
+    ASSERT((pg_addr >> 12) < nr_page_frames);
+    ASSERT(!(frame->flags &
+        (PAGE_FRAME_FREE | PAGE_FRAME_PCP | PAGE_FRAME_RESERVED)));
+    return frame;
+}
+
+void
+set_page_frame_flags(uint32_t pg_addr, uint8_t flags)
+{
+    allocated_page_frame(pg_addr)->flags |= flags;
+}
+
+void
+clear_page_frame_flags(uint32_t pg_addr, uint8_t flags)
+{
+    allocated_page_frame(pg_addr)->flags &= ~flags;
+}
+
+uint8_t
+get_page_frame_flags(uint32_t pg_addr)
+{
+    return allocated_page_frame(pg_addr)->flags;
+}
+
+void
+set_page_frame_owner(uint32_t pg_addr, void * owner)
+{
+    allocated_page_frame(pg_addr)->owner = owner;
+}
+
+void *
+get_page_frame_owner(uint32_t pg_addr)
+{
+    return allocated_page_frame(pg_addr)->owner;
+}
+
+/*
+ * walk the descriptor array, a free block is skipped at a time.
+ */
+void
+get_page_frame_summary(struct page_frame_summary * summary)
+{
+    uint32_t pfn = 0;
+    struct page_frame * frame;
+    memset(summary, 0x0, sizeof(struct page_frame_summary));
+    summary->nr_frames = nr_page_frames;
+    while (pfn < nr_page_frames) {
+        frame = &page_frames[pfn];
+        if (frame->flags & PAGE_FRAME_FREE) {
+            summary->nr_free += 1 << frame->order;
+            pfn += 1 << frame->order;
+            continue;
+        }
+        pfn++;
+        if (frame->flags & PAGE_FRAME_PCP) {
+            summary->nr_free++;
+            continue;
+        }
+        if (frame->flags & PAGE_FRAME_RESERVED) {
+            summary->nr_reserved++;
+            continue;
+        }
+        if (frame->flags & PAGE_FRAME_KERNEL)
+            summary->nr_kernel++;
+        if (frame->flags & PAGE_FRAME_USER)
+            summary->nr_user++;
+        if (frame->flags & PAGE_FRAME_PAGE_CACHE)
+            summary->nr_page_cache++;
+        if (frame->flags & PAGE_FRAME_PINNED)
+            summary->nr_pinned++;
+        if (frame->flags & PAGE_FRAME_DIRTY)
+            summary->nr_dirty++;
+        if (frame->refcount > 1)
+            summary->nr_shared++;
+        if (!(frame->flags & (PAGE_FRAME_KERNEL | PAGE_FRAME_USER |
+            PAGE_FRAME_PAGE_CACHE)))
+            summary->nr_untyped++;
+    }
+}
+
+void
+dump_page_frame_summary(void)
+{
+    struct page_frame_summary summary;
+    get_page_frame_summary(&summary);
+    LOG_INFO("Dump page frames(total:%d):\n", summary.nr_frames);
+    LOG_INFO("   reserved: %d\n", summary.nr_reserved);
+    LOG_INFO("   free: %d\n", summary.nr_free);
+    LOG_INFO("   kernel: %d\n", summary.nr_kernel);
+    LOG_INFO("   user: %d\n", summary.nr_user);
+    LOG_INFO("   page cache: %d\n", summary.nr_page_cache);
+    LOG_INFO("   pinned: %d dirty: %d shared: %d untyped: %d\n",
+        summary.nr_pinned,
+        summary.nr_dirty,
+        summary.nr_shared,
+        summary.nr_untyped);
+}
+
+/*
+ * the frames in the page caches are free as well
+ */
+uint32_t
+get_nr_free_frames(void)
+{
+    int32_t idx;
+    uint32_t nr_frames = nr_free_frames;
+    for (idx = 0; idx < NR_PCP_INSTANCES; idx++)
+        nr_frames += pcp_pages[idx].count;
+    return nr_frames;
+}
+
+void
+get_buddy_free_counts(uint32_t * nr_free, int32_t nr_orders)
+{
+    int32_t order;
+    for (order = 0; order < nr_orders && order <= BUDDY_MAX_ORDER; order++)
+        nr_free[order] = free_areas[order].nr_free;
+}
+
+void
+dump_buddy_free_areas(void)
+{
+    int32_t order;
+    int32_t idx;
+    LOG_INFO("Dump buddy free areas(free frames:%d):\n", nr_free_frames);
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        LOG_INFO("   order %d: %d free blocks\n",
+            order,
+            free_areas[order].nr_free);
+    }
+    for (idx = 0; idx < NR_PCP_INSTANCES; idx++) {
+        LOG_INFO("   pcp %d: %d cached frames, hits:%d misses:%d\n",
+            idx,
+            pcp_pages[idx].count,
+            pcp_pages[idx].nr_hits,
+            pcp_pages[idx].nr_misses);
+    }
+}
+
+/*
+ * /dev/buddyinfo gives the number of free blocks of each order in one line.
+ */
+static int32_t
+buddyinfo_dev_read(struct file * file, uint32_t offset, void * buffer, int size)
+{
+    uint8_t info[256];
+    int32_t length = 0;
+    int32_t order;
+    memset(info, 0x0, sizeof(info));
+    length += sprintf((char *)info + length, "Order");
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+        length += sprintf((char *)info + length, " %d", order);
+    length += sprintf((char *)info + length, "\nFree ");
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+        length += sprintf((char *)info + length, " %d",
+            free_areas[order].nr_free);
+    length += sprintf((char *)info + length, "\n");
+    if (offset >= length)
+        return 0;
+    size = MIN(size, length - (int32_t)offset);
+    memcpy(buffer, info + offset, size);
+    return size;
+}
+
+static struct file_operation buddyinfo_dev_ops = {
+    .isatty = NULL,
+    .size = NULL,
+    .stat = NULL,
+    .read = buddyinfo_dev_read,
+    .write = NULL,
+    .truncate = NULL,
+    .ioctl = NULL
+};
+
+/*
+ * /dev/frameinfo gives the number of frames of each usage, one per line.
+ */
+static int32_t
+frameinfo_dev_read(struct file * file, uint32_t offset, void * buffer, int size)
+{
+    uint8_t info[256];
+    int32_t length = 0;
+    struct page_frame_summary summary;
+    get_page_frame_summary(&summary);
+    memset(info, 0x0, sizeof(info));
+    length += sprintf((char *)info + length, "Total %d\n", summary.nr_frames);
+    length += sprintf((char *)info + length, "Reserved %d\n",
+        summary.nr_reserved);
+    length += sprintf((char *)info + length, "Free %d\n", summary.nr_free);
+    length += sprintf((char *)info + length, "Kernel %d\n",
+        summary.nr_kernel);
+    length += sprintf((char *)info + length, "User %d\n", summary.nr_user);
+    length += sprintf((char *)info + length, "PageCache %d\n",
+        summary.nr_page_cache);
+    length += sprintf((char *)info + length, "Pinned %d\n",
+        summary.nr_pinned);
+    length += sprintf((char *)info + length, "Dirty %d\n", summary.nr_dirty);
+    length += sprintf((char *)info + length, "Shared %d\n",
+        summary.nr_shared);
+    length += sprintf((char *)info + length, "Untyped %d\n",
+        summary.nr_untyped);
+    if (offset >= length)
+        return 0;
+    size = MIN(size, length - (int32_t)offset);
+    memcpy(buffer, info + offset, size);
+    return size;
+}
+
+static struct file_operation frameinfo_dev_ops = {
+    .isatty = NULL,
+    .size = NULL,
+    .stat = NULL,
+    .read = frameinfo_dev_read,
+    .write = NULL,
+    .truncate = NULL,
+    .ioctl = NULL
+};
+
+#if defined(INLINE_TEST)
+static void
+buddy_test(void)
+{
+    uint32_t nr_free = nr_free_frames;
+    uint32_t addr0 = get_pages(3);
+    uint32_t addr1 = get_pages(8);
+    ASSERT(addr0 && addr1);
+    ASSERT(!((addr1 >> 12) & 0x7));
+    ASSERT(nr_free_frames == nr_free - 11);
+    free_pages(addr0, 3);
+    free_pages(addr1, 8);
+    ASSERT(nr_free_frames == nr_free);
+    // A freed frame is handed out again first
+    nr_free = get_nr_free_frames();
+    addr0 = get_page();
+    addr1 = get_page();
+    ASSERT(addr0 && addr1 && addr0 != addr1);
+    free_page(addr0);
+    ASSERT(get_page() == addr0);
+    // the usage of a frame is dropped once it's freed
+    set_page_frame_flags(addr0, PAGE_FRAME_KERNEL | PAGE_FRAME_PINNED);
+    set_page_frame_owner(addr0, &nr_free);
+    ASSERT(get_page_frame_owner(addr0) == &nr_free);
+    {
+        struct page_frame_summary summary;
+        get_page_frame_summary(&summary);
+        ASSERT(summary.nr_free == get_nr_free_frames());
+        ASSERT(summary.nr_kernel && summary.nr_pinned);
+    }
+    free_page(addr0);
+    ASSERT(get_page() == addr0);
+    ASSERT(!get_page_frame_owner(addr0));
+    ASSERT(!(page_frames[addr0 >> 12].flags & PAGE_FRAME_KERNEL));
+    // a shared frame is released with its last reference
+    get_page_frame(addr0);
+    ASSERT(page_frame_refcount(addr0) == 2);
+    put_page_frame(addr0);
+    ASSERT(get_nr_free_frames() == nr_free - 2);
+    put_page_frame(addr0);
+    free_page(addr1);
+    ASSERT(get_nr_free_frames() == nr_free);
+    drain_pcp_pages();
+    ASSERT(nr_free_frames == nr_free);
+}
+#endif
+
+/*
+ * Reserve the frame descriptor array for the frames below the physical
+ * memory boundary, it's called before the kernel VMAs are set up.
+ */
+void
+page_frame_array_init(void)
+{
+    nr_page_frames = MIN(get_system_memory_boundary() >> 12, NR_PAGE_FRAMES);
+    page_frames = reserve_boot_memory(nr_page_frames *
+        sizeof(struct page_frame));
+    LOG_INFO("page frame descriptors: %d frames at 0x%x\n",
+        nr_page_frames,
+        page_frames);
+}
+
+/*
+ * Put the frames above the kernel image into the buddy system, except
+ * those of PageInventory which are taken by get_base_page().
+ */
+void
+buddy_init(void)
+{
+    int32_t order;
+    int32_t idx;
+    uint32_t pfn;
+    uint32_t sys_mem_start = get_system_memory_start() >> 12;
+    uint32_t sys_mem_boundary = nr_page_frames;
+    uint32_t page_space_bottom = PAGE_SPACE_BOTTOM >> 12;
+    uint32_t page_space_top = PAGE_SPACE_TOP >> 12;
+    ASSERT(page_frames);
+    memset(page_frames, 0x0, nr_page_frames * sizeof(struct page_frame));
+    for (pfn = 0; pfn < nr_page_frames; pfn++) {
+        if (pfn < sys_mem_start ||
+            (pfn >= page_space_bottom && pfn < page_space_top))
+            page_frames[pfn].flags = PAGE_FRAME_RESERVED;
+    }
+    memset(free_areas, 0x0, sizeof(free_areas));
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+        list_init(&free_areas[order].head);
+    nr_free_frames = 0;
+    memset(pcp_pages, 0x0, sizeof(pcp_pages));
+    for (idx = 0; idx < NR_PCP_INSTANCES; idx++) {
+        list_init(&pcp_pages[idx].head);
+        pcp_pages[idx].high = PCP_HIGH_WATER;
+        pcp_pages[idx].batch = PCP_BATCH;
+    }
+    if (sys_mem_start < page_space_bottom)
+        __free_range(sys_mem_start,
+            MIN(page_space_bottom, sys_mem_boundary) - sys_mem_start);
+    if (sys_mem_boundary > page_space_top)
+        __free_range(page_space_top, sys_mem_boundary - page_space_top);
+    LOG_INFO("buddy system: %d free frames\n", nr_free_frames);
+#if defined(INLINE_TEST)
+    buddy_test();
+#endif
+}
+
+void
+buddy_post_init(void)
+{
+    ASSERT(register_dev_node(get_dev_filesystem(),
+        (uint8_t *)"/buddyinfo",
+        0x0,
+        &buddyinfo_dev_ops,
+        NULL));
+    ASSERT(register_dev_node(get_dev_filesystem(),
+        (uint8_t *)"/frameinfo",
+        0x0,
+        &frameinfo_dev_ops,
+        NULL));
+}
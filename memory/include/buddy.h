@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _BUDDY_H
+#define _BUDDY_H
+#include <lib/include/types.h>
+#include <lib/include/list.h>
+
+/*
+ * The physical page frames are managed by a binary buddy system: a free block
+ * of order n consists of 2^n page frames whose first frame number is aligned
+ * to 2^n, its buddy is the adjacent block of the same order with which it can
+ * be merged into a block of order n + 1.
+ */
+#define BUDDY_MAX_ORDER 10
+#define NR_PAGE_FRAMES (1 << 20)
+
+#define PAGE_FRAME_FREE 0x1
+// the frame is held in a per-cpu page cache
+#define PAGE_FRAME_PCP 0x2
+/*
+ * the usage of an allocated frame, they are cleared once it's freed.
+ * PAGE_FRAME_PINNED: the frame must stay where it is, e.g. DMA memory.
+ * PAGE_FRAME_DIRTY: the content is modified and not written back yet.
+ * PAGE_FRAME_PAGE_CACHE: the frame caches file content.
+ * PAGE_FRAME_KERNEL: the frame is mapped in kernel space.
+ * PAGE_FRAME_USER: the frame is anonymous memory of a task.
+ */
+#define PAGE_FRAME_PINNED 0x4
+#define PAGE_FRAME_DIRTY 0x8
+#define PAGE_FRAME_PAGE_CACHE 0x10
+#define PAGE_FRAME_KERNEL 0x20
+#define PAGE_FRAME_USER 0x40
+// the frame is not managed by buddy system: kernel image, PageInventory.
+#define PAGE_FRAME_RESERVED 0x80
+
+/*
+ * The physical frames above the kernel image are not mapped, the per-frame
+ * descriptor holds the free list linkage instead of the frame itself.
+ * The descriptors are in an array indexed by frame number, which is
+ * reserved right after the kernel image at boot.
+ */
+struct page_frame {
+    // the free list linkage, the owner's lru linkage once allocated.
+    struct list_elem list;
+    uint8_t order;
+    uint8_t flags;
+    // the number of mappings sharing the frame, it's 1 once allocated.
+    uint16_t refcount;
+    // the task or file the frame is allocated for, NULL if unknown
+    void * owner;
+};
+
+/*
+ * the frames counted by their usage, a frame is counted once in each of the
+ * categories it belongs to.
+ */
+struct page_frame_summary {
+    uint32_t nr_frames;
+    uint32_t nr_reserved;
+    uint32_t nr_free;
+    uint32_t nr_kernel;
+    uint32_t nr_user;
+    uint32_t nr_page_cache;
+    uint32_t nr_pinned;
+    uint32_t nr_dirty;
+    // the frames shared by more than one mapping
+    uint32_t nr_shared;
+    // the frames allocated without usage
+    uint32_t nr_untyped;
+};
+
+struct free_area {
+    struct list_elem head;
+    uint32_t nr_free;
+};
+
+/*
+ * The per-cpu page cache keeps recently freed single frames in LIFO order so
+ * that get_page()/free_page() are O(1) and reuse cache-warm frames. It is
+ * refilled from and drained to the buddy system batch frames at a time.
+ * There is only one instance until SMP is supported, every instance must be
+ * accessed with interrupts disabled on its own cpu, get_page(), free_page()
+ * and drain_pcp_pages() disable them themselves, so do get_pages() and
+ * free_pages() for the buddy free areas.
+ */
+#define NR_PCP_INSTANCES 1
+#define PCP_HIGH_WATER 64
+#define PCP_BATCH 16
+
+struct per_cpu_pages {
+    struct list_elem head;
+    uint32_t count;
+    uint32_t high;
+    uint32_t batch;
+    uint32_t nr_hits;
+    uint32_t nr_misses;
+};
+
+#define PAGE_FRAME_TO_PFN(frame) ((uint32_t)((frame) - page_frames))
+
+extern struct page_frame * page_frames;
+extern uint32_t nr_page_frames;
+
+uint32_t
+get_nr_free_frames(void);
+
+void
+drain_pcp_pages(void);
+
+/*
+ * take/drop a reference to an allocated frame, the frame is freed when the
+ * last reference is dropped.
+ */
+void
+get_page_frame(uint32_t pg_addr);
+
+void
+put_page_frame(uint32_t pg_addr);
+
+uint32_t
+page_frame_refcount(uint32_t pg_addr);
+
+/*
+ * tag an allocated frame with its usage and owner.
+ */
+void
+set_page_frame_flags(uint32_t pg_addr, uint8_t flags);
+
+void
+clear_page_frame_flags(uint32_t pg_addr, uint8_t flags);
+
+uint8_t
+get_page_frame_flags(uint32_t pg_addr);
+
+void
+set_page_frame_owner(uint32_t pg_addr, void * owner);
+
+void *
+get_page_frame_owner(uint32_t pg_addr);
+
+void
+get_page_frame_summary(struct page_frame_summary * summary);
+
+void
+dump_page_frame_summary(void);
+
+void
+page_frame_array_init(void);
+
+void
+get_buddy_free_counts(uint32_t * nr_free, int32_t nr_orders);
+
+void
+dump_buddy_free_areas(void);
+
+void
+buddy_init(void);
+
+void
+buddy_post_init(void);
+
+#endif
@@ -4,15 +4,12 @@
 #ifndef _KERNEL_VMA_H
 #define _KERNEL_VMA_H
 #include <lib/include/types.h>
+#include <lib/include/avl_tree.h>
 
 #define KERNEL_VMA_NAME_SIZE 64
 struct kernel_vma
 {
     uint8_t name[KERNEL_VMA_NAME_SIZE];
-    /*
-     * a valid vma is set to 1
-     */
-    uint32_t present:1;
     /*
      * if the vma set exact to 1, the continuous phy_addr
      */
@@ -31,6 +28,15 @@ struct kernel_vma
      * length is times of PAGE_SIZE
      */
     uint32_t length;
+    /*
+     * The kernel VMAs are kept in a tree ordered by virt_addr, each node
+     * is augmented with the address range its subtree spans and the
+     * largest free gap between the VMAs of its subtree.
+     */
+    struct avl_node node;
+    uint32_t subtree_start;
+    uint32_t subtree_end;
+    uint32_t subtree_max_gap;
 };
 
 struct kernel_vma * search_kernel_vma(uint32_t virt_addr);
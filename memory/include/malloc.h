@@ -20,22 +20,36 @@
  * |         |           | <-----------user ptr
  * |size     |           |
  * |         |           |
- * |         |           |
+ * |         +-----------+
+ * |         |           | malloc_footer
  *---------  +-----------+
  *for free chunk, the padding header is not present.
- *the available size is: size - len(malloc_hdr) - len(padding_hdr)
- *and the available size is used to index the recycle bin when a memory chunk
- *is freed. so remember to use available size to calculate the bin index.
+ *the footer is a boundary tag which duplicates the size and the free state
+ *of the chunk, it tells the chunk after it where its previous neighbour
+ *starts, and it's verified when the chunk is freed to catch overruns.
+ *
+ *the heap is managed as a two-level segregated fit(TLSF) allocator: the
+ *first level splits the free chunks by power of 2 size classes, and the
+ *second level divides every power of 2 range linearly into
+ *TLSF_SL_INDEX_COUNT lists. a bitmap of non-empty lists at each level lets
+ *both malloc and free find a list with a single bit scan, i.e. in O(1).
  */
 #define MALLOC_MAGIC 0x5555
-#define RECYCLE_BIN_SIZE (12 + 1)
-#define MISC_BIN (RECYCLE_BIN_SIZE - 1)
 /*
- * the select policy is best fit
- * with buddy system to recycle the memory block to free, when 
- * a memory block is to be recycled, it is coalesced with the block
- * via next_block pointer.
+ * the select policy is good fit: the request size is rounded up to the
+ * next list boundary so that any chunk in the found list is large enough.
+ * when a memory chunk is recycled, it is coalesced with both its previous
+ * and next physical neighbours.
  */
+#define TLSF_SL_INDEX_LOG2 4
+#define TLSF_SL_INDEX_COUNT (1 << TLSF_SL_INDEX_LOG2)
+#define TLSF_FL_INDEX_SHIFT (TLSF_SL_INDEX_LOG2 + 4)
+#define TLSF_FL_INDEX_COUNT (32 - TLSF_FL_INDEX_SHIFT + 1)
+#define TLSF_SMALL_BLOCK_SIZE (1 << TLSF_FL_INDEX_SHIFT)
+#define TLSF_SMALL_BLOCK_STEP (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_INDEX_COUNT)
+
+#define MALLOC_BLOCK_ALIGN 4
+#define MALLOC_MIN_BLOCK_SIZE 32
 
 struct malloc_header {
     uint32_t prev;
@@ -46,6 +60,13 @@ struct malloc_header {
     uint16_t magic:15;
 }__attribute__((packed));
 
+struct malloc_footer {
+    uint32_t size;
+    uint16_t reserved;
+    uint16_t free:1;
+    uint16_t magic:15;
+}__attribute__((packed));
+
 
 
 struct padding_header {
@@ -54,28 +75,63 @@ struct padding_header {
     uint16_t magic:15;
 }__attribute__((packed));
 
-
-#define LENGTH_TO_RECYCLE_BIN_INDEX(len) ({\
-    int32_t _bin_len[RECYCLE_BIN_SIZE - 1] = { \
-        0x10, 0x20, 0x40, 0x80, \
-        0x100, 0x200, 0x400, 0x800, \
-        0x1000, 0x2000, 0x4000, 0x8000}; \
-    int32_t _idx = 0; \
-    for(; _idx < RECYCLE_BIN_SIZE - 1; _idx++) \
-        if ((len) <= _bin_len[_idx]) \
-            break; \
-    _idx; \
-})
-
 void * malloc(int len);
 void * malloc_align(int len, int align);
 void free(void * mem);
-void dump_recycle_bins(void);
+
+/*
+ * small chunks(no more than MALLOC_QUICK_MAX_SIZE bytes) are cached in
+ * per size class LIFO quick lists when freed, and served again without
+ * touching the TLSF lists. a list caches at most the high water mark chunks,
+ * all the lists are flushed back to the TLSF lists under memory pressure.
+ */
+#define MALLOC_QUICK_STEP 16
+#define MALLOC_QUICK_MAX_SIZE 256
+#define MALLOC_QUICK_MAX_ALIGN 4
+#define MALLOC_QUICK_LIST_COUNT (MALLOC_QUICK_MAX_SIZE / MALLOC_QUICK_STEP)
+#define MALLOC_QUICK_LIST_HIGH_WATER 64
+#define QUICK_LIST_INDEX(len) \
+    ((len) ? (((len) + MALLOC_QUICK_STEP - 1) / MALLOC_QUICK_STEP - 1) : 0)
+struct malloc_quick_list {
+    // user pointer of the first cached chunk, linked in the user area
+    uint32_t head;
+    uint32_t nr_chunks;
+    uint32_t nr_hits;
+    uint32_t nr_misses;
+};
+// in per mille
+#define QUICK_LIST_HIT_RATE(list) ({\
+    uint32_t _total = (list)->nr_hits + (list)->nr_misses; \
+    _total ? (list)->nr_hits * 1000 / _total : 0; \
+})
+
+/*
+ * the kernel heap is mapped on demand by the kernel page fault handler,
+ * the whole pages inside a free chunk which is no less than the threshold
+ * are unmapped and returned to the physical page allocator.
+ */
+#define MALLOC_RECLAIM_THRESHOLD (16 * PAGE_SIZE)
+
+struct malloc_stat {
+    uint32_t nr_free_chunks;
+    uint32_t free_bytes;
+    uint32_t largest_free_chunk;
+    uint32_t nr_reclaimed_pages;
+    /*
+     * in per mille: 1000 * (1 - largest_free_chunk / free_bytes),
+     * 0 means all the free memory is in a single chunk.
+     */
+    uint32_t fragmentation;
+};
+void get_malloc_stat(struct malloc_stat * stat);
+void dump_malloc_stat(void);
+uint32_t malloc_flush_quick_lists(void);
+void malloc_set_quick_list_high_water(uint32_t high_water);
 void malloc_init(void);
 void * stack_alloc(uint32_t size);
 
 // The two functions below ensure the allocated memory blocks are already
-// in the kernel paging directory.
+// in the kernel paging directory, the mapping stays until they are freed.
 void *
 malloc_align_mapped(int len, int align);
 
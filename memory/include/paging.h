@@ -17,7 +17,9 @@ struct pde32 {
     uint32_t accessed:1;
     uint32_t reserved0:1;
     uint32_t page_size:1;
-    uint32_t reserved1:4;
+    // only for the PDE which maps a 4MB page
+    uint32_t global:1;
+    uint32_t reserved1:3;
     uint32_t pt_frame:20;
 }__attribute__((packed));
 
@@ -34,10 +36,25 @@ struct pte32 {
     uint32_t dirty:1;
     uint32_t pat:1;// page attribute table
     uint32_t global:1;
-    uint32_t reserved:3;
+    uint32_t available:3;
     uint32_t pg_frame:20;
 }__attribute__((packed));
 
+/*
+ * A PDE with page_size set maps a 4MB page directly, its address is in the
+ * upper 10 bits of pt_frame, the lower bits must be zero without PSE-36.
+ */
+#define LARGE_PAGE_SIZE 0x400000
+#define LARGE_PAGE_MASK 0x3fffff
+#define PAGES_PER_LARGE_PAGE (LARGE_PAGE_SIZE / PAGE_SIZE)
+
+/*
+ * the bits in pte32.available which are ignored by MMU
+ * PTE_FRAME_NOT_OWNED: the frame is not allocated for the mapping, e.g. a
+ * page of file content, it's never released or reference counted.
+ */
+#define PTE_FRAME_NOT_OWNED 0x1
+
 uint32_t
 create_pte32(uint32_t write_permission,
     uint32_t supervisor_permission,
@@ -52,6 +69,13 @@ create_pde32(uint32_t write_permission,
     uint32_t page_cachedisable,
     uint32_t pt_frame);
 
+uint32_t
+create_large_pde32(uint32_t write_permission,
+    uint32_t supervisor_permission,
+    uint32_t page_writethrough,
+    uint32_t page_cachedisable,
+    uint32_t pg_frame);
+
 #define PAGE_ALIGN(addr) ((uint32_t)((addr) & (~PAGE_MASK)))
 
 #define PDE32_TO_DWORD(entry) (*(uint32_t*)(entry))
@@ -60,7 +84,6 @@ create_pde32(uint32_t write_permission,
 #define PDE32_PTR(addr) ((struct pde32*)(addr))
 #define PTE32_PTR(addr) ((struct pte32*)(addr))
 
-#define FREE_PAGE_BITMAP_SIZE  ((1 << 20) >> 3)
 #define PHYSICAL_MEMORY_TO_PAGE_FRAME(mem) (((uint32_t)(mem)) >> 12)
 
 #define AT_BYTE(fn) ((fn) >> 3)
@@ -68,48 +91,6 @@ create_pde32(uint32_t write_permission,
 
 #define INVALID_PAGE 0xffffffff
 
-#define IS_PAGE_FREE(pg_fn) ({\
-    uint32_t _pg_fn = (pg_fn) >> 12; \
-    uint32_t _byte_index = AT_BYTE((_pg_fn)); \
-    uint8_t _bit_index = AT_BIT((_pg_fn)); \
-    !((free_page_bitmap[_byte_index] >> _bit_index) & 0x1); \
-})
-
-#define MAKR_PAGE_AS_FREE(pg_fn) {\
-    uint32_t _pg_fn = (pg_fn) >> 12; \
-    uint32_t _byte_index = AT_BYTE((_pg_fn)); \
-    uint8_t _bit_index = AT_BIT((_pg_fn)); \
-    uint8_t _mask = 1 << _bit_index; \
-    _mask = ~_mask; \
-    free_page_bitmap[_byte_index] &= _mask; \
-}
-
-#define MARK_PAGE_AS_OCCUPIED(pg_fn) { \
-    uint32_t _pg_fn = (pg_fn) >> 12; \
-    uint32_t _byte_index = AT_BYTE((_pg_fn)); \
-    uint8_t _bit_index = AT_BIT((_pg_fn)); \
-    uint8_t _mask = 1 << _bit_index; \
-    free_page_bitmap[_byte_index] |= _mask; \
-}
-
-/*
- * deprecated macro to search free pages, as it only can search one free page
- * every time
- */
-#define SEARCH_FREE_PAGE(start_addr, mem_boundary) ({\
-    uint32_t _addr = (uint32_t)(start_addr); \
-    uint32_t _target = INVALID_PAGE; \
-    for (; _addr < (uint32_t)(mem_boundary); _addr += PAGE_SIZE) { \
-        if (IS_PAGE_FREE(_addr)) { \
-            _target = _addr; \
-            break; \
-        } \
-    } \
-    if (_target != INVALID_PAGE) \
-        _target = (uint32_t)(_target & (~PAGE_MASK)); \
-    _target; \
-})
-
 #define UPPER_MEMORY_PAGE_INDEX  PHYSICAL_MEMORY_TO_PAGE_FRAME(0x100000)
 
 #define PAGE_PERMISSION_READ_ONLY 0x0
@@ -135,14 +116,72 @@ void kernel_map_page(uint32_t virt_addr,
     uint32_t write_permission,
     uint32_t page_writethrough,
     uint32_t page_cachedisable);
+uint32_t kernel_unmap_page(uint32_t virt_addr);
+
+/*
+ * map a 4MB aligned physical block at a 4MB aligned kernel virtual address
+ * with one PDE, the PDE must not be in use.
+ * a large page is split into a page table once a 4KB page of it is mapped
+ * or unmapped, its frames are owned page by page from then on.
+ */
+int32_t kernel_map_large_page(uint32_t virt_addr,
+    uint32_t phy_addr,
+    uint32_t write_permission,
+    uint32_t page_writethrough,
+    uint32_t page_cachedisable);
+int32_t large_page_enabled(void);
+int32_t kernel_large_page_mappable(uint32_t virt_addr);
+/*
+ * the number of TLB entries needed to cover the mapped pages in
+ * [start, end) of the kernel address space
+ */
+uint32_t kernel_tlb_footprint(uint32_t start, uint32_t end);
 void enable_paging(void);
 void disable_paging(void);
+/*
+ * flush_tlb() drops all the TLB entries including the global ones, a single
+ * mapping change is to be flushed with flush_tlb_entry().
+ */
 void flush_tlb(void);
+void flush_tlb_entry(uint32_t virt_addr);
 void dump_page_tables(uint32_t page_directory);
 
+/*
+ * copy a physical frame to another one through the kernel scratch space,
+ * neither of them has to be mapped in kernel.
+ */
+void copy_page_frame(uint32_t dst_frame, uint32_t src_frame);
+void zero_page_frame(uint32_t frame);
+/*
+ * map a frame at the scratch window to access it in kernel, only one frame
+ * can be mapped at a time.
+ */
+void * kernel_map_scratch_frame(uint32_t frame);
+void kernel_unmap_scratch_frame(void);
+
 uint32_t get_base_page(void);
 void free_base_page(uint32_t);
 
+#define ZEROED_PAGE_POOL_SIZE 64
+struct zeroed_page_stat {
+    uint32_t nr_pooled;
+    // the pre-zeroed frames for the anonymous user pages
+    uint32_t nr_frames_pooled;
+    // allocations served by the pool
+    uint32_t nr_hits;
+    // allocations which clear the page by themselves
+    uint32_t nr_sync_zeroed;
+    // pages cleared by the idle task
+    uint32_t nr_idle_zeroed;
+};
+
+uint32_t get_zeroed_base_page(void);
+void refill_zeroed_base_pages(void);
+uint32_t get_zeroed_page_frame(void);
+void refill_zeroed_page_frames(void);
+void get_zeroed_page_stat(struct zeroed_page_stat * stat);
+void dump_zeroed_page_stat(void);
+
 __attribute__((always_inline)) inline uint32_t
 virt2phy(uint32_t * page_directory, uint32_t virt_addr);
 
@@ -151,4 +190,12 @@ page_present(uint32_t * page_directory, uint32_t virt_addr);
 
 void enable_kernel_paging(void);
 
+/*
+ * copy the userspace entries of a task page directory into the kernel page
+ * directory and reload CR3, the global kernel TLB entries survive it.
+ * NULL leaves userspace unmapped.
+ */
+void load_user_page_directory(uint32_t * page_directory);
+uint32_t * get_loaded_user_page_directory(void);
+
 #endif
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _SHRINKER_H
+#define _SHRINKER_H
+#include <lib/include/types.h>
+#include <lib/include/list.h>
+
+/*
+ * The subsystems which cache memory they can live without register a
+ * shrinker, the physical page allocator calls the shrinkers in registration
+ * order before it fails an allocation, until enough frames are given back.
+ * A shrink callback releases up to nr_frames frames and returns the number
+ * of frames actually released, it may allocate nothing on the way.
+ */
+struct shrinker {
+    struct list_elem list;
+    const char * name;
+    uint32_t (*shrink)(uint32_t nr_frames);
+    uint32_t nr_calls;
+    uint32_t nr_reclaimed;
+};
+
+void
+register_shrinker(struct shrinker * shrinker);
+
+/*
+ * ask the shrinkers to release nr_frames frames,
+ * return the number of frames released. It's not re-entrant: an allocation
+ * failure inside a shrink callback does not shrink again.
+ */
+uint32_t
+shrink_memory(uint32_t nr_frames);
+
+void
+dump_shrinkers(void);
+
+#endif
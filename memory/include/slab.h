@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _SLAB_H
+#define _SLAB_H
+#include <lib/include/types.h>
+#include <lib/include/list.h>
+
+/*
+ * memory layout of a slab:
+ *           +-----------+ <--- slab_size aligned
+ *           |           | struct slab
+ *           +-----------+ <--- object_offset
+ *           |           | object 0
+ *           +-----------+
+ *           |           | object 1
+ *           +-----------+
+ *           |    ...    |
+ *           +-----------+
+ *           |           | object nr_objects_per_slab - 1
+ *           +-----------+ <--- slab_size
+ * a slab is always aligned to its own size(a power of 2 number of pages),
+ * so the slab header of an object is found by masking the object address.
+ * a free object stores the address of the next free object in its first
+ * word, which makes both allocation and release O(1).
+ */
+#define SLAB_MAGIC 0x51ab51ab
+#define KMEM_CACHE_NAME_LENGTH 32
+#define KMEM_CACHE_MIN_ALIGN 4
+/*
+ * a slab grows its size until it can accommodate at least
+ * KMEM_CACHE_MIN_OBJECTS objects, but never beyond KMEM_CACHE_MAX_PAGES pages
+ */
+#define KMEM_CACHE_MIN_OBJECTS 8
+#define KMEM_CACHE_MAX_PAGES 16
+/*
+ * the number of completely free slabs a cache keeps before returning the
+ * pages to the physical page allocator.
+ */
+#define KMEM_CACHE_MAX_EMPTY_SLABS 1
+
+struct kmem_cache {
+    uint8_t name[KMEM_CACHE_NAME_LENGTH];
+    uint32_t object_size;
+    uint32_t object_stride;
+    uint32_t object_offset;
+    uint32_t nr_objects_per_slab;
+    uint32_t nr_pages_per_slab;
+    /*
+     * slabs which have at least one free object, full slabs are not linked
+     */
+    struct list_elem slabs_partial;
+    uint32_t nr_slabs;
+    uint32_t nr_empty_slabs;
+    uint32_t nr_active_objects;
+    struct list_elem list;
+};
+
+struct slab {
+    struct list_elem list;
+    struct kmem_cache * cache;
+    void * freelist;
+    uint32_t nr_inuse;
+    uint32_t magic;
+};
+
+struct kmem_cache *
+kmem_cache_create(const uint8_t * name, uint32_t object_size, uint32_t align);
+
+void *
+kmem_cache_alloc(struct kmem_cache * cache);
+
+void
+kmem_cache_free(struct kmem_cache * cache, void * object);
+
+int32_t
+kmem_cache_destroy(struct kmem_cache * cache);
+
+void
+dump_kmem_caches(void);
+
+void
+slab_init(void);
+
+#endif
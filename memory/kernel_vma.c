@@ -6,98 +6,157 @@
 #include <kernel/include/printk.h>
 #include <memory/include/physical_memory.h>
 #include <memory/include/paging.h>
-static struct kernel_vma _kernel_vma[KERNEL_VMA_ARRAY_LENGTH];
+#include <memory/include/malloc.h>
+#include <memory/include/buddy.h>
+
+static struct kernel_vma _bootstrap_kernel_vma[KERNEL_VMA_BOOTSTRAP_LENGTH];
+static int _nr_bootstrap_kernel_vma;
+static struct avl_tree kernel_vma_tree;
+
+#define KERNEL_VMA(_node) CONTAINER_OF((_node), struct kernel_vma, node)
+
+static int32_t
+kernel_vma_compare(struct avl_node * node0, struct avl_node * node1)
+{
+    struct kernel_vma * vma0 = KERNEL_VMA(node0);
+    struct kernel_vma * vma1 = KERNEL_VMA(node1);
+    if (vma0->virt_addr == vma1->virt_addr)
+        return 0;
+    return vma0->virt_addr < vma1->virt_addr ? -1 : 1;
+}
+
+static void
+kernel_vma_augment(struct avl_node * node)
+{
+    struct kernel_vma * vma = KERNEL_VMA(node);
+    struct kernel_vma * left;
+    struct kernel_vma * right;
+    vma->subtree_start = vma->virt_addr;
+    vma->subtree_end = vma->virt_addr + vma->length;
+    vma->subtree_max_gap = 0;
+    if (node->left) {
+        left = KERNEL_VMA(node->left);
+        vma->subtree_start = left->subtree_start;
+        vma->subtree_max_gap = MAX(left->subtree_max_gap,
+            vma->virt_addr - left->subtree_end);
+    }
+    if (node->right) {
+        right = KERNEL_VMA(node->right);
+        vma->subtree_end = right->subtree_end;
+        vma->subtree_max_gap = MAX(vma->subtree_max_gap,
+            MAX(right->subtree_max_gap,
+                right->subtree_start - (vma->virt_addr + vma->length)));
+    }
+}
+
+/*
+ * search the lowest gap no smaller than length between the VMAs of the
+ * subtree, only the subtrees with large enough gap are descended into.
+ */
+static uint32_t
+__search_free_gap(struct avl_node * node, uint32_t length)
+{
+    struct kernel_vma * vma;
+    struct kernel_vma * left;
+    struct kernel_vma * right;
+    uint32_t vma_end;
+    while (node) {
+        vma = KERNEL_VMA(node);
+        if (vma->subtree_max_gap < length)
+            return 0;
+        vma_end = vma->virt_addr + vma->length;
+        if (node->left) {
+            left = KERNEL_VMA(node->left);
+            if (left->subtree_max_gap >= length)
+                return __search_free_gap(node->left, length);
+            if ((vma->virt_addr - left->subtree_end) >= length)
+                return left->subtree_end;
+        }
+        ASSERT(node->right);
+        right = KERNEL_VMA(node->right);
+        if ((right->subtree_start - vma_end) >= length)
+            return vma_end;
+        node = node->right;
+    }
+    return 0;
+}
 
 uint32_t
 search_free_kernel_virtual_address(uint32_t length)
 {
-    int idx = 0;
-    int idx_tmp = 0;
-    struct kernel_vma * vma = NULL;
-    struct kernel_vma * vma_tmp = NULL;
-    struct kernel_vma * vma_nearest = NULL;
-    uint64_t vaddr_free_start = 0;
-    uint64_t vaddr_free_end = 0;
+    uint32_t vaddr_free_start;
+    struct kernel_vma * root;
     // Length must be page rounded
     length = length & PAGE_MASK ? (length & ~PAGE_MASK) + PAGE_SIZE : length;
-    for (idx = 0; idx < KERNEL_VMA_ARRAY_LENGTH; idx++) {
-        vma = &_kernel_vma[idx];
-        if (!vma->present)
-            continue;
-        vaddr_free_start = (uint64_t)(vma->virt_addr + vma->length);
-        {
-            // Try to find the vma's boundary by search the next vma
-            // but search the nearest vma first
-            vma_nearest = NULL;
-            for (idx_tmp = 0; idx_tmp < KERNEL_VMA_ARRAY_LENGTH; idx_tmp++) {
-                if (idx_tmp == idx)
-                    continue;
-                vma_tmp = &_kernel_vma[idx_tmp];
-                if (!vma_tmp->present)
-                    continue;
-                if (vma_tmp->virt_addr >= vaddr_free_start) {
-                    if (!vma_nearest ||
-                        vma_tmp->virt_addr <= vma_nearest->virt_addr)
-                        vma_nearest = vma_tmp;
-                }
-            }
-            vaddr_free_end = vma_nearest ?
-                vma_nearest->virt_addr :
-                USERSPACE_BOTTOM;
+    if (!kernel_vma_tree.root)
+        return 0;
+    vaddr_free_start = __search_free_gap(kernel_vma_tree.root, length);
+    if (vaddr_free_start)
+        return vaddr_free_start;
+    // The gap above all VMAs
+    root = KERNEL_VMA(kernel_vma_tree.root);
+    if ((KERNELSPACE_TOP - root->subtree_end) >= length)
+        return root->subtree_end;
+    return 0;
+}
+
+/*
+ * search the VMA with the highest start address below end, it's the only
+ * candidate to overlap [start, end).
+ */
+static struct kernel_vma *
+__search_kernel_vma_in_range(uint64_t start, uint64_t end)
+{
+    struct avl_node * node = kernel_vma_tree.root;
+    struct kernel_vma * _vma;
+    struct kernel_vma * _candidate = NULL;
+    while (node) {
+        _vma = KERNEL_VMA(node);
+        if (_vma->virt_addr < end) {
+            _candidate = _vma;
+            node = node->right;
+        } else {
+            node = node->left;
         }
-        ASSERT(vaddr_free_end);
-        if ((vaddr_free_end - vaddr_free_start) > length)
-            return vaddr_free_start;
     }
-    return 0;
+    if (_candidate &&
+        ((uint64_t)_candidate->virt_addr + _candidate->length) > start)
+        return _candidate;
+    return NULL;
 }
 
 struct kernel_vma *
 search_kernel_vma(uint32_t virt_addr)
 {
-    struct kernel_vma * vma = NULL;
-    struct kernel_vma * _vma = NULL;
-    int idx;
-    for (idx = 0; idx < KERNEL_VMA_ARRAY_LENGTH; idx++) {
-        _vma = &_kernel_vma[idx];
-        if (!_vma->present)
-            continue;
-        if ((virt_addr >= _vma->virt_addr) &&
-            (virt_addr < (_vma->virt_addr + _vma->length))) {
-            vma = _vma;
-            break;
-        }
-    }
-    return vma;
+    return __search_kernel_vma_in_range(virt_addr, (uint64_t)virt_addr + 1);
+}
+
+static struct kernel_vma *
+alloc_kernel_vma(void)
+{
+    if (_nr_bootstrap_kernel_vma < KERNEL_VMA_BOOTSTRAP_LENGTH)
+        return &_bootstrap_kernel_vma[_nr_bootstrap_kernel_vma++];
+    return malloc(sizeof(struct kernel_vma));
 }
 
 int
 register_kernel_vma(struct kernel_vma * vma)
 {
     int ret = OK;
-    int target_index = -1;
-    int idx = 0;
     struct kernel_vma * _vma;
-    for (idx = 0; idx < KERNEL_VMA_ARRAY_LENGTH; idx++) {
-        _vma = &_kernel_vma[idx];
-        if (!_kernel_vma[idx].present) {
-            target_index = (target_index == -1) ? idx : target_index; 
-            continue;
-        }
-        /*
-         * check whether the VMA to be added in the global overlaps with
-         * current VMA entries
-         */ 
-        if ((vma->virt_addr >= _vma->virt_addr) &&
-            (vma->virt_addr < (_vma->virt_addr + _vma->length)))
-            return -ERR_INVALID_ARG;
-    }
-
-    if (target_index == -1)
+    /*
+     * check whether the VMA to be added in the global overlaps with
+     * current VMA entries
+     */
+    if (!vma->length ||
+        __search_kernel_vma_in_range(vma->virt_addr,
+            (uint64_t)vma->virt_addr + vma->length))
+        return -ERR_INVALID_ARG;
+    _vma = alloc_kernel_vma();
+    if (!_vma)
         return -ERR_OUT_OF_RESOURCE;
-    _vma = &_kernel_vma[target_index];
+    memset(_vma, 0x0, sizeof(struct kernel_vma));
     strcpy_safe(_vma->name, vma->name, sizeof(_vma->name));
-    _vma->present = 1;
     _vma->exact = vma->exact;
     _vma->write_permission = vma->write_permission;
     _vma->page_writethrough = vma->page_writethrough;
@@ -105,16 +164,19 @@ register_kernel_vma(struct kernel_vma * vma)
     _vma->virt_addr = vma->virt_addr;
     _vma->phy_addr = vma->phy_addr;
     _vma->length = vma->length;
+    ASSERT(avl_tree_insert(&kernel_vma_tree, &_vma->node) == OK);
 
     if (_vma->premap) {
         uint32_t linear_address = _vma->virt_addr;
         uint32_t phy_address = 0;
         for (; linear_address < (_vma->virt_addr + _vma->length);
             linear_address += PAGE_SIZE) {
-            phy_address = _vma->exact ? 
+            phy_address = _vma->exact ?
                 linear_address - _vma->virt_addr + _vma->phy_addr :
                 get_page();
             ASSERT(phy_address);
+            if (!_vma->exact)
+                set_page_frame_flags(phy_address, PAGE_FRAME_KERNEL);
             kernel_map_page(linear_address,
                 phy_address,
                 _vma->write_permission,
@@ -156,18 +218,18 @@ kernel_map_vma(
     ASSERT(!register_kernel_vma(&vma));
     return virt_addr;
 }
-void dump_kernel_vma(void)
+
+static void
+__dump_kernel_vma(struct avl_node * node, int * pidx)
 {
-    int idx = 0;
     struct kernel_vma * _vma;
-    LOG_INFO("Dump kernel vma:\n");
-    for(idx = 0; idx < KERNEL_VMA_ARRAY_LENGTH; idx++) {
-        _vma = &_kernel_vma[idx];
-        if (!_vma->present)
-            continue;
+    if (!node)
+        return;
+    __dump_kernel_vma(node->left, pidx);
+    _vma = KERNEL_VMA(node);
     LOG_INFO("   vma entry %d: name:%s virt:0x%x phy:0x%x len:0x%x "
         "permission:0x%x %s\n",
-        idx,
+        (*pidx)++,
         _vma->name,
         _vma->virt_addr,
         _vma->phy_addr,
@@ -176,7 +238,14 @@ void dump_kernel_vma(void)
             _vma->page_writethrough << 1|
             _vma->page_cachedisable << 2,
         _vma->exact ? "(*use exact mapping)" : "");
-    }
+    __dump_kernel_vma(node->right, pidx);
+}
+
+void dump_kernel_vma(void)
+{
+    int idx = 0;
+    LOG_INFO("Dump kernel vma:\n");
+    __dump_kernel_vma(kernel_vma_tree.root, &idx);
 }
 
 void
@@ -184,8 +253,10 @@ kernel_vma_init(void)
 {
     struct kernel_vma _vma;
     uint32_t sys_mem_start = get_system_memory_start();
-    memset(_kernel_vma, 0x0, sizeof(_kernel_vma));
-    LOG_INFO("Set KERNEL_VMA_ARRAY_LENGTH = %d\n", KERNEL_VMA_ARRAY_LENGTH);
+    memset(_bootstrap_kernel_vma, 0x0, sizeof(_bootstrap_kernel_vma));
+    _nr_bootstrap_kernel_vma = 0;
+    avl_tree_init(&kernel_vma_tree, kernel_vma_compare, kernel_vma_augment);
+    memset(&_vma, 0x0, sizeof(_vma));
     /*
      * Setup initial layout linear VM area
      */
@@ -233,17 +304,27 @@ kernel_vma_init(void)
     _vma.premap = 0;
     ASSERT(register_kernel_vma(&_vma) == OK);
 
-#if 0
-    strcpy(_vma.name, (const uint8_t*)"KernelStack");
+    strcpy_safe(_vma.name, (const uint8_t*)"KernelSlab", sizeof(_vma.name));
+    _vma.exact = 0;
+    _vma.write_permission = PAGE_PERMISSION_READ_WRITE;
+    _vma.page_writethrough = PAGE_WRITEBACK;
+    _vma.page_cachedisable = PAGE_CACHE_ENABLED;
+    _vma.virt_addr = SLAB_SPACE_BOTTOM;
+    _vma.phy_addr = 0;
+    _vma.length = SLAB_SPACE_TOP - SLAB_SPACE_BOTTOM;
+    _vma.premap = 0;
+    ASSERT(register_kernel_vma(&_vma) == OK);
+
+    strcpy_safe(_vma.name, (const uint8_t*)"KernelScratch", sizeof(_vma.name));
     _vma.exact = 0;
     _vma.write_permission = PAGE_PERMISSION_READ_WRITE;
     _vma.page_writethrough = PAGE_WRITEBACK;
     _vma.page_cachedisable = PAGE_CACHE_ENABLED;
-    _vma.virt_addr = KERNEL_STACK_BOTTOM;
+    _vma.virt_addr = KERNEL_SCRATCH_BOTTOM;
     _vma.phy_addr = 0;
-    _vma.length = KERNEL_STACK_TOP - KERNEL_STACK_BOTTOM;
+    _vma.length = KERNEL_SCRATCH_TOP - KERNEL_SCRATCH_BOTTOM;
+    _vma.premap = 0;
     ASSERT(register_kernel_vma(&_vma) == OK);
-#endif
     dump_kernel_vma();
 }
 
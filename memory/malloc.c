@@ -6,8 +6,33 @@
 #include <lib/include/string.h>
 #include <kernel/include/printk.h>
 #include <memory/include/paging.h>
+#include <memory/include/buddy.h>
+#include <lib/include/bitmap.h>
+#include <memory/include/shrinker.h>
 
-static struct malloc_header _recycle_bins[RECYCLE_BIN_SIZE];
+/*
+ * the first level bitmap indicates which first level index has non-empty
+ * second level lists, and the second level bitmaps indicate which lists are
+ * non-empty.
+ */
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[TLSF_FL_INDEX_COUNT];
+static uint32_t _free_blocks[TLSF_FL_INDEX_COUNT][TLSF_SL_INDEX_COUNT];
+static uint32_t nr_free_chunks;
+static uint32_t free_bytes;
+/*
+ * the quick lists cache recently freed small chunks per size class, the
+ * cached chunks stay allocated from the view of the TLSF lists.
+ */
+static struct malloc_quick_list _quick_lists[MALLOC_QUICK_LIST_COUNT];
+static uint32_t quick_list_high_water = MALLOC_QUICK_LIST_HIGH_WATER;
+static uint32_t nr_reclaimed_pages;
+/*
+ * non-zero while the free lists are being updated, the interior pages of a
+ * chunk being carved may fault in the mean time, and the page allocator must
+ * not call back into the heap shrinker then.
+ */
+static uint32_t heap_busy;
 
 void __free(struct malloc_header * hdr);
 
@@ -29,6 +54,169 @@ void __free(struct malloc_header * hdr);
     _hdr1; \
 })
 
+#define BLOCK_FOOTER(hdr) ((struct malloc_footer *)((uint32_t)(hdr) + \
+    (hdr)->size - sizeof(struct malloc_footer)))
+
+/*
+ * locate the previous chunk through the boundary tag right before hdr,
+ * return NULL for the first chunk of the heap or if the previous chunk is in
+ * use, in which case its header is not touched.
+ */
+#define PREV_FREE_BLOCK(hdr) ({\
+    struct malloc_header * _hdr = (hdr); \
+    struct malloc_header * _hdr1 = NULL; \
+    struct malloc_footer * _footer = NULL; \
+    if ((uint32_t)_hdr > KERNEL_HEAP_BOTTOM) { \
+        _footer = ((struct malloc_footer *)_hdr) - 1; \
+        ASSERT(_footer->magic == MALLOC_MAGIC); \
+        if (_footer->free) \
+            _hdr1 = (struct malloc_header *)((uint32_t)_hdr - _footer->size); \
+    } \
+    _hdr1; \
+})
+
+#define ROUND_UP(size, align) (((size) + (align) - 1) & ~((align) - 1))
+
+/*
+ * map a chunk size to the list where the chunk is inserted
+ */
+static inline void
+mapping_insert(uint32_t size, int32_t * fl, int32_t * sl)
+{
+    int32_t msb;
+    if (size < TLSF_SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = size / TLSF_SMALL_BLOCK_STEP;
+    } else {
+        msb = bit_fls(size);
+        *sl = (size >> (msb - TLSF_SL_INDEX_LOG2)) ^ TLSF_SL_INDEX_COUNT;
+        *fl = msb - TLSF_FL_INDEX_SHIFT + 1;
+    }
+}
+
+/*
+ * map a request size to the first list whose chunks are all large enough
+ */
+static inline void
+mapping_search(uint32_t size, int32_t * fl, int32_t * sl)
+{
+    if (size < TLSF_SMALL_BLOCK_SIZE)
+        size = ROUND_UP(size, TLSF_SMALL_BLOCK_STEP);
+    else
+        size += (1 << (bit_fls(size) - TLSF_SL_INDEX_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+static struct malloc_header *
+search_suitable_block(int32_t fl, int32_t sl)
+{
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    uint32_t fl_map = 0;
+    if (!sl_map) {
+        fl_map = fl_bitmap & (~0U << (fl + 1));
+        if (!fl_map)
+            return NULL;
+        fl = bit_ffs(fl_map);
+        sl_map = sl_bitmap[fl];
+        ASSERT(sl_map);
+    }
+    sl = bit_ffs(sl_map);
+    return (struct malloc_header *)_free_blocks[fl][sl];
+}
+
+static inline void
+set_block_footer(struct malloc_header * hdr)
+{
+    struct malloc_footer * footer = BLOCK_FOOTER(hdr);
+    footer->size = hdr->size;
+    footer->reserved = 0;
+    footer->free = hdr->free;
+    footer->magic = MALLOC_MAGIC;
+}
+
+static void
+insert_free_block(struct malloc_header * hdr)
+{
+    int32_t fl;
+    int32_t sl;
+    struct malloc_header * head;
+    mapping_insert(hdr->size, &fl, &sl);
+    head = (struct malloc_header *)_free_blocks[fl][sl];
+    hdr->prev = 0;
+    hdr->next = (uint32_t)head;
+    if (head)
+        head->prev = (uint32_t)hdr;
+    _free_blocks[fl][sl] = (uint32_t)hdr;
+    fl_bitmap |= 1 << fl;
+    sl_bitmap[fl] |= 1 << sl;
+    nr_free_chunks++;
+    free_bytes += hdr->size;
+}
+
+static void
+remove_free_block(struct malloc_header * hdr)
+{
+    int32_t fl;
+    int32_t sl;
+    struct malloc_header * prev = (struct malloc_header *)hdr->prev;
+    struct malloc_header * next = (struct malloc_header *)hdr->next;
+    ASSERT(hdr->free);
+    ASSERT(hdr->magic == MALLOC_MAGIC);
+    mapping_insert(hdr->size, &fl, &sl);
+    if (prev) {
+        prev->next = hdr->next;
+    } else {
+        ASSERT(_free_blocks[fl][sl] == (uint32_t)hdr);
+        _free_blocks[fl][sl] = hdr->next;
+    }
+    if (next)
+        next->prev = hdr->prev;
+    if (!_free_blocks[fl][sl]) {
+        sl_bitmap[fl] &= ~(1 << sl);
+        if (!sl_bitmap[fl])
+            fl_bitmap &= ~(1 << fl);
+    }
+    hdr->prev = 0;
+    hdr->next = 0;
+    nr_free_chunks--;
+    free_bytes -= hdr->size;
+}
+
+/*
+ * map the pages of [start, start + length) which are not present yet, the
+ * heap metadata may be written into the unmapped interior pages of a large
+ * free chunk, and the heap must not fault in the middle of an update which
+ * can not wait for memory. return 0 if no frame is available.
+ */
+static int32_t
+heap_range_mapped(uint32_t start, uint32_t length)
+{
+    uint32_t * kernel_page_drectory = (uint32_t *)get_kernel_page_directory();
+    uint32_t virt_addr;
+    uint32_t phy_addr;
+    for (virt_addr = PAGE_ALIGN(start); virt_addr < (start + length);
+        virt_addr += PAGE_SIZE) {
+        if (page_present(kernel_page_drectory, virt_addr) == OK)
+            continue;
+        phy_addr = get_page();
+        if (!phy_addr)
+            return 0;
+        set_page_frame_flags(phy_addr, PAGE_FRAME_KERNEL);
+        kernel_map_page(virt_addr,
+            phy_addr,
+            PAGE_PERMISSION_READ_WRITE,
+            PAGE_WRITEBACK,
+            PAGE_CACHE_ENABLED);
+    }
+    return 1;
+}
+
+/*
+ * carve the user chunk from the head of a free chunk which is already
+ * detached from the free lists, and put the left tail back.
+ * return NULL if the pages of the metadata can not be mapped, the chunk is
+ * left untouched then.
+ */
 void *
 __malloc(struct malloc_header * hdr, int len, int align)
 {
@@ -36,26 +224,14 @@ __malloc(struct malloc_header * hdr, int len, int align)
     uint32_t mask = align -1;
     uint32_t usr_ptr = 0;
     uint32_t padding = 0;
-    uint32_t left = 0;
-    struct malloc_header * prev;
-    struct malloc_header * next;
+    uint32_t used = 0;
     struct malloc_header * hdr1 = NULL;
     struct padding_header * padding_hdr = NULL;
     ASSERT(hdr->free);
     ASSERT(hdr->magic == MALLOC_MAGIC);
     VALIDATE_ALIGNMENT(align);
     /*
-     * 1st step: ensure the memory chunk is big enough to contain
-     * the required user length plus metadata.
-     */
-    if((len +
-        sizeof(struct malloc_header) +
-        sizeof(struct padding_header)) > 
-        hdr->size)
-        return NULL;
-    
-    /*
-     * 2nd step: determine the extra space for alignment
+     * 1st step: determine the extra space for alignment
      */
     usr_ptr = ((uint32_t)hdr) +
         sizeof(struct malloc_header) +
@@ -66,45 +242,41 @@ __malloc(struct malloc_header * hdr, int len, int align)
     usr_ptr += padding;
     ASSERT(!(usr_ptr & mask));
     /*
-     * 2.5th step, re-check the length to prevent overflow
+     * 2nd step: the chunk must be big enough to contain the required
+     * user length plus metadata, it's guaranteed by the list search.
      */
-    if((len +
+    used = ROUND_UP(len +
         sizeof(struct malloc_header) +
         sizeof(struct padding_header) +
-        padding) >
-        hdr->size)
+        sizeof(struct malloc_footer) +
+        padding, MALLOC_BLOCK_ALIGN);
+    used = MAX(used, MALLOC_MIN_BLOCK_SIZE);
+    ASSERT(used <= hdr->size);
+    if (!heap_range_mapped(usr_ptr - sizeof(struct padding_header),
+            sizeof(struct padding_header)) ||
+        !heap_range_mapped((uint32_t)hdr + used - sizeof(struct malloc_footer),
+            sizeof(struct malloc_footer)) ||
+        ((hdr->size - used) >= MALLOC_MIN_BLOCK_SIZE &&
+        !heap_range_mapped((uint32_t)hdr + used,
+            sizeof(struct malloc_header))))
         return NULL;
     /*
-     * 3rd step: calculate the left bytes 
-     * and decide whether to split into halves. 
-     */
-    left = hdr->size -
-        sizeof(struct malloc_header) -
-        sizeof(struct padding_header) -
-        padding -
-        len;
-    /*
-     * 4th step: detach the malloc_header from the bin list
+     * 3rd step: split the chunk if the left bytes make a chunk.
      */
-    next = (struct malloc_header *)hdr->next;
-    prev = (struct malloc_header *)hdr->prev;
-    ASSERT(prev);
-    prev->next = hdr->next;
-    if(next)
-        next->prev = hdr->prev;
-
-    if(left > (sizeof(struct malloc_header) + sizeof(struct padding_header))) {
-        hdr1 = (struct malloc_header*)(((uint32_t)hdr) + hdr->size - left);
+    if((hdr->size - used) >= MALLOC_MIN_BLOCK_SIZE) {
+        hdr1 = (struct malloc_header*)(((uint32_t)hdr) + used);
         hdr1->magic = MALLOC_MAGIC;
         hdr1->free = 1;
         hdr1->padding = 0;
-        hdr1->size = left;
+        hdr1->size = hdr->size - used;
         hdr1->prev = 0;
         hdr1->next = 0;
-        hdr->size -=left;
+        set_block_footer(hdr1);
+        hdr->size = used;
+        insert_free_block(hdr1);
     }
     /*
-     * 5th step: prepare allodated memory chunk.
+     * 4th step: prepare allocated memory chunk.
      */
     hdr->prev = 0;
     hdr->next = 0;
@@ -115,80 +287,290 @@ __malloc(struct malloc_header * hdr, int len, int align)
     padding_hdr->padding = padding;
     padding_hdr->free = 0;
     padding_hdr->magic = MALLOC_MAGIC;
+    set_block_footer(hdr);
+    return (void *)usr_ptr;
+}
+
+static void *
+tlsf_malloc(int len, int align)
+{
+    int32_t fl;
+    int32_t sl;
+    uint32_t size;
+    struct malloc_header * hdr;
+    void * user_ptr;
     /*
-     *6th step: free the splited bottom half
+     * reserve the worst case padding so that any chunk of the found list
+     * can satisfy the alignment.
      */
-    __free(hdr1);
-    return (void *)usr_ptr;
+    size = ROUND_UP(len +
+        sizeof(struct malloc_header) +
+        sizeof(struct padding_header) +
+        sizeof(struct malloc_footer) +
+        align - 1, MALLOC_BLOCK_ALIGN);
+    size = MAX(size, MALLOC_MIN_BLOCK_SIZE);
+    mapping_search(size, &fl, &sl);
+    hdr = search_suitable_block(fl, sl);
+    if (!hdr)
+        return NULL;
+    ASSERT(hdr->size >= size);
+    remove_free_block(hdr);
+    user_ptr = __malloc(hdr, len, align);
+    if (!user_ptr)
+        insert_free_block(hdr);
+    return user_ptr;
+}
+
+/*
+ * serve a small allocation from the quick list of its size class,
+ * return NULL if the list is empty or its head is not well aligned.
+ */
+static void *
+quick_list_malloc(int len, int align)
+{
+    struct malloc_quick_list * quick_list;
+    struct padding_header * padding_hdr;
+    uint32_t user_ptr;
+    if (len > MALLOC_QUICK_MAX_SIZE || align > MALLOC_QUICK_MAX_ALIGN)
+        return NULL;
+    quick_list = &_quick_lists[QUICK_LIST_INDEX(len)];
+    user_ptr = quick_list->head;
+    if (!user_ptr || (user_ptr & (align - 1))) {
+        quick_list->nr_misses++;
+        return NULL;
+    }
+    padding_hdr = ((struct padding_header *)user_ptr) - 1;
+    ASSERT(padding_hdr->magic == MALLOC_MAGIC);
+    ASSERT(padding_hdr->free);
+    padding_hdr->free = 0;
+    quick_list->head = *(uint32_t *)user_ptr;
+    quick_list->nr_chunks--;
+    quick_list->nr_hits++;
+    return (void *)user_ptr;
+}
+
+/*
+ * cache a chunk in the quick list which matches its capacity,
+ * return 0 if the chunk is not small or the list is full.
+ */
+static int32_t
+quick_list_free(struct malloc_header * hdr, struct padding_header * padding_hdr)
+{
+    int32_t capacity;
+    struct malloc_quick_list * quick_list;
+    capacity = hdr->size -
+        sizeof(struct malloc_header) -
+        hdr->padding -
+        sizeof(struct padding_header) -
+        sizeof(struct malloc_footer);
+    if (capacity < MALLOC_QUICK_STEP ||
+        capacity >= MALLOC_QUICK_MAX_SIZE + MALLOC_QUICK_STEP)
+        return 0;
+    // a chunk is put in the class of the largest size it can serve
+    quick_list = &_quick_lists[capacity / MALLOC_QUICK_STEP - 1];
+    if (quick_list->nr_chunks >= quick_list_high_water)
+        return 0;
+    padding_hdr->free = 1;
+    *(uint32_t *)(padding_hdr + 1) = quick_list->head;
+    quick_list->head = (uint32_t)(padding_hdr + 1);
+    quick_list->nr_chunks++;
+    return 1;
+}
+
+static uint32_t
+__flush_quick_list(struct malloc_quick_list * quick_list, uint32_t nr_left)
+{
+    uint32_t nr_flushed = 0;
+    uint32_t user_ptr;
+    struct padding_header * padding_hdr;
+    while (quick_list->nr_chunks > nr_left) {
+        user_ptr = quick_list->head;
+        ASSERT(user_ptr);
+        quick_list->head = *(uint32_t *)user_ptr;
+        quick_list->nr_chunks--;
+        padding_hdr = ((struct padding_header *)user_ptr) - 1;
+        ASSERT(padding_hdr->magic == MALLOC_MAGIC);
+        ASSERT(padding_hdr->free);
+        padding_hdr->free = 0;
+        __free((struct malloc_header *)((uint32_t)padding_hdr -
+            padding_hdr->padding - sizeof(struct malloc_header)));
+        nr_flushed++;
+    }
+    return nr_flushed;
+}
+
+/*
+ * return all the cached small chunks to the TLSF lists so they can be
+ * coalesced, it returns the number of flushed chunks.
+ */
+static uint32_t
+__malloc_flush_quick_lists(void)
+{
+    int idx;
+    uint32_t nr_flushed = 0;
+    for (idx = 0; idx < MALLOC_QUICK_LIST_COUNT; idx++)
+        nr_flushed += __flush_quick_list(&_quick_lists[idx], 0);
+    return nr_flushed;
+}
+
+uint32_t
+malloc_flush_quick_lists(void)
+{
+    uint32_t nr_flushed;
+    heap_busy++;
+    nr_flushed = __malloc_flush_quick_lists();
+    heap_busy--;
+    return nr_flushed;
+}
+
+/*
+ * tune the maximum number of chunks per quick list, 0 disables the quick
+ * lists. the lists beyond the new mark are trimmed immediately.
+ */
+void
+malloc_set_quick_list_high_water(uint32_t high_water)
+{
+    int idx;
+    heap_busy++;
+    quick_list_high_water = high_water;
+    for (idx = 0; idx < MALLOC_QUICK_LIST_COUNT; idx++)
+        __flush_quick_list(&_quick_lists[idx], high_water);
+    heap_busy--;
 }
 
 void *
 malloc_align(int len, int align)
 {
-    uint32_t free_chunk_addr;
     void * user_ptr = NULL;
-    int bin_idx = LENGTH_TO_RECYCLE_BIN_INDEX(len);
-    for (; bin_idx < RECYCLE_BIN_SIZE; bin_idx++) {
-        for (free_chunk_addr = _recycle_bins[bin_idx].next;
-            free_chunk_addr;
-            free_chunk_addr = ((struct malloc_header *)free_chunk_addr)->next) {
-            user_ptr = __malloc((struct malloc_header *)free_chunk_addr,
-                len,
-                align);
-            if (user_ptr) {
-                LOG_TRIVIA("memory allocation: [size:%d align:%d] as 0x%x\n",
-                    len, align, user_ptr);
-                return user_ptr;
+    VALIDATE_ALIGNMENT(align);
+    if (len < 0)
+        goto out;
+    heap_busy++;
+    user_ptr = quick_list_malloc(len, align);
+    if (user_ptr)
+        goto unbusy;
+    // round a small chunk up to its size class so it's cached in the same
+    // class once it's freed.
+    if (len <= MALLOC_QUICK_MAX_SIZE && align <= MALLOC_QUICK_MAX_ALIGN)
+        len = (QUICK_LIST_INDEX(len) + 1) * MALLOC_QUICK_STEP;
+    user_ptr = tlsf_malloc(len, align);
+    // under memory pressure, give the cached chunks back and retry
+    if (!user_ptr && __malloc_flush_quick_lists())
+        user_ptr = tlsf_malloc(len, align);
+    unbusy:
+    heap_busy--;
+    out:
+    LOG_TRIVIA("memory allocation: [size:%d align:%d] as 0x%x\n",
+        len, align, user_ptr);
+    return user_ptr;
+}
+
+/*
+ * unmap the whole pages within [start, end) of a free chunk and give their
+ * frames back, they are faulted in again once the chunk is reused.
+ */
+static void
+reclaim_free_pages(uint32_t start, uint32_t end)
+{
+    uint32_t virt_addr;
+    uint32_t phy_addr;
+    start = ROUND_UP(start, PAGE_SIZE);
+    end = PAGE_ALIGN(end);
+    for (virt_addr = start; virt_addr < end; virt_addr += PAGE_SIZE) {
+        phy_addr = kernel_unmap_page(virt_addr);
+        if (phy_addr) {
+            free_page(phy_addr);
+            nr_reclaimed_pages++;
+        }
+    }
+}
+
+/*
+ * the heap shrinker: flush the quick lists, then unmap the whole pages inside
+ * the free chunks below MALLOC_RECLAIM_THRESHOLD, the larger ones are unmapped
+ * already. the freed task stacks end up here once they are coalesced.
+ */
+static uint32_t
+malloc_shrink(uint32_t nr_frames)
+{
+    int32_t fl;
+    int32_t sl;
+    uint32_t nr_reclaimed = nr_reclaimed_pages;
+    struct malloc_header * hdr;
+    // called back from a page fault inside the heap itself
+    if (heap_busy)
+        return 0;
+    heap_busy++;
+    __malloc_flush_quick_lists();
+    for (fl = 0; fl < TLSF_FL_INDEX_COUNT; fl++) {
+        for (sl = 0; sl < TLSF_SL_INDEX_COUNT; sl++) {
+            hdr = (struct malloc_header *)_free_blocks[fl][sl];
+            for (; hdr; hdr = (struct malloc_header *)hdr->next) {
+                if (hdr->size >= MALLOC_RECLAIM_THRESHOLD)
+                    continue;
+                reclaim_free_pages((uint32_t)hdr + sizeof(struct malloc_header),
+                    (uint32_t)BLOCK_FOOTER(hdr));
             }
+            if ((nr_reclaimed_pages - nr_reclaimed) >= nr_frames)
+                goto out;
         }
     }
-    LOG_TRIVIA("memory allocation: [size:%d align:%d] as 0x%x\n",
-        len, align, NULL);
-    return NULL;
+    out:
+    heap_busy--;
+    return nr_reclaimed_pages - nr_reclaimed;
 }
 
+static struct shrinker malloc_shrinker = {
+    .name = "kernel-heap",
+    .shrink = malloc_shrink,
+};
+
+/*
+ * put a chunk back to the free lists, coalescing it with its free physical
+ * neighbours.
+ * the interior pages of a free chunk which is no less than
+ * MALLOC_RECLAIM_THRESHOLD are always unmapped, so only the parts which were
+ * not large free chunks before the coalescing are to be reclaimed.
+ */
 void
 __free(struct malloc_header * hdr)
 {
-    int32_t bin_index = 0;
-    int32_t avail_size = 0;
     struct malloc_header * next_hdr = NEXT_BLOCK(hdr);
-    struct malloc_header * _ptr = NULL;
-    ASSERT(hdr->size >= sizeof(struct malloc_header));
+    struct malloc_header * prev_hdr = PREV_FREE_BLOCK(hdr);
+    struct malloc_footer * footer = BLOCK_FOOTER(hdr);
+    uint32_t reclaim_start = (uint32_t)hdr;
+    uint32_t reclaim_end = (uint32_t)hdr + hdr->size;
+    ASSERT(hdr->magic == MALLOC_MAGIC);
+    ASSERT(hdr->size >= MALLOC_MIN_BLOCK_SIZE);
+    // the footer is overwritten if the user ever writes beyond the chunk
+    ASSERT(footer->magic == MALLOC_MAGIC);
+    ASSERT(footer->size == hdr->size);
+    hdr->free = 1;
+    hdr->padding = 0;
     if (next_hdr && next_hdr->free) {
         ASSERT(next_hdr->magic == MALLOC_MAGIC);
-        struct malloc_header * _prev = (struct malloc_header *)next_hdr->prev;
-        struct malloc_header * _next = (struct malloc_header *)next_hdr->next;
-        ASSERT(_prev);
-        _prev->next = next_hdr->next;
-        if(_next)
-            _next->prev = next_hdr->prev;
+        remove_free_block(next_hdr);
         hdr->size += next_hdr->size;
+        reclaim_end = next_hdr->size < MALLOC_RECLAIM_THRESHOLD ?
+            (uint32_t)next_hdr + next_hdr->size :
+            (uint32_t)next_hdr + sizeof(struct malloc_header);
     }
-    avail_size = hdr->size -
-        sizeof(struct malloc_header) -
-        sizeof(struct padding_header);
-    bin_index = LENGTH_TO_RECYCLE_BIN_INDEX(avail_size);
-    for(_ptr = (struct malloc_header *)_recycle_bins[bin_index].next;
-        _ptr;
-        _ptr = (struct malloc_header *)_ptr->next) {
-        if(_ptr->size >= hdr->size)
-            break;
-    }
-    hdr->free = 1;
-    hdr->padding = 0;
-    if (_ptr) {
-        hdr->prev = _ptr->prev;
-        hdr->next = (uint32_t)_ptr;
-        _ptr->prev = (uint32_t)hdr;
-        ((struct malloc_header *)(hdr->prev))->next = (uint32_t)hdr;
-    } else {
-        _ptr = (struct malloc_header *)&_recycle_bins[bin_index];
-        for(; _ptr->next; _ptr = (struct malloc_header *)_ptr->next);
-        hdr->prev = (uint32_t)_ptr;
-        hdr->next = (uint32_t)NULL;
-        _ptr->next = (uint32_t)hdr;
+    if (prev_hdr) {
+        ASSERT(prev_hdr->magic == MALLOC_MAGIC);
+        ASSERT(prev_hdr->free);
+        remove_free_block(prev_hdr);
+        reclaim_start = prev_hdr->size < MALLOC_RECLAIM_THRESHOLD ?
+            (uint32_t)prev_hdr :
+            (uint32_t)hdr - sizeof(struct malloc_footer);
+        prev_hdr->size += hdr->size;
+        hdr = prev_hdr;
     }
+    set_block_footer(hdr);
+    insert_free_block(hdr);
+    if (hdr->size >= MALLOC_RECLAIM_THRESHOLD)
+        reclaim_free_pages(
+            MAX(reclaim_start, (uint32_t)hdr + sizeof(struct malloc_header)),
+            MIN(reclaim_end, (uint32_t)BLOCK_FOOTER(hdr)));
 }
 void
 free(void * mem)
@@ -200,9 +582,13 @@ free(void * mem)
     malloc_hdr = (struct malloc_header *)(((uint32_t)padding_hdr) -
         padding_hdr->padding - sizeof(struct malloc_header));
     LOG_TRIVIA("memory free: 0x%x is_free:%d\n", mem, malloc_hdr->free);
-    if (malloc_hdr->free)
+    // a chunk in quick list is marked free in its padding header only
+    if (malloc_hdr->free || padding_hdr->free)
         return;
-    __free(malloc_hdr);
+    heap_busy++;
+    if (!quick_list_free(malloc_hdr, padding_hdr))
+        __free(malloc_hdr);
+    heap_busy--;
 }
 
 void *
@@ -211,21 +597,63 @@ malloc(int len)
     return malloc_align(len, 1);
 }
 
+/*
+ * back the 4MB aligned range at virt_addr with a 4MB block of frames in one
+ * PDE, return OK if it's mapped.
+ */
+static int32_t
+map_large_heap_page(uint32_t virt_addr)
+{
+    uint32_t phy_addr;
+    uint32_t frame;
+    if (!kernel_large_page_mappable(virt_addr))
+        return -ERR_EXIST;
+    phy_addr = get_pages(PAGES_PER_LARGE_PAGE);
+    if (!phy_addr)
+        return -ERR_OUT_OF_MEMORY;
+    for (frame = phy_addr; frame < (phy_addr + LARGE_PAGE_SIZE);
+        frame += PAGE_SIZE)
+        set_page_frame_flags(frame, PAGE_FRAME_KERNEL);
+    ASSERT(kernel_map_large_page(virt_addr,
+        phy_addr,
+        PAGE_PERMISSION_READ_WRITE,
+        PAGE_WRITEBACK,
+        PAGE_CACHE_ENABLED) == OK);
+    return OK;
+}
+
+/*
+ * allocate a chunk whose pages are all mapped, the 4MB aligned parts of it
+ * are mapped with 4MB pages if their page directory entries are unused.
+ * NULL is returned if the heap or the page frames run out.
+ */
 void *
 malloc_align_mapped(int len, int align)
 {
     uint32_t * kernel_page_drectory = (uint32_t *)get_kernel_page_directory();
     uint32_t addr = (uint32_t)malloc_align(len, align);
     uint32_t virt_addr = 0;
+    uint32_t phy_addr = 0;
     if (addr) {
-        for (virt_addr = addr;
+        for (virt_addr = PAGE_ALIGN(addr);
             virt_addr < (addr + (uint32_t)len);
             virt_addr += PAGE_SIZE) {
+            if ((addr + (uint32_t)len - virt_addr) >= LARGE_PAGE_SIZE &&
+                map_large_heap_page(virt_addr) == OK) {
+                virt_addr += LARGE_PAGE_SIZE - PAGE_SIZE;
+                continue;
+            }
             if (page_present(kernel_page_drectory, virt_addr) != OK) {
+                phy_addr = get_page();
+                if (!phy_addr) {
+                    // the pages mapped so far go with the chunk
+                    LOG_DEBUG("can not back chunk:0x%x with pages\n", addr);
+                    free((void *)addr);
+                    return NULL;
+                }
+                set_page_frame_flags(phy_addr, PAGE_FRAME_KERNEL);
                 kernel_map_page(virt_addr,
-                    ({uint32_t __addr = get_page();
-                        ASSERT(__addr);
-                        __addr;}),
+                    phy_addr,
                     PAGE_PERMISSION_READ_WRITE,
                     PAGE_WRITEBACK,
                     PAGE_CACHE_ENABLED);
@@ -240,30 +668,79 @@ malloc_mapped(int len)
 {
     return malloc_align_mapped(len, 1);
 }
+/*
+ * take a snapshot of the heap usage, only the list which holds the largest
+ * chunks is walked.
+ */
 void
-dump_recycle_bins(void)
+get_malloc_stat(struct malloc_stat * stat)
 {
-    int idx = 0;
-    struct malloc_header *hdr;
-    char * hint[13] = {
-        "bin-16", "bin-32", "bin-64", "bin-128",
-        "bin-256", "bin-512", "bin-1024", "bin-2048",
-        "bin-4096", "bin-8192", "bin-16384", "bin-32768",
-        "bin-misc"
-    };
-    LOG_INFO("Dump malloc recycle bins:\n");
-    for(; idx < RECYCLE_BIN_SIZE; idx++) {
-        if(!_recycle_bins[idx].next)
-            continue;
-        for(hdr = (struct malloc_header *)_recycle_bins[idx].next;
+    int32_t fl;
+    int32_t sl;
+    struct malloc_header * hdr;
+    memset(stat, 0x0, sizeof(struct malloc_stat));
+    stat->nr_free_chunks = nr_free_chunks;
+    stat->free_bytes = free_bytes;
+    stat->nr_reclaimed_pages = nr_reclaimed_pages;
+    if (fl_bitmap) {
+        fl = bit_fls(fl_bitmap);
+        sl = bit_fls(sl_bitmap[fl]);
+        for (hdr = (struct malloc_header *)_free_blocks[fl][sl];
             hdr;
-            hdr = (struct malloc_header *)hdr->next) {
-            LOG_INFO("%s: addr:0x%x size:%d\n",
-                hint[idx],
-                (uint32_t)hdr,
+            hdr = (struct malloc_header *)hdr->next)
+            stat->largest_free_chunk = MAX(stat->largest_free_chunk,
                 hdr->size);
+    }
+    if (stat->free_bytes >= 1000)
+        stat->fragmentation =
+            (stat->free_bytes - stat->largest_free_chunk) /
+            (stat->free_bytes / 1000);
+}
+
+void
+dump_malloc_stat(void)
+{
+    int32_t fl;
+    int32_t sl;
+    int32_t nr_chunks;
+    struct malloc_header * hdr;
+    struct malloc_quick_list * quick_list;
+    struct malloc_stat stat;
+    get_malloc_stat(&stat);
+    LOG_INFO("Dump kernel heap:\n");
+    LOG_INFO("   free chunks:%d free bytes:%d largest free chunk:%d "
+        "fragmentation:%d/1000 reclaimed pages:%d\n",
+        stat.nr_free_chunks,
+        stat.free_bytes,
+        stat.largest_free_chunk,
+        stat.fragmentation,
+        stat.nr_reclaimed_pages);
+    for (fl = 0; fl < TLSF_FL_INDEX_COUNT; fl++) {
+        if (!(fl_bitmap & (1 << fl)))
+            continue;
+        for (sl = 0; sl < TLSF_SL_INDEX_COUNT; sl++) {
+            nr_chunks = 0;
+            for(hdr = (struct malloc_header *)_free_blocks[fl][sl];
+                hdr;
+                hdr = (struct malloc_header *)hdr->next)
+                nr_chunks++;
+            if (nr_chunks)
+                LOG_INFO("   list-%d.%d: %d chunks\n", fl, sl, nr_chunks);
         }
     }
+    LOG_INFO("   quick lists(high water:%d):\n", quick_list_high_water);
+    for (fl = 0; fl < MALLOC_QUICK_LIST_COUNT; fl++) {
+        quick_list = &_quick_lists[fl];
+        if (!quick_list->nr_hits && !quick_list->nr_misses)
+            continue;
+        LOG_INFO("   quick-%d: %d chunks hits:%d misses:%d "
+            "hit rate:%d/1000\n",
+            (fl + 1) * MALLOC_QUICK_STEP,
+            quick_list->nr_chunks,
+            quick_list->nr_hits,
+            quick_list->nr_misses,
+            QUICK_LIST_HIT_RATE(quick_list));
+    }
 }
 /*
  * Allocate a memory segment from caller's stack.
@@ -310,8 +787,11 @@ static void
 malloc_test(void)
 {
     void * ptr = NULL;
+    void * ptr1 = NULL;
+    void * ptr2 = NULL;
     struct padding_header * padding;
     struct malloc_header * hdr;
+    struct malloc_header * hdr1;
     ptr = malloc_align(1, 1024);
     ASSERT(!(1023 & (uint32_t)ptr));
     padding = ((struct padding_header *)ptr) - 1;
@@ -326,16 +806,66 @@ malloc_test(void)
     ASSERT(hdr->padding == padding->padding);
     free(ptr);
     ASSERT(hdr->free);
-    dump_recycle_bins();
+    /*
+     * free the middle chunk last, it must be merged with both neighbours.
+     */
+    ptr = malloc(100);
+    ptr1 = malloc(200);
+    ptr2 = malloc(300);
+    ASSERT(ptr && ptr1 && ptr2);
+    hdr = (struct malloc_header *)(((uint32_t)ptr) -
+        sizeof(struct padding_header) - sizeof(struct malloc_header));
+    hdr1 = (struct malloc_header *)(((uint32_t)ptr2) -
+        sizeof(struct padding_header) - sizeof(struct malloc_header));
+    free(ptr);
+    free(ptr2);
+    malloc_flush_quick_lists();
+    ASSERT(hdr->free && hdr1->free);
+    free(ptr1);
+    malloc_flush_quick_lists();
+    ASSERT(hdr->free);
+    ASSERT(!NEXT_BLOCK(hdr) || !NEXT_BLOCK(hdr)->free);
+    ASSERT(!PREV_FREE_BLOCK(hdr));
+    ASSERT(BLOCK_FOOTER(hdr)->size == hdr->size);
+    ASSERT(BLOCK_FOOTER(hdr)->free);
+    /*
+     * a freed small chunk is served again from its quick list
+     */
+    ptr = malloc(40);
+    ASSERT(ptr);
+    free(ptr);
+    ptr1 = malloc(33);
+    ASSERT(ptr1 == ptr);
+    free(ptr1);
+    malloc_flush_quick_lists();
+    /*
+     * the interior pages of a large free chunk are unmapped
+     */
+    ptr = malloc_mapped(MALLOC_RECLAIM_THRESHOLD * 2);
+    ASSERT(ptr);
+    memset(ptr, 0x0, MALLOC_RECLAIM_THRESHOLD * 2);
+    ptr1 = (void *)ROUND_UP((uint32_t)ptr + PAGE_SIZE, PAGE_SIZE);
+    ASSERT(page_present((uint32_t *)get_kernel_page_directory(),
+        (uint32_t)ptr1) == OK);
+    free(ptr);
+    ASSERT(page_present((uint32_t *)get_kernel_page_directory(),
+        (uint32_t)ptr1) != OK);
+    dump_malloc_stat();
 }
 #endif
 void
 malloc_init(void)
 {
     struct malloc_header * _malloc_hdr = NULL;
-    memset(_recycle_bins, 0x0, sizeof(_recycle_bins));
+    fl_bitmap = 0;
+    memset(sl_bitmap, 0x0, sizeof(sl_bitmap));
+    memset(_free_blocks, 0x0, sizeof(_free_blocks));
+    nr_free_chunks = 0;
+    free_bytes = 0;
+    memset(_quick_lists, 0x0, sizeof(_quick_lists));
+    nr_reclaimed_pages = 0;
     /*
-     *put the whole kernel heap into last recycle bin
+     *put the whole kernel heap into the free lists as a single chunk
      */
     _malloc_hdr = (struct malloc_header *)KERNEL_HEAP_BOTTOM;
     memset(_malloc_hdr, 0x0, sizeof(struct malloc_header));
@@ -345,11 +875,10 @@ malloc_init(void)
     _malloc_hdr->padding = 0;
     _malloc_hdr->free = 1;
     _malloc_hdr->magic = MALLOC_MAGIC;
-
-    _malloc_hdr->prev = (uint32_t)&_recycle_bins[MISC_BIN];
-    _recycle_bins[MISC_BIN].next  = KERNEL_HEAP_BOTTOM;
+    set_block_footer(_malloc_hdr);
+    insert_free_block(_malloc_hdr);
+    register_shrinker(&malloc_shrinker);
 #if defined(INLINE_TEST)
     malloc_test();
 #endif
 }
-
@@ -4,15 +4,16 @@
 #include <memory/include/paging.h>
 #include <kernel/include/printk.h>
 #include <lib/include/string.h>
+#include <memory/include/buddy.h>
+#include <lib/include/bitmap.h>
+#include <x86/include/interrupt.h>
+#include <memory/include/shrinker.h>
 
-
-static uint8_t free_page_bitmap[FREE_PAGE_BITMAP_SIZE];
 /*
  * The bit map records the free pages in the page inventory
  */
-#define FREE_BASE_PAGE_BITMAP_SIZE \
-    (((PAGE_SPACE_TOP - PAGE_SPACE_BOTTOM) >> 12) >> 3)
-static uint8_t free_base_page_bitmap[FREE_BASE_PAGE_BITMAP_SIZE];
+#define NR_BASE_PAGES ((PAGE_SPACE_TOP - PAGE_SPACE_BOTTOM) >> 12)
+static uint32_t free_base_page_bitmap[BITMAP_WORDS(NR_BASE_PAGES)];
 /*
  * the kernel page directory is the PDBR address.
  * NOTE the kernel_page_directory is not mapped into kernel virtual adddress
@@ -22,6 +23,26 @@ static uint8_t free_base_page_bitmap[FREE_BASE_PAGE_BITMAP_SIZE];
  */
 static uint32_t * kernel_page_directory;
 
+/*
+ * whether 4MB pages are used to map the kernel space, it's set once the CPU
+ * is found supporting PSE.
+ */
+static int32_t __large_page_enabled = 0;
+/*
+ * the kernel mappings are global once the CPU supports PGE, they are not
+ * flushed by CR3 reload at task switch.
+ */
+static int32_t __global_page_enabled = 0;
+/*
+ * the task page directory whose userspace entries are in kernel page
+ * directory.
+ */
+static uint32_t * loaded_user_page_directory = NULL;
+#define CPUID_EDX_PSE (1 << 3)
+#define CPUID_EDX_PGE (1 << 13)
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+
 /*
  * Function to create a 4k page table entry
  * write_permission: in [PAGE_PERMISSION_READ_ONLY, PAGE_PERMISSION_READ_WRITE]
@@ -70,93 +91,395 @@ create_pde32(uint32_t write_permission,
     pde.pt_frame = pt_frame >> 12;
     return PTE32_TO_DWORD(&pde);
 }
+
+/*
+ * Function to create a page directory entry which maps a 4MB page
+ * pg_frame: the physical address of the page, it must be 4MB aligned.
+ */
+uint32_t
+create_large_pde32(uint32_t write_permission,
+    uint32_t supervisor_permission,
+    uint32_t page_writethrough,
+    uint32_t page_cachedisable,
+    uint32_t pg_frame)
+{
+    struct pde32 pde;
+    ASSERT(!(pg_frame & LARGE_PAGE_MASK));
+    PDE32_TO_DWORD(&pde) = create_pde32(write_permission,
+        supervisor_permission,
+        page_writethrough,
+        page_cachedisable,
+        pg_frame);
+    pde.page_size = 1;
+    return PDE32_TO_DWORD(&pde);
+}
 /*
  *Get a free page from PageInventory VMA. usually these pages are to construct
  *page directory/table for both kernnel and userspace.
  *return 0 if no available page is found.
  * FIXED: create a *FAST* method to seach free base page ... as it makes 
  * significant sense.
+ * the fast method resumes from the last allocated page, the slow one rescans
+ * the whole inventory, both skip fully occupied words at a time.
  */
-static uint32_t fast_base_page_addr = 0;
+static uint32_t fast_base_page_idx = 0;
 uint32_t
 get_base_page_fast(void)
 {
-    int32_t offset;
-    int32_t byte_idx = 0;
-    int32_t bit_idx = 0;
-    uint8_t bit_set_mask = 0;
-    uint32_t target_page = 0;
-    if (fast_base_page_addr < PAGE_SPACE_BOTTOM ||
-        fast_base_page_addr >= PAGE_SPACE_TOP)
-        fast_base_page_addr = PAGE_SPACE_BOTTOM;
-    for(; fast_base_page_addr < PAGE_SPACE_TOP;
-        fast_base_page_addr += PAGE_SIZE) {
-        offset = fast_base_page_addr - PAGE_SPACE_BOTTOM;
-        offset = offset >> 12;
-        byte_idx = offset >> 3;
-        bit_idx = offset & 0x7;
-        bit_set_mask = 1 << bit_idx;
-        if(free_base_page_bitmap[byte_idx] & bit_set_mask)
-            continue;
-        free_base_page_bitmap[byte_idx] |= bit_set_mask;
-        target_page = fast_base_page_addr;
-        break;
-    }
-    return target_page;
+    int32_t idx;
+    if (fast_base_page_idx >= NR_BASE_PAGES)
+        fast_base_page_idx = 0;
+    idx = bitmap_find_first_zero(free_base_page_bitmap,
+        NR_BASE_PAGES,
+        fast_base_page_idx);
+    if (idx < 0)
+        return 0;
+    bitmap_set(free_base_page_bitmap, idx);
+    fast_base_page_idx = idx;
+    return PAGE_SPACE_BOTTOM + (idx << 12);
 }
 uint32_t
 get_base_page_slow(void)
 {
-    uint32_t _page = PAGE_SPACE_BOTTOM;
-    int32_t offset;
-    int32_t byte_idx = 0;
-    int32_t bit_idx = 0;
-    uint8_t bit_set_mask = 0;
-    for(; _page < PAGE_SPACE_TOP; _page += PAGE_SIZE) {
-        offset = _page - PAGE_SPACE_BOTTOM;
-        offset = offset >> 12;
-        byte_idx = offset >> 3;
-        bit_idx = offset & 0x7;
-        bit_set_mask = 1 << bit_idx;
-        if (free_base_page_bitmap[byte_idx] & bit_set_mask)
-            continue;
-        free_base_page_bitmap[byte_idx] |= bit_set_mask;
-        return _page;
-    }
-    return 0;
+    int32_t idx = bitmap_find_first_zero(free_base_page_bitmap,
+        NR_BASE_PAGES,
+        0);
+    if (idx < 0)
+        return 0;
+    bitmap_set(free_base_page_bitmap, idx);
+    return PAGE_SPACE_BOTTOM + (idx << 12);
+}
+/*
+ * The pool of pre-zeroed base pages, it's refilled by the idle task so that
+ * page table allocation does not have to clear the page synchronously.
+ */
+static uint32_t zeroed_base_pages[ZEROED_PAGE_POOL_SIZE];
+static struct zeroed_page_stat zeroed_page_stat;
+
+static uint32_t
+pop_zeroed_base_page(void)
+{
+    if (!zeroed_page_stat.nr_pooled)
+        return 0;
+    zeroed_page_stat.nr_pooled--;
+    return zeroed_base_pages[zeroed_page_stat.nr_pooled];
 }
+
 uint32_t
 get_base_page(void)
 {
     uint32_t target_page = get_base_page_fast();
     if (!target_page)
         target_page = get_base_page_slow();
+    // the zeroed pages are the last resort.
+    if (!target_page)
+        target_page = pop_zeroed_base_page();
     return target_page;
 }
+
+/*
+ * Get a base page whose content is all zero, the pool is tried first.
+ * return 0 if no available page is found.
+ */
+uint32_t
+get_zeroed_base_page(void)
+{
+    uint32_t target_page = pop_zeroed_base_page();
+    if (target_page) {
+        zeroed_page_stat.nr_hits++;
+        return target_page;
+    }
+    target_page = get_base_page();
+    if (target_page) {
+        memset((void *)target_page, 0x0, PAGE_SIZE);
+        zeroed_page_stat.nr_sync_zeroed++;
+    }
+    return target_page;
+}
+
+/*
+ * Fill the pool of zeroed base pages, it's called by the idle task only. the
+ * pages are cleared with interrupt enabled, the pool itself is accessed with
+ * interrupt disabled.
+ */
+void
+refill_zeroed_base_pages(void)
+{
+    uint32_t page;
+    while (1) {
+        cli();
+        if (zeroed_page_stat.nr_pooled >= ZEROED_PAGE_POOL_SIZE) {
+            sti();
+            break;
+        }
+        page = get_base_page_fast();
+        if (!page)
+            page = get_base_page_slow();
+        sti();
+        if (!page)
+            break;
+        memset((void *)page, 0x0, PAGE_SIZE);
+        cli();
+        if (zeroed_page_stat.nr_pooled < ZEROED_PAGE_POOL_SIZE) {
+            zeroed_base_pages[zeroed_page_stat.nr_pooled] = page;
+            zeroed_page_stat.nr_pooled++;
+            zeroed_page_stat.nr_idle_zeroed++;
+        } else {
+            free_base_page(page);
+        }
+        sti();
+    }
+}
+
+/*
+ * The pool of pre-zeroed page frames for the anonymous user pages, it's
+ * refilled by the idle task too. A frame is cleared through the scratch
+ * window which is not reentrant, so it's done with interrupt disabled.
+ */
+static uint32_t zeroed_page_frames[ZEROED_PAGE_POOL_SIZE];
+
+static uint32_t
+pop_zeroed_page_frame(void)
+{
+    uint32_t frame = 0;
+    uint32_t eflags = local_irq_save();
+    if (zeroed_page_stat.nr_frames_pooled) {
+        zeroed_page_stat.nr_frames_pooled--;
+        frame = zeroed_page_frames[zeroed_page_stat.nr_frames_pooled];
+    }
+    local_irq_restore(eflags);
+    return frame;
+}
+
+/*
+ * Get a page frame whose content is all zero, the pool is tried first.
+ * return 0 if no frame is available.
+ */
+uint32_t
+get_zeroed_page_frame(void)
+{
+    uint32_t frame = pop_zeroed_page_frame();
+    if (frame) {
+        zeroed_page_stat.nr_hits++;
+        return frame;
+    }
+    frame = get_page();
+    if (frame) {
+        zero_page_frame(frame);
+        zeroed_page_stat.nr_sync_zeroed++;
+    }
+    return frame;
+}
+
+void
+refill_zeroed_page_frames(void)
+{
+    uint32_t frame;
+    while (1) {
+        cli();
+        if (zeroed_page_stat.nr_frames_pooled >= ZEROED_PAGE_POOL_SIZE) {
+            sti();
+            break;
+        }
+        frame = get_page();
+        if (!frame) {
+            sti();
+            break;
+        }
+        zero_page_frame(frame);
+        zeroed_page_frames[zeroed_page_stat.nr_frames_pooled] = frame;
+        zeroed_page_stat.nr_frames_pooled++;
+        zeroed_page_stat.nr_idle_zeroed++;
+        sti();
+    }
+}
+
+/*
+ * the pooled frames are given back under memory pressure.
+ */
+static uint32_t
+zeroed_page_frame_shrink(uint32_t nr_frames)
+{
+    uint32_t frame;
+    uint32_t nr_released = 0;
+    while (nr_released < nr_frames && (frame = pop_zeroed_page_frame())) {
+        free_page(frame);
+        nr_released++;
+    }
+    return nr_released;
+}
+
+static struct shrinker zeroed_page_frame_shrinker = {
+    .name = "zeroed-frames",
+    .shrink = zeroed_page_frame_shrink,
+};
+
+void
+get_zeroed_page_stat(struct zeroed_page_stat * stat)
+{
+    memcpy(stat, &zeroed_page_stat, sizeof(struct zeroed_page_stat));
+}
+
+void
+dump_zeroed_page_stat(void)
+{
+    LOG_INFO("Dump zeroed base page pool:\n");
+    LOG_INFO("   pooled pages: %d\n", zeroed_page_stat.nr_pooled);
+    LOG_INFO("   pooled frames: %d\n", zeroed_page_stat.nr_frames_pooled);
+    LOG_INFO("   pool hits: %d\n", zeroed_page_stat.nr_hits);
+    LOG_INFO("   synchronously zeroed: %d\n", zeroed_page_stat.nr_sync_zeroed);
+    LOG_INFO("   zeroed in idle: %d\n", zeroed_page_stat.nr_idle_zeroed);
+}
 /*
  * release a page which must be in PageInventory VMA.
  */
 void
 free_base_page(uint32_t _page)
 {
-    int32_t offset;
-    int32_t byte_idx = 0;
-    int32_t bit_idx = 0;
-    uint8_t bit_set_mask = 0;
-    uint8_t bit_unset_mask = 0;
     if (_page < PAGE_SPACE_BOTTOM ||
         _page >= PAGE_SPACE_TOP) {
         LOG_WARN("seem page:0x%x is not in PageInventory VMA\n");
         return; 
     }
-    offset = _page - PAGE_SPACE_BOTTOM;
-    offset = offset >> 12;
-    byte_idx = offset >> 3;
-    bit_idx = offset & 0x7;
-    bit_set_mask = 1 << bit_idx;
-    bit_unset_mask = ~bit_set_mask;
-    free_base_page_bitmap[byte_idx] &= bit_unset_mask;
+    bitmap_clear(free_base_page_bitmap, (_page - PAGE_SPACE_BOTTOM) >> 12);
+}
+/*
+ * The first two pages of KernelScratch VMA are the windows to the source and
+ * destination frames, the caller must not be interrupted.
+ */
+#define SCRATCH_SRC_WINDOW KERNEL_SCRATCH_BOTTOM
+#define SCRATCH_DST_WINDOW (KERNEL_SCRATCH_BOTTOM + PAGE_SIZE)
+void
+copy_page_frame(uint32_t dst_frame, uint32_t src_frame)
+{
+    kernel_map_page(SCRATCH_SRC_WINDOW,
+        src_frame & ~PAGE_MASK,
+        PAGE_PERMISSION_READ_ONLY,
+        PAGE_WRITEBACK,
+        PAGE_CACHE_ENABLED);
+    kernel_map_page(SCRATCH_DST_WINDOW,
+        dst_frame & ~PAGE_MASK,
+        PAGE_PERMISSION_READ_WRITE,
+        PAGE_WRITEBACK,
+        PAGE_CACHE_ENABLED);
+    memcpy((void *)SCRATCH_DST_WINDOW, (void *)SCRATCH_SRC_WINDOW, PAGE_SIZE);
+    kernel_unmap_page(SCRATCH_SRC_WINDOW);
+    kernel_unmap_page(SCRATCH_DST_WINDOW);
+}
+
+void
+zero_page_frame(uint32_t frame)
+{
+    memset(kernel_map_scratch_frame(frame), 0x0, PAGE_SIZE);
+    kernel_unmap_scratch_frame();
+}
+
+void *
+kernel_map_scratch_frame(uint32_t frame)
+{
+    kernel_map_page(SCRATCH_DST_WINDOW,
+        frame & ~PAGE_MASK,
+        PAGE_PERMISSION_READ_WRITE,
+        PAGE_WRITEBACK,
+        PAGE_CACHE_ENABLED);
+    return (void *)SCRATCH_DST_WINDOW;
+}
+
+void
+kernel_unmap_scratch_frame(void)
+{
+    kernel_unmap_page(SCRATCH_DST_WINDOW);
+}
+static uint32_t
+cpu_features(void)
+{
+    uint32_t eax = 1;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+    asm volatile("cpuid;"
+        :"+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return edx;
+}
+
+int32_t
+large_page_enabled(void)
+{
+    return __large_page_enabled;
+}
+
+/*
+ * whether a 4MB page can be mapped at virt_addr, the PDE must be unused.
+ */
+int32_t
+kernel_large_page_mappable(uint32_t virt_addr)
+{
+    uint32_t pd_index = (virt_addr >> 22) & 0x3ff;
+    return __large_page_enabled &&
+        !(virt_addr & LARGE_PAGE_MASK) &&
+        !PDE32_PTR(&kernel_page_directory[pd_index])->present;
+}
+
+int32_t
+kernel_map_large_page(uint32_t virt_addr,
+    uint32_t phy_addr,
+    uint32_t write_permission,
+    uint32_t page_writethrough,
+    uint32_t page_cachedisable)
+{
+    uint32_t pd_index = (virt_addr >> 22) & 0x3ff;
+    if (!__large_page_enabled)
+        return -ERR_NOT_SUPPORTED;
+    if ((virt_addr & LARGE_PAGE_MASK) || (phy_addr & LARGE_PAGE_MASK))
+        return -ERR_INVALID_ARG;
+    if (PDE32_PTR(&kernel_page_directory[pd_index])->present)
+        return -ERR_EXIST;
+    kernel_page_directory[pd_index] = create_large_pde32(write_permission,
+        PAGE_PERMISSION_SUPERVISOR,
+        page_writethrough,
+        page_cachedisable,
+        phy_addr);
+    PDE32_PTR(&kernel_page_directory[pd_index])->global =
+        __global_page_enabled;
+    return OK;
+}
+
+/*
+ * replace the 4MB page mapped by a PDE with a page table which maps the
+ * same frames with the same attributes.
+ * return -ERR_OUT_OF_MEMORY if no page table is available, the 4MB page is
+ * left in place.
+ */
+static int32_t
+split_large_page(uint32_t pd_index)
+{
+    int idx;
+    uint32_t page_table;
+    uint32_t * page_table_ptr;
+    struct pde32 * pde = PDE32_PTR(&kernel_page_directory[pd_index]);
+    ASSERT(pde->present && pde->page_size);
+    page_table = get_base_page();
+    if (!page_table)
+        return -ERR_OUT_OF_MEMORY;
+    page_table_ptr = (uint32_t *)page_table;
+    for (idx = 0; idx < PAGES_PER_LARGE_PAGE; idx++) {
+        page_table_ptr[idx] = create_pte32(pde->write_permission,
+            pde->supervisor_permission,
+            pde->page_writethrough,
+            pde->page_cachedisable,
+            (pde->pt_frame << 12) + idx * PAGE_SIZE);
+        PTE32_PTR(&page_table_ptr[idx])->global = pde->global;
+    }
+    kernel_page_directory[pd_index] = create_pde32(PAGE_PERMISSION_READ_WRITE,
+        PAGE_PERMISSION_SUPERVISOR,
+        PAGE_WRITEBACK,
+        PAGE_CACHE_ENABLED,
+        page_table);
+    flush_tlb_entry(pd_index << 22);
+    LOG_DEBUG("split large page at page directory index:%x\n", pd_index);
+    return OK;
 }
+
 /*
  * map phy_addr to virt_addr in kernel linear address space
  * if page table is not present for a page directory entry
@@ -175,14 +498,14 @@ kernel_map_page(uint32_t virt_addr,
     uint32_t pt_index = (virt_addr >> 12) & 0x3ff;
     struct pde32 * pde = PDE32_PTR(&kernel_page_directory[pd_index]);
     struct pte32 * pte;
+    uint32_t was_present;
     if(!pde->present) {
-        page_table = get_base_page();
-        ASSERT(page_table);
         /*
          * MY GOD, the page should be clear once allocated
          * or the table will be polluted initially.
          */
-        memset((void *)page_table, 0x0, PAGE_SIZE);
+        page_table = get_zeroed_base_page();
+        ASSERT(page_table);
         kernel_page_directory[pd_index] = create_pde32(
             PAGE_PERMISSION_READ_WRITE,
             PAGE_PERMISSION_SUPERVISOR,
@@ -191,105 +514,55 @@ kernel_map_page(uint32_t virt_addr,
             page_table);
         LOG_DEBUG("allocate page table for page directory index:%x\n", pd_index);
         pde = PDE32_PTR(&kernel_page_directory[pd_index]);
+    } else if (pde->page_size) {
+        ASSERT(split_large_page(pd_index) == OK);
     }
     ASSERT(pde->present);
     page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
+    was_present = PTE32_PTR(&page_table_ptr[pt_index])->present;
     page_table_ptr[pt_index] = create_pte32(write_permission,
         PAGE_PERMISSION_SUPERVISOR,
         page_writethrough,
         page_cachedisable,
         phy_addr);
     pte = PTE32_PTR(&page_table_ptr[pt_index]);
+    pte->global = __global_page_enabled;
+    // the kernel mappings are global, a CR3 reload does not flush them
+    if (was_present)
+        flush_tlb_entry(virt_addr);
     ASSERT(pte->present);
     ASSERT((pte->pg_frame << 12) == (phy_addr & (~PAGE_MASK)));
     //LOG_INFO("map %x to %x %x\n", phy_addr, virt_addr, page_table_ptr[pt_index]);
 }
 /*
- * allocate physically continuous pages
- * return the address of the 1st page
+ * unmap virt_addr from kernel linear address space, the page table itself is
+ * kept even if it becomes empty.
+ * return the physical address the page was mapped to, 0 if it's not mapped
+ * or it's in a 4MB page which can not be split for lack of a page table, the
+ * page stays mapped then.
  */
 uint32_t
-get_pages(int nr_pages)
+kernel_unmap_page(uint32_t virt_addr)
 {
-    //addr is page aligned
-    uint32_t addr = get_system_memory_start();
-    uint32_t boundary = get_system_memory_boundary();
-    int idx = 0;
-    int nstep = 1;
-    int match = 0;
-    ASSERT(!(addr & PAGE_MASK));
-    for (; addr < boundary; addr += PAGE_SIZE * nstep) {
-        if ((addr + PAGE_SIZE * nr_pages) >= boundary)
-            break;
-        for(idx = 0; idx < nr_pages; idx++){
-            if (!IS_PAGE_FREE(addr + idx * PAGE_SIZE))
-                break;
-        }
-        if (idx == nr_pages) {
-            match = 1;
-            break;
-        }
-        nstep = idx + 1;
-    }
-    if (match) {
-        for (idx = 0; idx < nr_pages; idx++) {
-            ASSERT(IS_PAGE_FREE(addr + idx * PAGE_SIZE));
-            MARK_PAGE_AS_OCCUPIED(addr + idx * PAGE_SIZE);
-            ASSERT(!IS_PAGE_FREE(addr + idx * PAGE_SIZE));
-        }
-        return addr;
-    }
-    return 0;
-}
-/*
- * It's crutial to import fast free page searching method, it save lots of time
- * and it almost approches o(1) time.
- */
-static uint32_t fast_page_addr = 0;
-uint32_t
-get_page_fast(void)
-{
-    uint32_t target_page = 0;
-    uint32_t addr = get_system_memory_start();
-    uint32_t boundary = get_system_memory_boundary();
-    if (fast_page_addr < addr || fast_page_addr >= boundary)
-        fast_page_addr = addr;
-    for (; fast_page_addr < boundary; fast_page_addr += PAGE_SIZE) {
-        if(IS_PAGE_FREE(fast_page_addr)) {
-            target_page = fast_page_addr;
-            MARK_PAGE_AS_OCCUPIED(fast_page_addr);
-            ASSERT(!IS_PAGE_FREE(fast_page_addr));
-            fast_page_addr += PAGE_SIZE;
-            break;
-        }
-    }
-    return target_page;
-}
-
-uint32_t
-get_page(void)
-{
-    uint32_t _page = get_page_fast();
-    if (!_page)
-        _page = get_pages(1);
-    return _page;
-}
-
-void
-free_pages(uint32_t pg_addr, int nr_pages)
-{
-    int idx = 0;
-    for(; idx < nr_pages; idx++){
-        MAKR_PAGE_AS_FREE(pg_addr + PAGE_SIZE * idx);
-    }
-}
-
-void
-free_page(uint32_t pg_addr)
-{
-    free_pages(pg_addr, 1);
+    uint32_t phy_addr = 0;
+    uint32_t * page_table_ptr;
+    uint32_t pd_index = (virt_addr >> 22) & 0x3ff;
+    uint32_t pt_index = (virt_addr >> 12) & 0x3ff;
+    struct pde32 * pde = PDE32_PTR(&kernel_page_directory[pd_index]);
+    struct pte32 * pte;
+    if (!pde->present)
+        return phy_addr;
+    if (pde->page_size && split_large_page(pd_index) != OK)
+        return phy_addr;
+    page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
+    pte = PTE32_PTR(&page_table_ptr[pt_index]);
+    if (!pte->present)
+        return phy_addr;
+    phy_addr = pte->pg_frame << 12;
+    page_table_ptr[pt_index] = 0;
+    flush_tlb_entry(virt_addr);
+    return phy_addr;
 }
-
 void
 enable_paging(void)
 {
@@ -315,11 +588,32 @@ disable_paging(void)
 void
 flush_tlb(void)
 {
-    asm volatile("movl %%cr3, %%eax;"
-        "movl %%eax, %%cr3;"
-        :
+    if (__global_page_enabled)
+        asm volatile("movl %%cr4, %%eax;"
+            "xor %0, %%eax;"
+            "movl %%eax, %%cr4;"
+            "xor %0, %%eax;"
+            "movl %%eax, %%cr4;"
+            :
+            :"i"(CR4_PGE)
+            :"%eax", "memory");
+    else
+        asm volatile("movl %%cr3, %%eax;"
+            "movl %%eax, %%cr3;"
+            :
+            :
+            :"%eax", "memory");
+}
+/*
+ * Invalidate the TLB entry of a single linear address.
+ */
+void
+flush_tlb_entry(uint32_t virt_addr)
+{
+    asm volatile("invlpg (%0);"
         :
-        :"%eax", "memory");
+        :"r"(virt_addr)
+        :"memory");
 }
 uint32_t
 get_kernel_page_directory(void)
@@ -341,9 +635,12 @@ dump_page_tables(uint32_t page_directory)
         pde = PDE32_PTR(&pd_ptr[pd_index]);
         if(!pde->present)
             continue;
-        printk("    page directory entry:%d 0x%x\n",
+        printk("    page directory entry:%d 0x%x%s\n",
             pd_index,
-            pd_ptr[pd_index]);
+            pd_ptr[pd_index],
+            pde->page_size ? " (4MB page)" : "");
+        if (pde->page_size)
+            continue;
         for(pg_index = 0; pg_index < 1024; pg_index++) {
             pte = PTE32_PTR(((pde->pt_frame << 12) + pg_index * 4));
             if (!pte->present)
@@ -372,6 +669,11 @@ virt2phy(uint32_t * page_directory, uint32_t virt_addr)
     struct pte32 * pte = NULL;
     pde = PDE32_PTR(&page_directory[pd_index]);
     _(pde->present);
+    if (pde->page_size) {
+        phy_addr = (((uint32_t)pde->pt_frame) << 12);
+        phy_addr |= virt_addr & LARGE_PAGE_MASK;
+        goto out;
+    }
     page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
     pte = PTE32_PTR(&page_table_ptr[pt_index]);
     _(pte->present);
@@ -399,93 +701,157 @@ page_present(uint32_t * page_directory, uint32_t virt_addr)
     struct pte32 * pte = NULL;
     pde = PDE32_PTR(&page_directory[pd_index]);
     _(pde->present);
-    page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
-    pte = PTE32_PTR(&page_table_ptr[pt_index]);
-    _(pte->present);
+    if (!pde->page_size) {
+        page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
+        pte = PTE32_PTR(&page_table_ptr[pt_index]);
+        _(pte->present);
+    }
     present = OK;
     out:
         return present;
 #undef _
 }
 
+uint32_t
+kernel_tlb_footprint(uint32_t start, uint32_t end)
+{
+    uint32_t nr_entries = 0;
+    uint64_t virt_addr = PAGE_ALIGN(start);
+    uint32_t pd_index;
+    uint32_t pt_index;
+    uint32_t * page_table_ptr;
+    struct pde32 * pde;
+    while (virt_addr < end) {
+        pd_index = (virt_addr >> 22) & 0x3ff;
+        pt_index = (virt_addr >> 12) & 0x3ff;
+        pde = PDE32_PTR(&kernel_page_directory[pd_index]);
+        if (!pde->present || pde->page_size) {
+            nr_entries += pde->present;
+            virt_addr = (virt_addr & ~(uint64_t)LARGE_PAGE_MASK) +
+                LARGE_PAGE_SIZE;
+            continue;
+        }
+        page_table_ptr = (uint32_t *)(pde->pt_frame << 12);
+        nr_entries += PTE32_PTR(&page_table_ptr[pt_index])->present;
+        virt_addr += PAGE_SIZE;
+    }
+    return nr_entries;
+}
+
+/*
+ * identity map [start, end) in kernel space, [ro_start, ro_end) is mapped
+ * read-only. the 4MB aligned chunks which are fully covered and writable are
+ * mapped with 4MB pages if possible.
+ */
+static void
+kernel_map_identity(uint32_t start,
+    uint32_t end,
+    uint32_t ro_start,
+    uint32_t ro_end)
+{
+    uint32_t phy_addr = start;
+    while (phy_addr < end) {
+        if (kernel_large_page_mappable(phy_addr) &&
+            (end - phy_addr) >= LARGE_PAGE_SIZE &&
+            (phy_addr >= ro_end ||
+            (phy_addr + LARGE_PAGE_SIZE) <= ro_start)) {
+            ASSERT(kernel_map_large_page(phy_addr,
+                phy_addr,
+                PAGE_PERMISSION_READ_WRITE,
+                PAGE_WRITEBACK,
+                PAGE_CACHE_ENABLED) == OK);
+            phy_addr += LARGE_PAGE_SIZE;
+            continue;
+        }
+        kernel_map_page(phy_addr, phy_addr,
+            (phy_addr >= ro_start && phy_addr < ro_end) ?
+            PAGE_PERMISSION_READ_ONLY :
+            PAGE_PERMISSION_READ_WRITE,
+            PAGE_WRITEBACK,
+            PAGE_CACHE_ENABLED);
+        phy_addr += PAGE_SIZE;
+    }
+}
+
 void
-enable_kernel_paging(void)
+load_user_page_directory(uint32_t * page_directory)
 {
     int idx = 0;
     uint32_t directory_index_top = USERSPACE_BOTTOM >> 12 >> 10;
-    uint32_t * kernel_page_directory = (uint32_t *)get_kernel_page_directory();
     for(idx = directory_index_top; idx < 1024; idx++)
-        kernel_page_directory[idx] = 0x0;
+        kernel_page_directory[idx] = page_directory ?
+            page_directory[idx] : 0x0;
+    loaded_user_page_directory = page_directory;
     __asm__ volatile("movl %%eax, %%cr3;"
         :
-        :"a"(kernel_page_directory));
+        :"a"(kernel_page_directory)
+        :"memory");
+}
+
+uint32_t *
+get_loaded_user_page_directory(void)
+{
+    return loaded_user_page_directory;
+}
+
+void
+enable_kernel_paging(void)
+{
+    load_user_page_directory(NULL);
 }
 void
 paging_init(void)
 {
-    int idx = 0;
-    uint32_t phy_addr = 0;
-    uint32_t frame_addr = 0;
     uint32_t sys_mem_start = get_system_memory_start();
-    uint32_t sys_mem_boundary = get_system_memory_boundary();
-    memset(free_page_bitmap, 0x0, sizeof(free_page_bitmap));
     memset(free_base_page_bitmap, 0x0, sizeof(free_base_page_bitmap));
+    memset(&zeroed_page_stat, 0x0, sizeof(zeroed_page_stat));
+    register_shrinker(&zeroed_page_frame_shrinker);
     /*
-     * Marks pages above system memory boundary as occupised
-     *
+     * Hand the frames between the _kernel_bss_end and system memory boundary
+     * over to buddy system, PageInventory is excluded.
      */
-    for(idx = AT_BYTE(sys_mem_boundary >> 12);
-        idx < FREE_PAGE_BITMAP_SIZE;
-        idx++) {
-        free_page_bitmap[idx] = 0xff;
-    }
-    /*
-     * Mark pages whose address is lower than the _kernel_bss_end as occupied
-     */
-    for (frame_addr = 0;
-        frame_addr < (uint32_t)&_kernel_bss_end;
-        frame_addr += PAGE_SIZE) {
-        MARK_PAGE_AS_OCCUPIED(frame_addr);
-        ASSERT(!IS_PAGE_FREE(frame_addr));
-    }
+    buddy_init();
     /*
      * Allocate the kernel page directory
      * */
     kernel_page_directory = (uint32_t *)get_base_page();
     memset(kernel_page_directory, 0x0, PAGE_SIZE);
     LOG_INFO("kernel page directory address: 0x%x\n", kernel_page_directory);
+#if defined(KERNEL_LARGE_PAGE)
+    __large_page_enabled = !!(cpu_features() & CPUID_EDX_PSE);
+    if (__large_page_enabled)
+        asm volatile("movl %%cr4, %%eax;"
+            "or %0, %%eax;"
+            "movl %%eax, %%cr4;"
+            :
+            :"i"(CR4_PSE)
+            :"%eax");
+#endif
+    __global_page_enabled = !!(cpu_features() & CPUID_EDX_PGE);
+    if (__global_page_enabled)
+        asm volatile("movl %%cr4, %%eax;"
+            "or %0, %%eax;"
+            "movl %%eax, %%cr4;"
+            :
+            :"i"(CR4_PGE)
+            :"%eax");
+    LOG_INFO("4MB page mapping: %s, global kernel mapping: %s\n",
+        __large_page_enabled ? "enabled" : "disabled",
+        __global_page_enabled ? "enabled" : "disabled");
     /*
-     *Mark pages in page inventory as occupied
-     *and map them in advance
+     *Map pages in page inventory in advance
      */
-    for(frame_addr = PAGE_SPACE_BOTTOM;
-        frame_addr < PAGE_SPACE_TOP;
-        frame_addr += PAGE_SIZE) {
-        MARK_PAGE_AS_OCCUPIED(frame_addr);
-        ASSERT(!IS_PAGE_FREE(frame_addr));
-    }
-    for(frame_addr = PAGE_SPACE_BOTTOM;
-        frame_addr < PAGE_SPACE_TOP;
-        frame_addr += PAGE_SIZE) {
-        kernel_map_page(frame_addr,
-            frame_addr,
-            PAGE_PERMISSION_READ_WRITE,
-            PAGE_WRITEBACK,
-            PAGE_CACHE_ENABLED);
-    }
+    kernel_map_identity(PAGE_SPACE_BOTTOM, PAGE_SPACE_TOP, 0, 0);
     /*
      * Map all the pages before the returned address of 
-     * get_system_memory_start()
+     * get_system_memory_start(), the kernel text is read-only.
      */
-    for(phy_addr = 0; phy_addr < sys_mem_start; phy_addr += PAGE_SIZE) {
-        kernel_map_page(phy_addr, phy_addr,
-            (phy_addr >= (uint32_t)&_kernel_text_start &&
-            phy_addr < (uint32_t)&_kernel_data_start) ?
-            PAGE_PERMISSION_READ_ONLY :
-            PAGE_PERMISSION_READ_WRITE,
-            PAGE_WRITEBACK,
-            PAGE_CACHE_ENABLED);
-    }
+    kernel_map_identity(0, sys_mem_start,
+        (uint32_t)&_kernel_text_start,
+        (uint32_t)&_kernel_data_start);
+    LOG_INFO("kernel identity map TLB footprint: %d entries\n",
+        kernel_tlb_footprint(0, sys_mem_start) +
+        kernel_tlb_footprint(PAGE_SPACE_BOTTOM, PAGE_SPACE_TOP));
     
     //dump_page_tables((uint32_t)kernel_page_directory);
     /*
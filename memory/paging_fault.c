@@ -2,6 +2,7 @@
  * Copyright (c) 2018 Jie Zheng
  */
 #include <memory/include/paging.h>
+#include <memory/include/buddy.h>
 #include <memory/include/kernel_vma.h>
 #include <kernel/include/printk.h>
 #include <x86/include/interrupt.h>
@@ -34,9 +35,16 @@ handle_kernel_page_fault(struct x86_cpustate * cpu,
                 get_page();
             /*
              * physical address is not supposed to be 0x0
-             * because it's already mapped as Low1MB area
+             * because it's already mapped as Low1MB area, the page frames
+             * may run out though.
              */
-            ASSERT(phy_addr);
+            if (!phy_addr) {
+                LOG_DEBUG("can not allocate page for kernel VMA:%s "
+                    "addr:0x%x\n", vma->name, linear_addr);
+                return -ERR_OUT_OF_MEMORY;
+            }
+            if (!vma->exact)
+                set_page_frame_flags(phy_addr, PAGE_FRAME_KERNEL);
             kernel_map_page(linear_addr, phy_addr,
                 vma->write_permission,
                 vma->page_writethrough,
@@ -88,22 +96,26 @@ paging_fault_handler(struct x86_cpustate * cpu)
         linear_addr, current);
     if (linear_addr < ((uint32_t)USERSPACE_BOTTOM)) {
         result = handle_kernel_page_fault(cpu, linear_addr, &esp);
-        if (result == OK) {
-            if (current)
-                enable_task_paging(current);
-            else
-                enable_kernel_paging();
-        }
     } else {
+        /*
+         * the fault handlers flush the TLB entry of the page they change,
+         * no CR3 reload is needed.
+         */
         ASSERT(current);
         result = handle_userspace_page_fault(current, cpu, linear_addr);
-        if (result == OK) {
-            if (current)
-                enable_task_paging(current);
-            else
-                enable_kernel_paging();
-        }
     }
+    /*
+     * the shrinkers have been tried by the page allocator, kill a task to
+     * free its memory. The faulting task sleeps until the victim exits, the
+     * faulting instruction is retried once it's resumed.
+     * the kernel heap never faults in the middle of its own updates, so a
+     * kernel page fault can wait for memory as well.
+     */
+    if ((result == (uint32_t)-ERR_OUT_OF_RESOURCE ||
+        result == (uint32_t)-ERR_OUT_OF_MEMORY) &&
+        out_of_memory() == OK &&
+        wait_for_memory(cpu, &esp) == OK)
+        result = OK;
     /*
      * Page Fault is not occuring as expected.
      */
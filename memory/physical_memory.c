@@ -25,7 +25,25 @@ __attribute__((always_inline)) inline
 uint32_t get_system_memory_start(void)
 {
     uint32_t _bss_end = (uint32_t)&_kernel_bss_end;
-    return (uint32_t)page_round_addr(_bss_end);
+    if (!system_memory_start)
+        system_memory_start = (uint32_t)page_round_addr(_bss_end);
+    return system_memory_start;
+}
+
+/*
+ * Reserve physical memory right after the kernel image at boot, the system
+ * memory start is moved beyond it, so it's identity mapped and excluded from
+ * the buddy system as the kernel image is. It must be called before the
+ * kernel VMAs are set up.
+ */
+void *
+reserve_boot_memory(uint32_t length)
+{
+    uint32_t mem = get_system_memory_start();
+    system_memory_start = (uint32_t)page_round_addr(mem + length);
+    ASSERT(system_memory_start <= PAGE_SPACE_BOTTOM);
+    LOG_INFO("reserve boot memory:0x%x length:0x%x\n", mem, length);
+    return (void *)mem;
 }
 void probe_physical_memory(struct multiboot_info * boot_info)
 {
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <memory/include/shrinker.h>
+#include <kernel/include/printk.h>
+
+static struct list_elem shrinker_head;
+static int32_t shrinking;
+
+void
+register_shrinker(struct shrinker * shrinker)
+{
+    ASSERT(shrinker->shrink);
+    shrinker->nr_calls = 0;
+    shrinker->nr_reclaimed = 0;
+    list_append(&shrinker_head, &shrinker->list);
+    LOG_INFO("Register memory shrinker:%s\n", shrinker->name);
+}
+
+uint32_t
+shrink_memory(uint32_t nr_frames)
+{
+    uint32_t nr_reclaimed = 0;
+    uint32_t nr_shrunk;
+    struct list_elem * _list;
+    struct shrinker * shrinker;
+    if (shrinking)
+        return 0;
+    shrinking = 1;
+    LIST_FOREACH_START(&shrinker_head, _list) {
+        shrinker = CONTAINER_OF(_list, struct shrinker, list);
+        if (nr_reclaimed >= nr_frames)
+            break;
+        nr_shrunk = shrinker->shrink(nr_frames - nr_reclaimed);
+        shrinker->nr_calls++;
+        shrinker->nr_reclaimed += nr_shrunk;
+        nr_reclaimed += nr_shrunk;
+    }
+    LIST_FOREACH_END();
+    shrinking = 0;
+    LOG_DEBUG("Shrink memory: %d of %d frames reclaimed\n",
+        nr_reclaimed, nr_frames);
+    return nr_reclaimed;
+}
+
+void
+dump_shrinkers(void)
+{
+    struct list_elem * _list;
+    struct shrinker * shrinker;
+    LOG_INFO("Dump memory shrinkers:\n");
+    LIST_FOREACH_START(&shrinker_head, _list) {
+        shrinker = CONTAINER_OF(_list, struct shrinker, list);
+        LOG_INFO("   shrinker:%s calls:%d reclaimed frames:%d\n",
+            shrinker->name,
+            shrinker->nr_calls,
+            shrinker->nr_reclaimed);
+    }
+    LIST_FOREACH_END();
+}
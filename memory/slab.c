@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#include <memory/include/slab.h>
+#include <memory/include/paging.h>
+#include <memory/include/buddy.h>
+#include <lib/include/string.h>
+#include <kernel/include/printk.h>
+#include <lib/include/bitmap.h>
+#include <memory/include/shrinker.h>
+
+/*
+ * The bitmap records the occupied pages of the KernelSlab VMA.
+ */
+#define SLAB_SPACE_NR_PAGES ((SLAB_SPACE_TOP - SLAB_SPACE_BOTTOM) >> 12)
+static uint32_t slab_space_bitmap[BITMAP_WORDS(SLAB_SPACE_NR_PAGES)];
+
+#define SLAB_SIZE(cache) ((cache)->nr_pages_per_slab * PAGE_SIZE)
+#define OBJECT_TO_SLAB(cache, obj) \
+    ((struct slab *)(((uint32_t)(obj)) & ~(SLAB_SIZE(cache) - 1)))
+
+static struct list_elem kmem_cache_head;
+/*
+ * The cache of struct kmem_cache, it's the only statically allocated one.
+ */
+static struct kmem_cache kmem_cache_boot;
+
+/*
+ * Search a run of nr_pages free pages which is aligned to nr_pages
+ * in KernelSlab VMA, nr_pages must be a power of 2.
+ * return 0 if the VMA is exhausted.
+ */
+static uint32_t
+slab_space_alloc(uint32_t nr_pages)
+{
+    int32_t pg_idx = bitmap_find_zero_area(slab_space_bitmap,
+        SLAB_SPACE_NR_PAGES,
+        0,
+        nr_pages,
+        nr_pages);
+    if (pg_idx < 0)
+        return 0;
+    bitmap_set_range(slab_space_bitmap, pg_idx, nr_pages);
+    return SLAB_SPACE_BOTTOM + pg_idx * PAGE_SIZE;
+}
+
+static void
+slab_space_free(uint32_t virt_addr, uint32_t nr_pages)
+{
+    uint32_t pg_idx = (virt_addr - SLAB_SPACE_BOTTOM) >> 12;
+    ASSERT(bitmap_find_first_zero(slab_space_bitmap,
+        pg_idx + nr_pages, pg_idx) < 0);
+    bitmap_clear_range(slab_space_bitmap, pg_idx, nr_pages);
+}
+
+/*
+ * Unmap the pages of a slab and return them to the physical page allocator
+ */
+static void
+kmem_cache_release_slab(struct kmem_cache * cache, struct slab * slab)
+{
+    uint32_t virt_addr = (uint32_t)slab;
+    uint32_t phy_addr = 0;
+    uint32_t idx = 0;
+    ASSERT(!slab->nr_inuse);
+    slab->magic = 0;
+    for (idx = 0; idx < cache->nr_pages_per_slab; idx++) {
+        phy_addr = kernel_unmap_page(virt_addr + idx * PAGE_SIZE);
+        ASSERT(phy_addr);
+        free_page(phy_addr);
+    }
+    slab_space_free(virt_addr, cache->nr_pages_per_slab);
+    cache->nr_slabs--;
+    LOG_TRIVIA("kmem_cache:%s release slab:0x%x\n", cache->name, virt_addr);
+}
+
+/*
+ * Allocate a slab from KernelSlab VMA, back it with physical pages and
+ * thread all its objects into the slab's freelist.
+ */
+static struct slab *
+kmem_cache_grow(struct kmem_cache * cache)
+{
+    uint32_t virt_addr = 0;
+    uint32_t phy_addr = 0;
+    uint32_t idx = 0;
+    uint32_t obj = 0;
+    struct slab * slab = NULL;
+    virt_addr = slab_space_alloc(cache->nr_pages_per_slab);
+    if (!virt_addr) {
+        LOG_DEBUG("kmem_cache:%s runs out of slab space\n", cache->name);
+        return NULL;
+    }
+    for (idx = 0; idx < cache->nr_pages_per_slab; idx++) {
+        phy_addr = get_page();
+        if (!phy_addr)
+            goto page_error;
+        set_page_frame_flags(phy_addr, PAGE_FRAME_KERNEL);
+        kernel_map_page(virt_addr + idx * PAGE_SIZE,
+            phy_addr,
+            PAGE_PERMISSION_READ_WRITE,
+            PAGE_WRITEBACK,
+            PAGE_CACHE_ENABLED);
+    }
+    slab = (struct slab *)virt_addr;
+    memset(slab, 0x0, sizeof(struct slab));
+    slab->cache = cache;
+    slab->magic = SLAB_MAGIC;
+    for (idx = cache->nr_objects_per_slab; idx > 0; idx--) {
+        obj = virt_addr + cache->object_offset +
+            (idx - 1) * cache->object_stride;
+        *(void **)obj = slab->freelist;
+        slab->freelist = (void *)obj;
+    }
+    cache->nr_slabs++;
+    cache->nr_empty_slabs++;
+    LOG_TRIVIA("kmem_cache:%s grow slab:0x%x\n", cache->name, virt_addr);
+    return slab;
+
+    page_error:
+        while (idx > 0) {
+            idx--;
+            phy_addr = kernel_unmap_page(virt_addr + idx * PAGE_SIZE);
+            ASSERT(phy_addr);
+            free_page(phy_addr);
+        }
+        slab_space_free(virt_addr, cache->nr_pages_per_slab);
+        return NULL;
+}
+
+static int32_t
+kmem_cache_setup(struct kmem_cache * cache,
+    const uint8_t * name,
+    uint32_t object_size,
+    uint32_t align)
+{
+    uint32_t nr_pages = 1;
+    uint32_t object_offset;
+    uint32_t object_stride;
+    if (!object_size || !align || (align & (align - 1)))
+        return -ERR_INVALID_ARG;
+    align = MAX(align, KMEM_CACHE_MIN_ALIGN);
+    object_stride = (object_size + align - 1) & ~(align - 1);
+    object_offset = (sizeof(struct slab) + align - 1) & ~(align - 1);
+    while (nr_pages < KMEM_CACHE_MAX_PAGES &&
+        (nr_pages * PAGE_SIZE - object_offset) / object_stride <
+        KMEM_CACHE_MIN_OBJECTS)
+        nr_pages <<= 1;
+    if (nr_pages * PAGE_SIZE < object_offset + object_stride)
+        return -ERR_INVALID_ARG;
+    memset(cache, 0x0, sizeof(struct kmem_cache));
+    strcpy_safe(cache->name, name, sizeof(cache->name));
+    cache->object_size = object_size;
+    cache->object_stride = object_stride;
+    cache->object_offset = object_offset;
+    cache->nr_pages_per_slab = nr_pages;
+    cache->nr_objects_per_slab =
+        (nr_pages * PAGE_SIZE - object_offset) / object_stride;
+    list_init(&cache->slabs_partial);
+    list_append(&kmem_cache_head, &cache->list);
+    return OK;
+}
+
+/*
+ * Create a named cache of objects of object_size bytes, every object is
+ * aligned to align which must be a power of 2.
+ * return NULL if the object can not be fit into a slab.
+ */
+struct kmem_cache *
+kmem_cache_create(const uint8_t * name, uint32_t object_size, uint32_t align)
+{
+    struct kmem_cache * cache = kmem_cache_alloc(&kmem_cache_boot);
+    if (!cache)
+        return NULL;
+    if (kmem_cache_setup(cache, name, object_size, align)) {
+        kmem_cache_free(&kmem_cache_boot, cache);
+        return NULL;
+    }
+    LOG_DEBUG("kmem_cache:%s created, object size:%d, %d objects per slab\n",
+        cache->name, cache->object_size, cache->nr_objects_per_slab);
+    return cache;
+}
+
+/*
+ * Allocate an object from the cache, the object is not cleared.
+ * return NULL if no memory is available.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache * cache)
+{
+    struct slab * slab = NULL;
+    void * obj = NULL;
+    if (list_empty(&cache->slabs_partial)) {
+        slab = kmem_cache_grow(cache);
+        if (!slab)
+            return NULL;
+        list_prepend(&cache->slabs_partial, &slab->list);
+    }
+    slab = CONTAINER_OF(list_first_elem(&cache->slabs_partial),
+        struct slab,
+        list);
+    ASSERT(slab->magic == SLAB_MAGIC);
+    ASSERT(slab->freelist);
+    if (!slab->nr_inuse)
+        cache->nr_empty_slabs--;
+    obj = slab->freelist;
+    slab->freelist = *(void **)obj;
+    slab->nr_inuse++;
+    if (slab->nr_inuse == cache->nr_objects_per_slab) {
+        ASSERT(!slab->freelist);
+        ASSERT(list_fetch(&cache->slabs_partial) == &slab->list);
+    }
+    cache->nr_active_objects++;
+    return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache * cache, void * object)
+{
+    struct slab * slab = OBJECT_TO_SLAB(cache, object);
+    ASSERT(slab->magic == SLAB_MAGIC);
+    ASSERT(slab->cache == cache);
+    ASSERT(slab->nr_inuse);
+    ASSERT(!(((uint32_t)object - (uint32_t)slab - cache->object_offset) %
+        cache->object_stride));
+    if (slab->nr_inuse == cache->nr_objects_per_slab)
+        list_prepend(&cache->slabs_partial, &slab->list);
+    *(void **)object = slab->freelist;
+    slab->freelist = object;
+    slab->nr_inuse--;
+    cache->nr_active_objects--;
+    if (!slab->nr_inuse) {
+        if (cache->nr_empty_slabs >= KMEM_CACHE_MAX_EMPTY_SLABS) {
+            list_unlink(&cache->slabs_partial, &slab->list);
+            kmem_cache_release_slab(cache, slab);
+        } else {
+            cache->nr_empty_slabs++;
+        }
+    }
+}
+
+/*
+ * Destroy a cache, all the objects must be released before.
+ * return -ERR_BUSY if there are objects in use.
+ */
+int32_t
+kmem_cache_destroy(struct kmem_cache * cache)
+{
+    struct list_elem * _list = NULL;
+    struct slab * slab = NULL;
+    ASSERT(cache != &kmem_cache_boot);
+    if (cache->nr_active_objects)
+        return -ERR_BUSY;
+    while ((_list = list_fetch(&cache->slabs_partial))) {
+        slab = CONTAINER_OF(_list, struct slab, list);
+        kmem_cache_release_slab(cache, slab);
+    }
+    ASSERT(!cache->nr_slabs);
+    list_delete(&kmem_cache_head, &cache->list);
+    kmem_cache_free(&kmem_cache_boot, cache);
+    return OK;
+}
+
+/*
+ * the slab shrinker releases the empty slabs every cache keeps.
+ */
+static uint32_t
+kmem_cache_shrink(uint32_t nr_frames)
+{
+    uint32_t nr_reclaimed = 0;
+    struct list_elem * _cache_list;
+    struct list_elem * _list;
+    struct kmem_cache * cache;
+    struct slab * slab;
+    LIST_FOREACH_START(&kmem_cache_head, _cache_list) {
+        cache = CONTAINER_OF(_cache_list, struct kmem_cache, list);
+        if (!cache->nr_empty_slabs)
+            continue;
+        LIST_FOREACH_START(&cache->slabs_partial, _list) {
+            slab = CONTAINER_OF(_list, struct slab, list);
+            if (slab->nr_inuse)
+                continue;
+            list_unlink(&cache->slabs_partial, &slab->list);
+            kmem_cache_release_slab(cache, slab);
+            cache->nr_empty_slabs--;
+            nr_reclaimed += cache->nr_pages_per_slab;
+        }
+        LIST_FOREACH_END();
+        if (nr_reclaimed >= nr_frames)
+            break;
+    }
+    LIST_FOREACH_END();
+    return nr_reclaimed;
+}
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .shrink = kmem_cache_shrink,
+};
+
+void
+dump_kmem_caches(void)
+{
+    struct list_elem * _list = NULL;
+    struct kmem_cache * cache = NULL;
+    LOG_INFO("Dump kmem caches:\n");
+    LIST_FOREACH_START(&kmem_cache_head, _list) {
+        cache = CONTAINER_OF(_list, struct kmem_cache, list);
+        LOG_INFO("   kmem_cache:%s object size:%d(stride:%d) "
+            "slab pages:%d objects per slab:%d slabs:%d(empty:%d) "
+            "active objects:%d\n",
+            cache->name,
+            cache->object_size,
+            cache->object_stride,
+            cache->nr_pages_per_slab,
+            cache->nr_objects_per_slab,
+            cache->nr_slabs,
+            cache->nr_empty_slabs,
+            cache->nr_active_objects);
+    }
+    LIST_FOREACH_END();
+}
+
+#if defined(INLINE_TEST)
+static void
+slab_test(void)
+{
+#define _NR_TEST_OBJECTS 64
+    struct kmem_cache * cache = NULL;
+    uint8_t * objs[_NR_TEST_OBJECTS];
+    int idx = 0;
+    cache = kmem_cache_create((const uint8_t *)"slab-test", 100, 32);
+    ASSERT(cache);
+    ASSERT(cache->object_stride == 128);
+    for (idx = 0; idx < _NR_TEST_OBJECTS; idx++) {
+        objs[idx] = kmem_cache_alloc(cache);
+        ASSERT(objs[idx]);
+        ASSERT(!(((uint32_t)objs[idx]) & 31));
+        memset(objs[idx], idx, 100);
+    }
+    ASSERT(cache->nr_active_objects == _NR_TEST_OBJECTS);
+    for (idx = 0; idx < _NR_TEST_OBJECTS; idx++) {
+        ASSERT(objs[idx][0] == idx && objs[idx][99] == idx);
+        kmem_cache_free(cache, objs[idx]);
+    }
+    ASSERT(!cache->nr_active_objects);
+    ASSERT(cache->nr_slabs <= KMEM_CACHE_MAX_EMPTY_SLABS);
+    ASSERT(kmem_cache_destroy(cache) == OK);
+#undef _NR_TEST_OBJECTS
+}
+#endif
+
+void
+slab_init(void)
+{
+    memset(slab_space_bitmap, 0x0, sizeof(slab_space_bitmap));
+    list_init(&kmem_cache_head);
+    ASSERT(!kmem_cache_setup(&kmem_cache_boot,
+        (const uint8_t *)"kmem_cache",
+        sizeof(struct kmem_cache),
+        KMEM_CACHE_MIN_ALIGN));
+    register_shrinker(&slab_shrinker);
+    LOG_INFO("Slab space: 0x%x - 0x%x\n", SLAB_SPACE_BOTTOM, SLAB_SPACE_TOP);
+#if defined(INLINE_TEST)
+    slab_test();
+#endif
+}
@@ -47,7 +47,9 @@ uint32_t register_ethernet_device(uint8_t * name,
     if (device_index < 0) {
         return -ERR_OUT_OF_RESOURCE;
     }
-    ASSERT((ethdev = malloc_mapped(sizeof(struct ethernet_device))));
+    ethdev = malloc_mapped(sizeof(struct ethernet_device));
+    if (!ethdev)
+        return -ERR_OUT_OF_MEMORY;
     memset(ethdev, 0x0, sizeof(struct ethernet_device));
     strcpy_safe(ethdev->name, name, sizeof(ethdev->name));
     ethdev->device_index = device_index;
@@ -58,7 +60,10 @@ uint32_t register_ethernet_device(uint8_t * name,
         0x0,
         &net_dev_file_ops,
         ethdev);
-    ASSERT(ethdev->net_dev_file);
+    if (!ethdev->net_dev_file) {
+        free(ethdev);
+        return -ERR_OUT_OF_RESOURCE;
+    }
     LOG_INFO("Register ethernet device: %s [ops:0x%x] as port %d\n",
         name, net_ops, device_index);
     ether_devs[device_index] = ethdev;
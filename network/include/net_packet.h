@@ -60,6 +60,9 @@ get_packet(void);
 void
 put_packet(struct packet * pkt);
 
+void
+packet_pool_benchmark(void);
+
 void
 net_packet_init(void);
 #endif
@@ -6,6 +6,7 @@
 #include <x86/include/ioport.h>
 #include <memory/include/malloc.h>
 #include <memory/include/paging.h>
+#include <memory/include/buddy.h>
 #include <memory/include/kernel_vma.h>
 #include <lib/include/string.h>
 #include <network/include/net_packet.h>
@@ -109,6 +110,15 @@ virtio_net_device_virt_queue_setup(struct pci_device * pdev, int vq_index)
             pdev->function,
             vq_index);
         ASSERT((phy_queue_base = get_pages(size_virtq >> 12)));
+        {
+            // the rings are accessed by the device, they never move.
+            uint32_t frame;
+            for (frame = phy_queue_base;
+                frame < (phy_queue_base + size_virtq);
+                frame += PAGE_SIZE)
+                set_page_frame_flags(frame,
+                    PAGE_FRAME_KERNEL | PAGE_FRAME_PINNED);
+        }
         ASSERT((virt_queue_base = kernel_map_vma(vma_mapping_name,
             1,
             1,
@@ -78,4 +78,42 @@ getdents(uint8_t * path,
 uint32_t
 gettaskents(struct taskent * taskp, int32_t count);
 
+int32_t
+fork(void);
+
+void *
+mmap(void * addr,
+    uint32_t length,
+    int32_t prot,
+    int32_t flags,
+    int32_t fd,
+    uint32_t offset);
+
+int32_t
+munmap(void * addr, uint32_t length);
+
+int32_t
+mprotect(void * addr, uint32_t length, int32_t prot);
+
+/*
+ * set the priority of a task, or of the calling task if task_id is
+ * negative, TASK_PRIORITY_HIGHEST(0) to TASK_PRIORITY_LOWEST(7).
+ */
+int32_t
+settaskpriority(int32_t task_id, int32_t priority);
+
+/*
+ * read the monotonic clock in nanosecond resolution, clock_id must be
+ * CLOCK_MONOTONIC.
+ */
+int32_t
+clock_gettime(int32_t clock_id, struct timespec * tp);
+
+/*
+ * sleep with the high resolution timers, the remaining time is stored in
+ * rem if the sleep is interrupted by a signal.
+ */
+int32_t
+nanosleep(const struct timespec * req, struct timespec * rem);
+
 #endif
@@ -162,3 +162,58 @@ gettaskents(struct taskent * taskp, int32_t count)
 {
     return do_system_call2(SYS_GETTASKENTS_IDX, (uint32_t)taskp, count);
 }
+
+int32_t
+fork(void)
+{
+    return do_system_call0(SYS_FORK_IDX);
+}
+
+void *
+mmap(void * addr,
+    uint32_t length,
+    int32_t prot,
+    int32_t flags,
+    int32_t fd,
+    uint32_t offset)
+{
+    struct mmap_args args = {
+        .addr = (uint32_t)addr,
+        .length = length,
+        .prot = prot,
+        .flags = flags,
+        .fd = fd,
+        .offset = offset,
+    };
+    return (void *)do_system_call1(SYS_MMAP_IDX, (uint32_t)&args);
+}
+
+int32_t
+munmap(void * addr, uint32_t length)
+{
+    return do_system_call2(SYS_MUNMAP_IDX, (uint32_t)addr, length);
+}
+
+int32_t
+mprotect(void * addr, uint32_t length, int32_t prot)
+{
+    return do_system_call3(SYS_MPROTECT_IDX, (uint32_t)addr, length, prot);
+}
+
+int32_t
+settaskpriority(int32_t task_id, int32_t priority)
+{
+    return do_system_call2(SYS_SETTASKPRIORITY_IDX, task_id, priority);
+}
+
+int32_t
+clock_gettime(int32_t clock_id, struct timespec * tp)
+{
+    return do_system_call2(SYS_CLOCK_GETTIME_IDX, clock_id, (uint32_t)tp);
+}
+
+int32_t
+nanosleep(const struct timespec * req, struct timespec * rem)
+{
+    return do_system_call2(SYS_NANOSLEEP_IDX, (uint32_t)req, (uint32_t)rem);
+}
@@ -119,6 +119,30 @@ cli(void)
     asm volatile("cli;");
 }
 
+/*
+ * disable the interrupts and return the previous eflags, the interrupts are
+ * enabled again by local_irq_restore() only if they were enabled before.
+ */
+static inline uint32_t
+local_irq_save(void)
+{
+    uint32_t eflags;
+    asm volatile("pushfl;"
+        "popl %0;"
+        "cli;"
+        :"=r"(eflags)
+        :
+        :"memory");
+    return eflags;
+}
+
+static inline void
+local_irq_restore(uint32_t eflags)
+{
+    if (eflags & EFLAGS_INTERRUPT)
+        sti();
+}
+
 static inline void
 hlt(void)
 {
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ */
+#ifndef _LAPIC_H
+#define _LAPIC_H
+#include <lib/include/types.h>
+
+#define LAPIC_TIMER_VECTOR 0xf0
+// the lower 4 bits of the spurious vector must be all set on P6 family
+#define LAPIC_SPURIOUS_VECTOR 0xef
+
+/*
+ * map and software-enable the local APIC, the timer is left masked until
+ * it's calibrated. The legacy PIC keeps delivering the device interrupts.
+ */
+void
+lapic_init(void);
+
+/*
+ * the calibration window is measured by the PIT, lapic_timer_calibrate_start
+ * and lapic_timer_calibrate_end are called at the two ends of it.
+ */
+void
+lapic_timer_calibrate_start(void);
+
+void
+lapic_timer_calibrate_end(uint32_t window_ms);
+
+/*
+ * whether the local APIC timer can be used as the one-shot event device.
+ */
+int32_t
+lapic_timer_ready(void);
+
+/*
+ * fire LAPIC_TIMER_VECTOR once delta_ns nanoseconds later, a previously
+ * programmed event is overridden.
+ */
+void
+lapic_timer_program(uint64_t delta_ns);
+
+#endif
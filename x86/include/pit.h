@@ -12,4 +12,18 @@
 
 #define OSCILLATPR_CHIP_FREQUENCY 1193182
 void pit_init(void);
+
+/*
+ * stop the periodic tick until the earliest timer expires, called by the
+ * idle task with interrupt disabled when no task is runnable.
+ */
+void
+tick_nohz_idle_enter(void);
+
+/*
+ * called on every interrupt, an interrupt which wakes the cpu up from the
+ * tickless idle restarts the tick and catches jiffies up.
+ */
+void
+tick_nohz_irq_enter(int vector);
 #endif
@@ -10,6 +10,27 @@
 // pipeline, it's supposed to be highly precise.
 
 #include <lib/include/types.h>
-// TODO
+
+static inline uint64_t
+rdtsc(void)
+{
+    uint32_t low;
+    uint32_t high;
+    asm volatile("rdtsc;"
+        :"=a"(low), "=d"(high));
+    return (((uint64_t)high) << 32) | low;
+}
+
+/*
+ * the number of TSC cycles per milisecond, it's calibrated against the PIT
+ * shortly after the timer starts and it's 0 until then.
+ */
+extern uint32_t tsc_khz;
+
+static inline uint64_t
+tsc_to_ms(uint64_t cycles)
+{
+    return tsc_khz ? div_u64_u32(cycles, tsc_khz) : 0;
+}
 
 #endif
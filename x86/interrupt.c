@@ -8,6 +8,7 @@
 #include <x86/include/ioport.h>
 #include <kernel/include/printk.h>
 #include <lib/include/list.h>
+#include <x86/include/pit.h>
 
 static struct interrupt_gate_entry IDT[IDT_SIZE] __attribute__((aligned(8)));
 // one vector can not map to more than one device
@@ -132,6 +133,7 @@ uint32_t interrupt_handler(struct x86_cpustate * cpu)
     int_handler * device_interrup_handler = NULL;
     int vector = cpu->vector;
     ASSERT(((vector >= 0) && (vector < IDT_SIZE)));
+    tick_nohz_irq_enter(vector);
     // pre-interrupt handler
     task_pre_interrupt_handler(cpu);
     device_interrup_handler = handlers[vector];
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2018 Jie Zheng
+ * The local APIC timer is the one-shot event device of the high resolution
+ * timers, the periodic tick stays on the PIT.
+ */
+#include <x86/include/lapic.h>
+#include <x86/include/interrupt.h>
+#include <x86/include/tsc.h>
+#include <memory/include/paging.h>
+#include <memory/include/kernel_vma.h>
+#include <kernel/include/printk.h>
+#include <kernel/include/clocksource.h>
+#include <kernel/include/hrtimer.h>
+
+#define CPUID_EDX_APIC (1 << 9)
+#define CPUID_ECX_TSC_DEADLINE (1 << 24)
+
+#define MSR_IA32_APIC_BASE 0x1b
+#define MSR_IA32_TSC_DEADLINE 0x6e0
+#define APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_REG_EOI 0xb0
+#define LAPIC_REG_SVR 0xf0
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_LVT_LINT0 0x350
+#define LAPIC_REG_LVT_LINT1 0x360
+#define LAPIC_REG_TIMER_INITIAL_COUNT 0x380
+#define LAPIC_REG_TIMER_CURRENT_COUNT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_LVT_DELIVERY_NMI (0x4 << 8)
+#define LAPIC_LVT_DELIVERY_EXTINT (0x7 << 8)
+#define LAPIC_LVT_TIMER_ONESHOT (0x0 << 17)
+#define LAPIC_LVT_TIMER_TSC_DEADLINE (0x2 << 17)
+// the timer counts down at bus frequency / 16
+#define LAPIC_TIMER_DIVIDE_BY_16 0x3
+
+// a farther event is programmed in steps, the counters never overflow.
+#define LAPIC_TIMER_MAX_DELTA_NS ((uint64_t)NSEC_PER_SEC)
+
+static uint32_t lapic_base = 0;
+static int32_t tsc_deadline = 0;
+static uint32_t lapic_timer_khz = 0;
+static int32_t __lapic_timer_ready = 0;
+
+static void
+cpuid(uint32_t leaf, uint32_t * ecx, uint32_t * edx)
+{
+    uint32_t eax = leaf;
+    uint32_t ebx;
+    asm volatile("cpuid;"
+        :"+a"(eax), "=b"(ebx), "=c"(*ecx), "=d"(*edx));
+}
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+    uint32_t low;
+    uint32_t high;
+    asm volatile("rdmsr;"
+        :"=a"(low), "=d"(high)
+        :"c"(msr));
+    return (((uint64_t)high) << 32) | low;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr;"
+        :
+        :"c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint32_t
+lapic_read(uint32_t reg)
+{
+    return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+static inline void
+lapic_write(uint32_t reg, uint32_t value)
+{
+    *(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+int32_t
+lapic_timer_ready(void)
+{
+    return __lapic_timer_ready;
+}
+
+void
+lapic_timer_program(uint64_t delta_ns)
+{
+    uint64_t count;
+    ASSERT(__lapic_timer_ready);
+    if (delta_ns > LAPIC_TIMER_MAX_DELTA_NS)
+        delta_ns = LAPIC_TIMER_MAX_DELTA_NS;
+    if (tsc_deadline) {
+        count = div_u64_u32(delta_ns * tsc_khz, NSEC_PER_MSEC);
+        wrmsr(MSR_IA32_TSC_DEADLINE, rdtsc() + count + 1);
+    } else {
+        count = div_u64_u32(delta_ns * lapic_timer_khz, NSEC_PER_MSEC);
+        lapic_write(LAPIC_REG_TIMER_INITIAL_COUNT,
+            count ? (uint32_t)count : 1);
+    }
+}
+
+void
+lapic_timer_calibrate_start(void)
+{
+    if (!lapic_base)
+        return;
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_REG_LVT_TIMER,
+        LAPIC_LVT_MASKED | LAPIC_LVT_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL_COUNT, 0xffffffff);
+}
+
+void
+lapic_timer_calibrate_end(uint32_t window_ms)
+{
+    uint32_t elapsed;
+    if (!lapic_base)
+        return;
+    elapsed = 0xffffffff - lapic_read(LAPIC_REG_TIMER_CURRENT_COUNT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL_COUNT, 0);
+    lapic_timer_khz = elapsed / window_ms;
+    if (tsc_deadline && tsc_khz) {
+        lapic_write(LAPIC_REG_LVT_TIMER,
+            LAPIC_LVT_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+    } else if (lapic_timer_khz) {
+        tsc_deadline = 0;
+        lapic_write(LAPIC_REG_LVT_TIMER,
+            LAPIC_LVT_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    } else {
+        LOG_WARN("Local APIC timer is not counting\n");
+        return;
+    }
+    __lapic_timer_ready = 1;
+    LOG_INFO("Local APIC timer: %d KHz, %s mode\n", lapic_timer_khz,
+        tsc_deadline ? "TSC-deadline" : "one-shot");
+}
+
+static uint32_t
+lapic_timer_handler(struct x86_cpustate * cpu)
+{
+    uint32_t esp = (uint32_t)cpu;
+    lapic_write(LAPIC_REG_EOI, 0);
+    hrtimer_interrupt();
+    return esp;
+}
+
+static uint32_t
+lapic_spurious_handler(struct x86_cpustate * cpu)
+{
+    // no EOI for a spurious interrupt
+    return (uint32_t)cpu;
+}
+
+void
+lapic_init(void)
+{
+    uint32_t ecx;
+    uint32_t edx;
+    uint64_t apic_base_msr;
+    cpuid(1, &ecx, &edx);
+    if (!(edx & CPUID_EDX_APIC)) {
+        LOG_INFO("No local APIC, high resolution timers run on the tick\n");
+        return;
+    }
+    tsc_deadline = !!(ecx & CPUID_ECX_TSC_DEADLINE);
+    apic_base_msr = rdmsr(MSR_IA32_APIC_BASE);
+    if (!(apic_base_msr & APIC_BASE_ENABLE)) {
+        apic_base_msr |= APIC_BASE_ENABLE;
+        wrmsr(MSR_IA32_APIC_BASE, apic_base_msr);
+    }
+    ASSERT((lapic_base = kernel_map_vma((uint8_t *)"Local APIC",
+        1,
+        1,
+        PAGE_ALIGN((uint32_t)apic_base_msr),
+        PAGE_SIZE,
+        PAGE_PERMISSION_READ_WRITE,
+        PAGE_WRITETHROUGH,
+        PAGE_CACHE_DISABLED)));
+    register_interrupt_handler(LAPIC_TIMER_VECTOR,
+        lapic_timer_handler,
+        "Local APIC timer");
+    register_interrupt_handler(LAPIC_SPURIOUS_VECTOR,
+        lapic_spurious_handler,
+        "Local APIC spurious interrupt");
+    // virtual wire mode: the 8259 PIC is wired to LINT0 and NMI to LINT1.
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_DELIVERY_EXTINT);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_DELIVERY_NMI);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    LOG_INFO("Local APIC at 0x%x(mapped at 0x%x)%s\n",
+        PAGE_ALIGN((uint32_t)apic_base_msr),
+        lapic_base,
+        tsc_deadline ? ", TSC-deadline supported" : "");
+}
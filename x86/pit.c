@@ -11,12 +11,48 @@
 #include <kernel/include/task.h>
 #include <kernel/include/jiffies.h>
 #include <kernel/include/timer.h>
+#include <x86/include/tsc.h>
+#include <x86/include/lapic.h>
+#include <kernel/include/hrtimer.h>
+#include <kernel/include/clocksource.h>
 
 #define TIMER_RESOLUTION_HZ HZ
 #define PIT_CHANNEL0_INTERRUPT_VECTOR (0x20 + 0)
 
 static uint32_t pit_ticks = 0;
 uint64_t jiffies = 0;
+uint32_t tsc_khz = 0;
+
+/*
+ * count the TSC cycles elapsed over TSC_CALIBRATION_TICKS PIT ticks, the
+ * first tick is skipped as the PIT may be programmed in the middle of a tick.
+ * The local APIC timer is calibrated in the same window.
+ */
+#define TSC_CALIBRATION_TICKS 100
+static uint64_t tsc_calibration_start;
+
+static struct clocksource tsc_clocksource = {
+    .name = "tsc",
+    .read = rdtsc,
+    .rating = 300,
+};
+
+static void
+calibrate_tsc(void)
+{
+    uint32_t window_ms = TSC_CALIBRATION_TICKS * 1000 / TIMER_RESOLUTION_HZ;
+    if (pit_ticks == 1) {
+        tsc_calibration_start = rdtsc();
+        lapic_timer_calibrate_start();
+    } else if (pit_ticks == (1 + TSC_CALIBRATION_TICKS)) {
+        tsc_khz = (uint32_t)div_u64_u32(rdtsc() - tsc_calibration_start,
+            window_ms);
+        LOG_INFO("TSC frequency: %d KHz\n", tsc_khz);
+        tsc_clocksource.khz = tsc_khz;
+        register_clocksource(&tsc_clocksource);
+        lapic_timer_calibrate_end(window_ms);
+    }
+}
 
 static void
 refresh_pit_channel0(void)
@@ -27,15 +63,126 @@ refresh_pit_channel0(void)
     outb(PIT_CHANNEL0_PORT, (divisor >> 8) & 0xff);
 }
 
+/*
+ * NO_HZ idle: when nothing is runnable, the idle task stops the periodic
+ * tick until the earliest timer expiry. With the local APIC timer, the PIT
+ * is halted and the expiry is an hrtimer on the APIC, no wakeup at all is
+ * needed if no timer is pending. Otherwise channel0 is programmed in
+ * one-shot mode(mode 0), its 16-bit counter limits a one-shot to
+ * PIT_MAX_IDLE_TICKS.
+ * The first interrupt after that catches jiffies up with the TSC cycles
+ * elapsed since the last tick and restarts the periodic tick.
+ */
+#define PIT_MAX_IDLE_TICKS \
+    (0xffff / (OSCILLATPR_CHIP_FREQUENCY / TIMER_RESOLUTION_HZ))
+
+static int32_t tick_stopped = 0;
+// the TSC when jiffies was last advanced
+static uint64_t tick_tsc = 0;
+
+static void
+tick_nohz_timer_callback(struct hrtimer * hrtimer, void * priv)
+{
+    // nothing to do, the interrupt which fires it restarts the tick.
+}
+
+static struct hrtimer tick_nohz_timer = {
+    .callback = tick_nohz_timer_callback,
+};
+
+static void
+program_pit_channel0_oneshot(uint32_t ticks)
+{
+    int divisor = ticks * (OSCILLATPR_CHIP_FREQUENCY / TIMER_RESOLUTION_HZ);
+    outb(PIT_CONTROL_PORT, 0x0 | 0x30);
+    outb(PIT_CHANNEL0_PORT, divisor & 0xff);
+    outb(PIT_CHANNEL0_PORT, (divisor >> 8) & 0xff);
+}
+
+/*
+ * In mode 0, the counter stops until a new count is written, no interrupt
+ * is raised meanwhile.
+ */
+static void
+halt_pit_channel0(void)
+{
+    outb(PIT_CONTROL_PORT, 0x0 | 0x30);
+}
+
+void
+tick_nohz_idle_enter(void)
+{
+    uint64_t expiry;
+    uint64_t ticks = 0;
+    // jiffies can only be caught up with a calibrated TSC
+    if (tick_stopped || !tsc_khz)
+        return;
+    // the high resolution timers expire at the tick without an event device
+    if (hrtimer_pending() && !lapic_timer_ready())
+        return;
+    if (timer_next_expiry(&expiry) == OK) {
+        if (expiry <= jiffies)
+            return;
+        ticks = expiry - jiffies;
+        // not worth it if the next tick is due anyway
+        if (ticks <= 1)
+            return;
+    }
+    if (lapic_timer_ready()) {
+        if (ticks) {
+            tick_nohz_timer.expires = ktime_get_ns() +
+                ticks * (NSEC_PER_SEC / TIMER_RESOLUTION_HZ);
+            register_hrtimer(&tick_nohz_timer);
+        }
+        halt_pit_channel0();
+    } else {
+        if (!ticks || ticks > PIT_MAX_IDLE_TICKS)
+            ticks = PIT_MAX_IDLE_TICKS;
+        program_pit_channel0_oneshot((uint32_t)ticks);
+    }
+    tick_stopped = 1;
+}
+
+static void
+tick_nohz_restart(void)
+{
+    uint32_t cycles_per_tick =
+        (uint32_t)div_u64_u32((uint64_t)tsc_khz * 1000, TIMER_RESOLUTION_HZ);
+    uint64_t ticks = div_u64_u32(rdtsc() - tick_tsc, cycles_per_tick);
+    jiffies += ticks;
+    tick_tsc += ticks * cycles_per_tick;
+    if (!hrtimer_detached(&tick_nohz_timer))
+        cancel_hrtimer(&tick_nohz_timer);
+    refresh_pit_channel0();
+    tick_stopped = 0;
+}
+
+void
+tick_nohz_irq_enter(int vector)
+{
+    // the PIT handler restarts the tick itself
+    if (tick_stopped && vector != PIT_CHANNEL0_INTERRUPT_VECTOR)
+        tick_nohz_restart();
+}
+
 static uint32_t
 pit_handler(struct x86_cpustate * _cpu __used)
 {
     uint32_t esp = (uint32_t)_cpu;
     pit_ticks++;
-    jiffies++;
+    if (tick_stopped) {
+        tick_nohz_restart();
+    } else {
+        jiffies++;
+        tick_tsc = rdtsc();
+    }
+    if (!tsc_khz)
+        calibrate_tsc();
     // Schedule timers which is measured by Jiffies variable.
     // the timer resolution is 1 milisecond as it ticks with HZ = 1000
     schedule_timer();
+    if (!lapic_timer_ready())
+        hrtimer_interrupt();
     // Schedule tasks every 2 miliseconds, note we set HZ is 1000
     if (((pit_ticks % 2) == 0) && ready_to_schedule()) {
         esp = schedule(_cpu);
@@ -11,26 +11,37 @@
 //#define KERNEL_LOGGING_LEVEL LOG_DEBUG
 #define KERNEL_LOGGING_LEVEL LOG_INFO
 /*
- *KERNEL_VMA_ARRAY_LENGTH is the length of kernel VMA array, this is
- *to be larger than 64
+ *KERNEL_VMA_BOOTSTRAP_LENGTH is the number of kernel VMAs which can be
+ *registered before kernel heap is ready, the later ones are allocated
+ *from kernel heap.
  */
-#define KERNEL_VMA_ARRAY_LENGTH 1024
+#define KERNEL_VMA_BOOTSTRAP_LENGTH 16
+
+/*
+ * map the kernel identity ranges and large mapped heap allocations with 4MB
+ * pages when the CPU supports PSE, comment it out to use 4KB pages only.
+ */
+#define KERNEL_LARGE_PAGE 1
 
 
 /*
  * page space bottom set to 0x4000000, i.e. 64MB
  * Kernel heap bottom set to 0x8000000, i.e. 128MB
  * kernel heap top set to 0x1F000000 : 496MB
- * kernel stack bottom set to 0x1F000000 : 496MB
- * while kernel stack top is set to 0x20000000, i.e. 512 MB
+ * kernel slab space bottom set to 0x1F000000 : 496MB
+ * while kernel slab space top is set to 0x20000000, i.e. 512 MB
+ * kernel scratch space which temporarily maps physical frames into kernel
+ * is [512MB, 516MB)
  */
 
 #define PAGE_SPACE_BOTTOM 0x4000000
 #define PAGE_SPACE_TOP 0x8000000
 #define KERNEL_HEAP_BOTTOM PAGE_SPACE_TOP
 #define KERNEL_HEAP_TOP 0x1F000000
-//#define KERNEL_STACK_BOTTOM KERNEL_HEAP_TOP
-//#define KERNEL_STACK_TOP 0x20000000
+#define SLAB_SPACE_BOTTOM KERNEL_HEAP_TOP
+#define SLAB_SPACE_TOP 0x20000000
+#define KERNEL_SCRATCH_BOTTOM SLAB_SPACE_TOP
+#define KERNEL_SCRATCH_TOP 0x20400000
 
 
 /*
@@ -85,6 +96,13 @@
 #define USERSPACE_SIGNAL_STACK_TOP \
     (USERSPACE_STACK_TOP + DEFAULT_TASK_NON_PRIVILEGED_SIGNAL_STACK_SIZE)
 
+/*
+ * the memory mappings created by mmap() are placed in
+ * [USERSPACE_MMAP_BOTTOM, USERSPACE_MMAP_TOP)
+ */
+#define USERSPACE_MMAP_BOTTOM USERSPACE_SIGNAL_STACK_TOP
+#define USERSPACE_MMAP_TOP USERSPACE_TOP
+
 
 /*
  * enable/disable task preemption